@@ -1,11 +1,19 @@
 #include "FormulaAST.h"
 
+#include "aggregates.h"
+#include "number_codec.h"
+
+#ifdef SPREADSHEET_WITH_ANTLR
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#endif
 
+#include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cmath>
+#include <iterator>
 #include <limits>
 #include <memory>
 #include <optional>
@@ -68,17 +76,62 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+namespace {
+constexpr std::pair<Function, std::string_view> FUNCTION_NAMES[] = {
+    {Function::Sum, "SUM"},
+    {Function::Min, "MIN"},
+    {Function::Max, "MAX"},
+    {Function::Average, "AVERAGE"},
+    {Function::Count, "COUNT"},
+};
+
+std::string_view GetFunctionName(Function function) {
+    return FUNCTION_NAMES[static_cast<int>(function)].second;
+}
+
+std::optional<Function> FindFunction(std::string_view name) {
+    for (const auto& [function, function_name] : FUNCTION_NAMES) {
+        if (function_name == name) {
+            return function;
+        }
+    }
+    return std::nullopt;
+}
+
+Range ShiftRange(const Range& offset, Position anchor) {
+    return Range{ShiftPosition(offset.first, anchor), ShiftPosition(offset.last, anchor)};
+}
+
+double CheckArithmetic(double result) {
+    if (!std::isfinite(result)) {
+        throw FormulaError(FormulaError::Category::Arithmetic);
+    }
+    return result;
+}
+}  // namespace
+
 class Expr {
 public:
     virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const std::function<double(Position)> lmbd) const = 0;
+    // Cell positions in the tree are offsets from anchor; an absolute tree has a zero anchor.
+    virtual void Print(std::ostream& out, Position anchor) const = 0;
+    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position anchor) const = 0;
+    virtual double Evaluate(const std::function<double(Position)>& lmbd, const RangeValues& range_values,
+                            Position anchor) const = 0;
+    // Appends the postfix code of the subtree.
+    virtual void Compile(std::vector<Instruction>& code) const = 0;
+    // Appends the postfix form of the subtree.
+    virtual void Serialize(std::vector<PostfixNode>& nodes) const = 0;
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+    // The range of a range operand, nullptr for any other expression.
+    virtual const Range* GetRange() const {
+        return nullptr;
+    }
+
+    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position anchor,
                       bool right_child = false) const {
         auto precedence = GetPrecedence();
         auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -87,7 +140,7 @@ public:
             out << '(';
         }
 
-        DoPrintFormula(out, precedence);
+        DoPrintFormula(out, precedence, anchor);
 
         if (parens_needed) {
             out << ')';
@@ -112,18 +165,18 @@ public:
         , rhs_(std::move(rhs)) {
     }
 
-    void Print(std::ostream& out) const override {
+    void Print(std::ostream& out, Position anchor) const override {
         out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
+        lhs_->Print(out, anchor);
         out << ' ';
-        rhs_->Print(out);
+        rhs_->Print(out, anchor);
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position anchor) const override {
+        lhs_->PrintFormula(out, precedence, anchor);
         out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+        rhs_->PrintFormula(out, precedence, anchor, /* right_child = */ true);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -145,10 +198,11 @@ public:
 
 // Реализуйте метод Evaluate() для бинарных операций.
 // При делении на 0 выбрасывайте ошибку вычисления FormulaError
-    double Evaluate(const std::function<double(Position)> lmbd) const override {
+    double Evaluate(const std::function<double(Position)>& lmbd, const RangeValues& range_values,
+                    Position anchor) const override {
         double result = .0;
-        double lhs = lhs_->Evaluate(lmbd);
-        double rhs = rhs_->Evaluate(lmbd);
+        double lhs = lhs_->Evaluate(lmbd, range_values, anchor);
+        double rhs = rhs_->Evaluate(lmbd, range_values, anchor);
         ASTImpl::ExprPrecedence precendence = GetPrecedence();
 
         switch (precendence)
@@ -175,6 +229,48 @@ public:
         return result;
     }
 
+    void Compile(std::vector<Instruction>& code) const override {
+        lhs_->Compile(code);
+        rhs_->Compile(code);
+        Instruction instruction{};
+        switch (type_) {
+            case Add:
+                instruction.op = Instruction::OpCode::Add;
+                break;
+            case Subtract:
+                instruction.op = Instruction::OpCode::Subtract;
+                break;
+            case Multiply:
+                instruction.op = Instruction::OpCode::Multiply;
+                break;
+            case Divide:
+                instruction.op = Instruction::OpCode::Divide;
+                break;
+        }
+        code.push_back(instruction);
+    }
+
+    void Serialize(std::vector<PostfixNode>& nodes) const override {
+        lhs_->Serialize(nodes);
+        rhs_->Serialize(nodes);
+        PostfixNode node;
+        switch (type_) {
+            case Add:
+                node.type = PostfixNode::Type::Add;
+                break;
+            case Subtract:
+                node.type = PostfixNode::Type::Subtract;
+                break;
+            case Multiply:
+                node.type = PostfixNode::Type::Multiply;
+                break;
+            case Divide:
+                node.type = PostfixNode::Type::Divide;
+                break;
+        }
+        nodes.push_back(node);
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> lhs_;
@@ -194,15 +290,15 @@ public:
         , operand_(std::move(operand)) {
     }
 
-    void Print(std::ostream& out) const override {
+    void Print(std::ostream& out, Position anchor) const override {
         out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
+        operand_->Print(out, anchor);
         out << ')';
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position anchor) const override {
         out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+        operand_->PrintFormula(out, precedence, anchor);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -210,15 +306,16 @@ public:
     }
 
 // Реализуйте метод Evaluate() для унарных операций.
-    double Evaluate(const std::function<double(Position)> lmbd) const override {
+    double Evaluate(const std::function<double(Position)>& lmbd, const RangeValues& range_values,
+                    Position anchor) const override {
         double result = .0;
         switch (type_)
         {
         case UnaryPlus:
-            result = operand_->Evaluate(lmbd);
+            result = operand_->Evaluate(lmbd, range_values, anchor);
             break;
         case UnaryMinus:
-            result = -(operand_->Evaluate(lmbd));
+            result = -(operand_->Evaluate(lmbd, range_values, anchor));
             break;
         default:
             break;
@@ -226,6 +323,22 @@ public:
         return result;
     }
 
+    void Compile(std::vector<Instruction>& code) const override {
+        operand_->Compile(code);
+        if (type_ == UnaryMinus) {
+            Instruction instruction{};
+            instruction.op = Instruction::OpCode::Negate;
+            code.push_back(instruction);
+        }
+    }
+
+    void Serialize(std::vector<PostfixNode>& nodes) const override {
+        operand_->Serialize(nodes);
+        PostfixNode node;
+        node.type = type_ == UnaryMinus ? PostfixNode::Type::UnaryMinus : PostfixNode::Type::UnaryPlus;
+        nodes.push_back(node);
+    }
+
 private:
     Type type_;
     std::unique_ptr<Expr> operand_;
@@ -237,27 +350,45 @@ public:
         : cell_(cell) {
     }
 
-    void Print(std::ostream& out) const override {
-        if (!cell_->IsValid()) {
+    void Print(std::ostream& out, Position anchor) const override {
+        Position cell = ShiftPosition(*cell_, anchor);
+        if (!cell.IsValid()) {
             out << FormulaError::Category::Ref;
         } else {
-            out << cell_->ToString();
+            char buffer[Position::MAX_STRING_LENGTH];
+            out.write(buffer, cell.ToChars(buffer) - buffer);
         }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position anchor) const override {
+        Print(out, anchor);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(const std::function<double(Position)> lmbd) const override {
-        if (!cell_->IsValid()) {
+    double Evaluate(const std::function<double(Position)>& lmbd, const RangeValues& /* range_values */,
+                    Position anchor) const override {
+        Position cell = ShiftPosition(*cell_, anchor);
+        if (!cell.IsValid()) {
             throw FormulaError(FormulaError::Category::Ref);
         }
-        return lmbd(*cell_);
+        return lmbd(cell);
+    }
+
+    void Compile(std::vector<Instruction>& code) const override {
+        Instruction instruction{};
+        instruction.op = Instruction::OpCode::Cell;
+        instruction.cell = cell_;
+        code.push_back(instruction);
+    }
+
+    void Serialize(std::vector<PostfixNode>& nodes) const override {
+        PostfixNode node;
+        node.type = PostfixNode::Type::Cell;
+        node.cell = *cell_;
+        nodes.push_back(node);
     }
 
 private:
@@ -270,12 +401,12 @@ public:
         : value_(value) {
     }
 
-    void Print(std::ostream& out) const override {
-        out << value_;
+    void Print(std::ostream& out, Position /* anchor */) const override {
+        out << FormatNumber(value_);
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position /* anchor */) const override {
+        out << FormatNumber(value_);
     }
 
     ExprPrecedence GetPrecedence() const override {
@@ -283,14 +414,542 @@ public:
     }
 
     // Для чисел метод возвращает значение числа.
-    double Evaluate(const std::function<double(Position)> lmbd) const override {
+    double Evaluate(const std::function<double(Position)>& lmbd, const RangeValues& /* range_values */,
+                    Position /* anchor */) const override {
         return value_;
     }
 
+    void Compile(std::vector<Instruction>& code) const override {
+        Instruction instruction{};
+        instruction.op = Instruction::OpCode::Number;
+        instruction.number = value_;
+        code.push_back(instruction);
+    }
+
+    void Serialize(std::vector<PostfixNode>& nodes) const override {
+        PostfixNode node;
+        node.type = PostfixNode::Type::Number;
+        node.number = value_;
+        nodes.push_back(node);
+    }
+
 private:
     double value_;
 };
 
+// A range argument of a function; it has no value of its own.
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(const Range* range)
+        : range_(range) {
+    }
+
+    void Print(std::ostream& out, Position anchor) const override {
+        Range range = ShiftRange(*range_, anchor);
+        if (!range.IsValid()) {
+            out << FormulaError::Category::Ref;
+            return;
+        }
+        char buffer[2 * Position::MAX_STRING_LENGTH + 1];
+        char* end = range.first.ToChars(buffer);
+        *end++ = ':';
+        end = range.last.ToChars(end);
+        out.write(buffer, end - buffer);
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position anchor) const override {
+        Print(out, anchor);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    const Range* GetRange() const override {
+        return range_;
+    }
+
+    // The parsers accept ranges only as function arguments.
+    double Evaluate(const std::function<double(Position)>& /* lmbd */, const RangeValues& /* range_values */,
+                    Position /* anchor */) const override {
+        throw FormulaError(FormulaError::Category::Value);
+    }
+
+    // FunctionExpr reads its ranges itself.
+    void Compile(std::vector<Instruction>& /* code */) const override {
+        assert(false);
+    }
+
+    void Serialize(std::vector<PostfixNode>& nodes) const override {
+        PostfixNode node;
+        node.type = PostfixNode::Type::Range;
+        node.cell = range_->first;
+        node.last = range_->last;
+        nodes.push_back(node);
+    }
+
+private:
+    const Range* range_;
+};
+}  // namespace
+
+// An aggregate function call. It is computed over the values of the scalar
+// arguments followed by the values of the non-empty cells of the ranges.
+// Errors of the arguments and the cells propagate as from a cell reference;
+// AVERAGE of no values and non-finite results are arithmetic errors.
+class FunctionExpr final : public Expr {
+public:
+    FunctionExpr(Function function, std::vector<std::unique_ptr<Expr>> args)
+        : function_(function)
+        , args_(std::move(args)) {
+        for (const auto& arg : args_) {
+            if (const Range* range = arg->GetRange()) {
+                ranges_.push_back(range);
+            } else {
+                scalars_.push_back(arg.get());
+            }
+        }
+    }
+
+    void Print(std::ostream& out, Position anchor) const override {
+        out << '(' << GetFunctionName(function_);
+        for (const auto& arg : args_) {
+            out << ' ';
+            arg->Print(out, anchor);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position anchor) const override {
+        out << GetFunctionName(function_) << '(';
+        for (size_t i = 0; i < args_.size(); ++i) {
+            if (i > 0) {
+                out << ',';
+            }
+            // Arguments are delimited by commas, so they never need parentheses
+            args_[i]->PrintFormula(out, EP_ADD, anchor);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const std::function<double(Position)>& lmbd, const RangeValues& range_values,
+                    Position anchor) const override {
+        std::vector<double> values;
+        values.reserve(scalars_.size());
+        for (const Expr* arg : scalars_) {
+            values.push_back(arg->Evaluate(lmbd, range_values, anchor));
+        }
+        return Apply(values, range_values, anchor);
+    }
+
+    // Computes the function given the values of the scalar arguments;
+    // appends the values of the ranges to them.
+    double Apply(std::vector<double>& values, const RangeValues& range_values, Position anchor) const {
+        for (const Range* range : ranges_) {
+            Range shifted = ShiftRange(*range, anchor);
+            if (!shifted.IsValid()) {
+                throw FormulaError(FormulaError::Category::Ref);
+            }
+            range_values(shifted, values);
+        }
+
+        switch (function_) {
+            case Function::Sum:
+                return CheckArithmetic(SumValues(values.data(), values.size()));
+            case Function::Min:
+                return MinValues(values.data(), values.size());
+            case Function::Max:
+                return MaxValues(values.data(), values.size());
+            case Function::Average:
+                if (values.empty()) {
+                    throw FormulaError(FormulaError::Category::Arithmetic);
+                }
+                return CheckArithmetic(SumValues(values.data(), values.size()) / values.size());
+            case Function::Count:
+                return static_cast<double>(values.size());
+        }
+        assert(false);
+        return 0;
+    }
+
+    size_t GetScalarCount() const {
+        return scalars_.size();
+    }
+
+    void Compile(std::vector<Instruction>& code) const override {
+        for (const Expr* arg : scalars_) {
+            arg->Compile(code);
+        }
+        Instruction instruction{};
+        instruction.op = Instruction::OpCode::Call;
+        instruction.call = this;
+        code.push_back(instruction);
+    }
+
+    void Serialize(std::vector<PostfixNode>& nodes) const override {
+        for (const auto& arg : args_) {
+            arg->Serialize(nodes);
+        }
+        PostfixNode node;
+        node.type = PostfixNode::Type::Call;
+        node.function = function_;
+        node.arg_count = static_cast<uint32_t>(args_.size());
+        nodes.push_back(node);
+    }
+
+private:
+    Function function_;
+    std::vector<std::unique_ptr<Expr>> args_;
+    std::vector<const Expr*> scalars_;
+    std::vector<const Range*> ranges_;
+};
+
+namespace {
+
+// Hand-written lexer and precedence-climbing (Pratt) parser for the Formula.g4
+// grammar. Builds the same AST as the ANTLR pipeline, but works directly on the
+// input characters and does not build an intermediate parse tree.
+class Tokenizer {
+public:
+    enum class TokenType {
+        Number,
+        Cell,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+        Colon,
+        Comma,
+        Name,
+        End,
+    };
+
+    struct Token {
+        TokenType type = TokenType::End;
+        std::string_view text;
+    };
+
+    explicit Tokenizer(std::string_view text)
+        : text_(text) {
+        Advance();
+    }
+
+    const Token& Peek() const {
+        return token_;
+    }
+
+    Token Next() {
+        Token token = token_;
+        Advance();
+        return token;
+    }
+
+private:
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+    }
+
+    bool IsDigitAt(size_t i) const {
+        return i < text_.size() && IsDigit(text_[i]);
+    }
+
+    size_t SkipDigits(size_t i) const {
+        while (IsDigitAt(i)) {
+            ++i;
+        }
+        return i;
+    }
+
+    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+    size_t ScanNumber(size_t i) const {
+        size_t end = SkipDigits(i);
+        if (end < text_.size() && text_[end] == '.' && IsDigitAt(end + 1)) {
+            end = SkipDigits(end + 1);
+        } else if (end == i) {
+            return i;
+        }
+
+        // An incomplete exponent is not part of the number, as in the ANTLR lexer
+        if (end < text_.size() && (text_[end] == 'e' || text_[end] == 'E')) {
+            size_t exponent = end + 1;
+            if (exponent < text_.size() && (text_[exponent] == '+' || text_[exponent] == '-')) {
+                ++exponent;
+            }
+            if (IsDigitAt(exponent)) {
+                end = SkipDigits(exponent);
+            }
+        }
+        return end;
+    }
+
+    // CELL: [A-Z]+[0-9]+
+    size_t ScanCell(size_t i) const {
+        size_t end = i;
+        while (end < text_.size() && IsUpper(text_[end])) {
+            ++end;
+        }
+        return IsDigitAt(end) ? SkipDigits(end) : i;
+    }
+
+    // FUNCTION: [A-Z]+, checked against the known names by the parser
+    size_t ScanName(size_t i) const {
+        while (i < text_.size() && IsUpper(text_[i])) {
+            ++i;
+        }
+        return i;
+    }
+
+    void Advance() {
+        while (pos_ < text_.size() && IsSpace(text_[pos_])) {
+            ++pos_;
+        }
+        if (pos_ == text_.size()) {
+            token_ = Token{TokenType::End, {}};
+            return;
+        }
+
+        size_t start = pos_;
+        TokenType type;
+        switch (text_[pos_]) {
+            case '+':
+                type = TokenType::Add;
+                break;
+            case '-':
+                type = TokenType::Sub;
+                break;
+            case '*':
+                type = TokenType::Mul;
+                break;
+            case '/':
+                type = TokenType::Div;
+                break;
+            case '(':
+                type = TokenType::LeftParen;
+                break;
+            case ')':
+                type = TokenType::RightParen;
+                break;
+            case ':':
+                type = TokenType::Colon;
+                break;
+            case ',':
+                type = TokenType::Comma;
+                break;
+            default:
+                if (size_t end = ScanNumber(pos_); end != pos_) {
+                    type = TokenType::Number;
+                    pos_ = end;
+                } else if (size_t end = ScanCell(pos_); end != pos_) {
+                    type = TokenType::Cell;
+                    pos_ = end;
+                } else if (size_t end = ScanName(pos_); end != pos_) {
+                    type = TokenType::Name;
+                    pos_ = end;
+                } else {
+                    throw ParsingError("Error when lexing: unexpected character '"
+                                       + std::string(1, text_[pos_]) + "'");
+                }
+                token_ = Token{type, text_.substr(start, pos_ - start)};
+                return;
+        }
+        ++pos_;
+        token_ = Token{type, text_.substr(start, 1)};
+    }
+
+    std::string_view text_;
+    size_t pos_ = 0;
+    Token token_;
+};
+
+class PrattParser {
+public:
+    // Cell positions are stored as offsets from anchor.
+    PrattParser(std::string_view text, Position anchor)
+        : tokens_(text)
+        , anchor_(anchor) {
+    }
+
+    // main: expr EOF
+    std::unique_ptr<Expr> ParseMain() {
+        auto root = ParseExpr(0);
+        if (tokens_.Peek().type != TokenType::End) {
+            throw UnexpectedToken();
+        }
+        return root;
+    }
+
+    std::forward_list<Position> MoveCells() {
+        return std::move(cells_);
+    }
+
+    std::forward_list<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
+private:
+    using TokenType = Tokenizer::TokenType;
+
+    // Binary operators are left-associative; '*' and '/' bind tighter than '+' and '-'.
+    // Unary operators bind tighter than any binary one.
+    static std::optional<std::pair<BinaryOpExpr::Type, int>> GetBinaryOp(TokenType type) {
+        switch (type) {
+            case TokenType::Add:
+                return std::pair{BinaryOpExpr::Add, 1};
+            case TokenType::Sub:
+                return std::pair{BinaryOpExpr::Subtract, 1};
+            case TokenType::Mul:
+                return std::pair{BinaryOpExpr::Multiply, 2};
+            case TokenType::Div:
+                return std::pair{BinaryOpExpr::Divide, 2};
+            default:
+                return std::nullopt;
+        }
+    }
+
+    // lhs, when given, is an already parsed prefix of the expression.
+    std::unique_ptr<Expr> ParseExpr(int min_binding_power, std::unique_ptr<Expr> lhs = nullptr) {
+        if (lhs == nullptr) {
+            lhs = ParsePrefix();
+        }
+        while (auto op = GetBinaryOp(tokens_.Peek().type)) {
+            auto [type, binding_power] = *op;
+            if (binding_power <= min_binding_power) {
+                break;
+            }
+            tokens_.Next();
+            auto rhs = ParseExpr(binding_power);
+            lhs = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+        }
+        return lhs;
+    }
+
+    std::unique_ptr<Expr> ParsePrefix() {
+        switch (tokens_.Peek().type) {
+            case TokenType::LeftParen: {
+                tokens_.Next();
+                auto expr = ParseExpr(0);
+                if (tokens_.Peek().type != TokenType::RightParen) {
+                    throw UnexpectedToken();
+                }
+                tokens_.Next();
+                return expr;
+            }
+            case TokenType::Add:
+            case TokenType::Sub: {
+                auto type = tokens_.Next().type == TokenType::Sub ? UnaryOpExpr::UnaryMinus
+                                                                  : UnaryOpExpr::UnaryPlus;
+                return std::make_unique<UnaryOpExpr>(type, ParsePrefix());
+            }
+            case TokenType::Number:
+                return ParseNumber(tokens_.Next().text);
+            case TokenType::Cell:
+                return ParseCell(tokens_.Next().text);
+            case TokenType::Name:
+                return ParseCall(tokens_.Next().text);
+            default:
+                throw UnexpectedToken();
+        }
+    }
+
+    // FUNCTION '(' arg (',' arg)* ')'
+    std::unique_ptr<Expr> ParseCall(std::string_view name) {
+        auto function = FindFunction(name);
+        if (!function) {
+            throw ParsingError("Unknown function: " + std::string(name));
+        }
+        Expect(TokenType::LeftParen);
+        std::vector<std::unique_ptr<Expr>> args;
+        args.push_back(ParseArgument());
+        while (tokens_.Peek().type == TokenType::Comma) {
+            tokens_.Next();
+            args.push_back(ParseArgument());
+        }
+        Expect(TokenType::RightParen);
+        return std::make_unique<FunctionExpr>(*function, std::move(args));
+    }
+
+    // arg: CELL ':' CELL | expr
+    std::unique_ptr<Expr> ParseArgument() {
+        if (tokens_.Peek().type != TokenType::Cell) {
+            return ParseExpr(0);
+        }
+        auto first = tokens_.Next().text;
+        if (tokens_.Peek().type != TokenType::Colon) {
+            return ParseExpr(0, ParseCell(first));
+        }
+        tokens_.Next();
+        if (tokens_.Peek().type != TokenType::Cell) {
+            throw UnexpectedToken();
+        }
+        return ParseRange(first, tokens_.Next().text);
+    }
+
+    void Expect(TokenType type) {
+        if (tokens_.Peek().type != type) {
+            throw UnexpectedToken();
+        }
+        tokens_.Next();
+    }
+
+    std::unique_ptr<Expr> ParseNumber(std::string_view text) {
+        auto value = ::ParseNumber(text);
+        if (!value) {
+            throw ParsingError("Invalid number: " + std::string(text));
+        }
+        return std::make_unique<NumberExpr>(*value);
+    }
+
+    std::unique_ptr<Expr> ParseCell(std::string_view text) {
+        Position value = ParsePosition(text);
+        cells_.push_front(Position{value.row - anchor_.row, value.col - anchor_.col});
+        return std::make_unique<CellExpr>(&cells_.front());
+    }
+
+    std::unique_ptr<Expr> ParseRange(std::string_view first_text, std::string_view last_text) {
+        Position first = ParsePosition(first_text);
+        Position last = ParsePosition(last_text);
+        Range range = Range::FromCorners(first, last);
+        ranges_.push_front(Range{Position{range.first.row - anchor_.row, range.first.col - anchor_.col},
+                                 Position{range.last.row - anchor_.row, range.last.col - anchor_.col}});
+        return std::make_unique<RangeExpr>(&ranges_.front());
+    }
+
+    static Position ParsePosition(std::string_view text) {
+        auto value = Position::FromString(text);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid position: " + std::string(text));
+        }
+        return value;
+    }
+
+    ParsingError UnexpectedToken() const {
+        const auto& token = tokens_.Peek();
+        return ParsingError("Error when parsing: "
+                            + (token.type == TokenType::End ? std::string("<EOF>")
+                                                            : std::string(token.text)));
+    }
+
+    Tokenizer tokens_;
+    Position anchor_;
+    std::forward_list<Position> cells_;
+    std::forward_list<Range> ranges_;
+};
+
+#ifdef SPREADSHEET_WITH_ANTLR
 class ParseASTListener final : public FormulaBaseListener {
 public:
     std::unique_ptr<Expr> MoveRoot() {
@@ -305,6 +964,10 @@ public:
         return std::move(cells_);
     }
 
+    std::forward_list<Range> MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -324,15 +987,13 @@ public:
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-        double value = 0;
         auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-        std::istringstream in(valueStr);
-        in >> value;
-        if (!in) {
+        auto value = ParseNumber(valueStr);
+        if (!value) {
             throw ParsingError("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
+        auto node = std::make_unique<NumberExpr>(*value);
         args_.push_back(std::move(node));
     }
 
@@ -372,13 +1033,43 @@ public:
         args_.back() = std::move(node);
     }
 
+    void exitRangeArg(FormulaParser::RangeArgContext* ctx) override {
+        Position first = ParsePosition(ctx->CELL(0)->getSymbol()->getText());
+        Position last = ParsePosition(ctx->CELL(1)->getSymbol()->getText());
+        ranges_.push_front(Range::FromCorners(first, last));
+        args_.push_back(std::make_unique<RangeExpr>(&ranges_.front()));
+    }
+
+    void exitCall(FormulaParser::CallContext* ctx) override {
+        size_t count = ctx->arg().size();
+        assert(args_.size() >= count);
+
+        auto first = args_.end() - count;
+        std::vector<std::unique_ptr<Expr>> call_args(std::make_move_iterator(first),
+                                                     std::make_move_iterator(args_.end()));
+        args_.erase(first, args_.end());
+
+        auto function = FindFunction(ctx->FUNCTION()->getSymbol()->getText());
+        assert(function.has_value());
+        args_.push_back(std::make_unique<FunctionExpr>(*function, std::move(call_args)));
+    }
+
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
         throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
     }
 
 private:
+    static Position ParsePosition(const std::string& text) {
+        auto value = Position::FromString(text);
+        if (!value.IsValid()) {
+            throw FormulaException("Invalid position: " + text);
+        }
+        return value;
+    }
+
     std::vector<std::unique_ptr<Expr>> args_;
     std::forward_list<Position> cells_;
+    std::forward_list<Range> ranges_;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -390,11 +1081,129 @@ public:
         throw ParsingError("Error when lexing: " + msg);
     }
 };
+#endif  // SPREADSHEET_WITH_ANTLR
 
 }  // namespace
 }  // namespace ASTImpl
 
+FormulaAST ParseFormulaAST(std::string_view in, Position anchor) {
+    ASTImpl::PrattParser parser(in, anchor);
+    auto root = parser.ParseMain();
+    return FormulaAST(std::move(root), parser.MoveCells(), parser.MoveRanges());
+}
+
+FormulaAST FormulaASTFromPostfix(const ASTImpl::PostfixNode* nodes, size_t count) {
+    using ASTImpl::PostfixNode;
+
+    std::vector<std::unique_ptr<ASTImpl::Expr>> stack;
+    std::forward_list<Position> cells;
+    std::forward_list<Range> ranges;
+    // Pops an operand of an operator; a range can only be an argument of a call
+    auto pop = [&stack] {
+        if (stack.empty() || stack.back()->GetRange() != nullptr) {
+            throw ParsingError("Invalid postfix formula");
+        }
+        auto expr = std::move(stack.back());
+        stack.pop_back();
+        return expr;
+    };
+
+    for (size_t i = 0; i < count; ++i) {
+        const PostfixNode& node = nodes[i];
+        switch (node.type) {
+            case PostfixNode::Type::Number:
+                stack.push_back(std::make_unique<ASTImpl::NumberExpr>(node.number));
+                break;
+            case PostfixNode::Type::Cell:
+                cells.push_front(node.cell);
+                stack.push_back(std::make_unique<ASTImpl::CellExpr>(&cells.front()));
+                break;
+            case PostfixNode::Type::Add:
+            case PostfixNode::Type::Subtract:
+            case PostfixNode::Type::Multiply:
+            case PostfixNode::Type::Divide: {
+                static constexpr ASTImpl::BinaryOpExpr::Type TYPES[] = {
+                    ASTImpl::BinaryOpExpr::Add,
+                    ASTImpl::BinaryOpExpr::Subtract,
+                    ASTImpl::BinaryOpExpr::Multiply,
+                    ASTImpl::BinaryOpExpr::Divide,
+                };
+                auto rhs = pop();
+                auto lhs = pop();
+                auto type = TYPES[static_cast<int>(node.type) - static_cast<int>(PostfixNode::Type::Add)];
+                stack.push_back(std::make_unique<ASTImpl::BinaryOpExpr>(type, std::move(lhs), std::move(rhs)));
+                break;
+            }
+            case PostfixNode::Type::UnaryPlus:
+            case PostfixNode::Type::UnaryMinus: {
+                auto type = node.type == PostfixNode::Type::UnaryMinus ? ASTImpl::UnaryOpExpr::UnaryMinus
+                                                                       : ASTImpl::UnaryOpExpr::UnaryPlus;
+                stack.push_back(std::make_unique<ASTImpl::UnaryOpExpr>(type, pop()));
+                break;
+            }
+            case PostfixNode::Type::Range:
+                if (node.cell.row > node.last.row || node.cell.col > node.last.col) {
+                    throw ParsingError("Invalid postfix formula");
+                }
+                ranges.push_front(Range{node.cell, node.last});
+                stack.push_back(std::make_unique<ASTImpl::RangeExpr>(&ranges.front()));
+                break;
+            case PostfixNode::Type::Call: {
+                if (node.arg_count == 0 || node.arg_count > stack.size()
+                    || node.function > ASTImpl::Function::Count) {
+                    throw ParsingError("Invalid postfix formula");
+                }
+                auto first = stack.end() - node.arg_count;
+                std::vector<std::unique_ptr<ASTImpl::Expr>> args(std::make_move_iterator(first),
+                                                                 std::make_move_iterator(stack.end()));
+                stack.erase(first, stack.end());
+                stack.push_back(std::make_unique<ASTImpl::FunctionExpr>(node.function, std::move(args)));
+                break;
+            }
+            default:
+                throw ParsingError("Invalid postfix formula");
+        }
+    }
+
+    auto root = pop();
+    if (!stack.empty()) {
+        throw ParsingError("Invalid postfix formula");
+    }
+    return FormulaAST(std::move(root), std::move(cells), std::move(ranges));
+}
+
+std::string GetRelativeFormulaKey(std::string_view in, Position anchor) {
+    using TokenType = ASTImpl::Tokenizer::TokenType;
+
+    std::string key;
+    key.reserve(in.size() + 8);
+    for (ASTImpl::Tokenizer tokens(in); tokens.Peek().type != TokenType::End;) {
+        auto token = tokens.Next();
+        if (token.type != TokenType::Cell) {
+            key += token.text;
+        } else {
+            auto cell = Position::FromString(token.text);
+            if (!cell.IsValid()) {
+                throw FormulaException("Invalid position: " + std::string(token.text));
+            }
+            key += 'R';
+            key += std::to_string(cell.row - anchor.row);
+            key += 'C';
+            key += std::to_string(cell.col - anchor.col);
+        }
+        // Separator keeps "1 2" and "12" apart
+        key += ' ';
+    }
+    return key;
+}
+
 FormulaAST ParseFormulaAST(std::istream& in) {
+    std::string in_str(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(std::string_view(in_str));
+}
+
+#ifdef SPREADSHEET_WITH_ANTLR
+FormulaAST ParseFormulaASTAntlr(std::istream& in) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -415,13 +1224,14 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
     
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveRanges());
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+FormulaAST ParseFormulaASTAntlr(std::string_view in_str) {
+    std::istringstream in{std::string(in_str)};
+    return ParseFormulaASTAntlr(in);
 }
+#endif  // SPREADSHEET_WITH_ANTLR
 
 void FormulaAST::PrintCells(std::ostream& out) const {
     for (auto cell : cells_) {
@@ -429,22 +1239,140 @@ void FormulaAST::PrintCells(std::ostream& out) const {
     }
 }
 
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+void FormulaAST::Print(std::ostream& out, Position anchor) const {
+    root_expr_->Print(out, anchor);
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position anchor) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, anchor);
+}
+
+void FormulaAST::Serialize(std::vector<ASTImpl::PostfixNode>& out) const {
+    root_expr_->Serialize(out);
+}
+
+namespace {
+// Formulas rarely need a deeper evaluation stack, so it usually lives on the C++ stack.
+constexpr size_t INLINE_STACK_DEPTH = 32;
+
+// Reads every cell of a range, empty ones included, through lmbd.
+RangeValues ReadEachCell(const std::function<double(Position)>& lmbd) {
+    return [&lmbd](Range range, std::vector<double>& values) {
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+            for (int col = range.first.col; col <= range.last.col; ++col) {
+                values.push_back(lmbd(Position{row, col}));
+            }
+        }
+    };
+}
+}  // namespace
+
+double FormulaAST::Execute(const std::function<double(Position)>& lmbd, Position anchor) const {
+    return Execute(lmbd, ReadEachCell(lmbd), anchor);
+}
+
+// The arithmetic below must stay in sync with BinaryOpExpr, UnaryOpExpr, CellExpr and FunctionExpr.
+double FormulaAST::Execute(const std::function<double(Position)>& lmbd, const RangeValues& range_values,
+                           Position anchor) const {
+    using ASTImpl::CheckArithmetic;
+    using OpCode = ASTImpl::Instruction::OpCode;
+
+    double inline_stack[INLINE_STACK_DEPTH];
+    std::unique_ptr<double[]> heap_stack;
+    double* stack = inline_stack;
+    if (max_stack_depth_ > INLINE_STACK_DEPTH) {
+        heap_stack = std::make_unique<double[]>(max_stack_depth_);
+        stack = heap_stack.get();
+    }
+
+    // top points one past the topmost value
+    double* top = stack;
+    // Values of a function call, reused between calls
+    std::vector<double> values;
+    for (const ASTImpl::Instruction& instruction : code_) {
+        switch (instruction.op) {
+            case OpCode::Number:
+                *top++ = instruction.number;
+                break;
+            case OpCode::Cell: {
+                Position cell = ShiftPosition(*instruction.cell, anchor);
+                if (!cell.IsValid()) {
+                    throw FormulaError(FormulaError::Category::Ref);
+                }
+                *top++ = lmbd(cell);
+                break;
+            }
+            case OpCode::Add:
+                --top;
+                top[-1] = CheckArithmetic(top[-1] + top[0] + .0);
+                break;
+            case OpCode::Subtract:
+                --top;
+                top[-1] = CheckArithmetic(top[-1] - top[0] - .0);
+                break;
+            case OpCode::Multiply:
+                --top;
+                top[-1] = CheckArithmetic(top[-1] * top[0] * 1.0);
+                break;
+            case OpCode::Divide:
+                --top;
+                top[-1] = CheckArithmetic(top[-1] / top[0]);
+                break;
+            case OpCode::Negate:
+                top[-1] = -top[-1];
+                break;
+            case OpCode::Call: {
+                size_t count = instruction.call->GetScalarCount();
+                top -= count;
+                values.assign(top, top + count);
+                *top++ = instruction.call->Apply(values, range_values, anchor);
+                break;
+            }
+        }
+    }
+
+    assert(top == stack + 1);
+    return top[-1];
+}
+
+double FormulaAST::ExecuteTree(const std::function<double(Position)>& lmbd, Position anchor) const {
+    return ExecuteTree(lmbd, ReadEachCell(lmbd), anchor);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+double FormulaAST::ExecuteTree(const std::function<double(Position)>& lmbd, const RangeValues& range_values,
+                               Position anchor) const {
+    return root_expr_->Evaluate(lmbd, range_values, anchor);
 }
 
-double FormulaAST::Execute(const std::function<double(Position)> lmbd) const {
-    return root_expr_->Evaluate(lmbd);
+void FormulaAST::Compile() {
+    using OpCode = ASTImpl::Instruction::OpCode;
+
+    code_.clear();
+    root_expr_->Compile(code_);
+
+    size_t depth = 0;
+    max_stack_depth_ = 0;
+    for (const ASTImpl::Instruction& instruction : code_) {
+        if (instruction.op == OpCode::Number || instruction.op == OpCode::Cell) {
+            max_stack_depth_ = std::max(max_stack_depth_, ++depth);
+        } else if (instruction.op == OpCode::Call) {
+            depth -= instruction.call->GetScalarCount();
+            max_stack_depth_ = std::max(max_stack_depth_, ++depth);
+        } else if (instruction.op != OpCode::Negate) {
+            --depth;
+        }
+    }
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::forward_list<Range> ranges)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , cells_(std::move(cells))
+    , ranges_(std::move(ranges)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    Compile();
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
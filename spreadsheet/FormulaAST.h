@@ -1,33 +1,122 @@
 #pragma once
 
-#include "FormulaLexer.h"
 #include "common.h"
 
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <iosfwd>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
-}
+class FunctionExpr;
+
+// Aggregate functions; their arguments are numbers and cell ranges.
+enum class Function : unsigned char {
+    Sum,
+    Min,
+    Max,
+    Average,
+    Count,
+};
+
+// A single bytecode instruction; a program is the postfix form of the AST
+// with number and cell operands stored inline. A function call pops its
+// scalar arguments and reads its ranges itself.
+struct Instruction {
+    enum class OpCode : unsigned char {
+        Number,
+        Cell,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+        Call,
+    };
+
+    OpCode op;
+    union {
+        double number;
+        const Position* cell;
+        const FunctionExpr* call;
+    };
+};
+
+// A node of the AST in postfix order. Unlike the bytecode, the postfix form
+// keeps unary pluses, so it restores exactly the same tree; used to store
+// formulas without their text.
+struct PostfixNode {
+    enum class Type : unsigned char {
+        Number,
+        Cell,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        UnaryPlus,
+        UnaryMinus,
+        // A range operand of a call: from cell to last
+        Range,
+        // Takes arg_count operands, ranges included
+        Call,
+    };
+
+    Type type = Type::Number;
+    double number = 0;
+    Position cell;
+    Position last;
+    Function function = Function::Sum;
+    uint32_t arg_count = 0;
+};
+}  // namespace ASTImpl
+
+// Appends the numeric values of the non-empty cells of a range, see
+// SheetInterface::GetNumericValues.
+using RangeValues = std::function<void(Range, std::vector<double>&)>;
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// The position at the offset from anchor.
+inline Position ShiftPosition(Position offset, Position anchor) {
+    return Position{anchor.row + offset.row, anchor.col + offset.col};
+}
+
+// An AST may store its cells either as absolute positions or as offsets from
+// an anchor passed to Execute and Print*; the former is the case with a zero
+// anchor. The relative form lets cells whose formulas differ only by a shift
+// of references, as after filling a formula down a column, share one AST.
 class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+                        std::forward_list<Position> cells,
+                        std::forward_list<Range> ranges = {});
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(const std::function<double(Position)> lmbd) const;
+    // Runs the compiled bytecode. Without range_values every cell of a range
+    // is read through lmbd.
+    double Execute(const std::function<double(Position)>& lmbd, Position anchor = {}) const;
+    double Execute(const std::function<double(Position)>& lmbd, const RangeValues& range_values,
+                   Position anchor = {}) const;
+    // Walks the AST; kept as the reference implementation for tests and benchmarks.
+    double ExecuteTree(const std::function<double(Position)>& lmbd, Position anchor = {}) const;
+    double ExecuteTree(const std::function<double(Position)>& lmbd, const RangeValues& range_values,
+                       Position anchor = {}) const;
     void PrintCells(std::ostream& out) const;
-    void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void Print(std::ostream& out, Position anchor = {}) const;
+    void PrintFormula(std::ostream& out, Position anchor = {}) const;
+    // Appends the postfix form of the AST, see FormulaASTFromPostfix.
+    void Serialize(std::vector<ASTImpl::PostfixNode>& out) const;
 
+    // Cells as stored, i.e. offsets from the anchor for a relative AST.
     std::forward_list<Position>& GetCells() {
         return cells_;
     }
@@ -36,6 +125,11 @@ public:
         return cells_;
     }
 
+    // Ranges of the function arguments, stored the same way as cells.
+    const std::forward_list<Range>& GetRanges() const {
+        return ranges_;
+    }
+
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
 
@@ -43,7 +137,32 @@ private:
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+    std::forward_list<Range> ranges_;
+
+    std::vector<ASTImpl::Instruction> code_;
+    size_t max_stack_depth_ = 0;
+
+    void Compile();
 };
 
+// Parses a formula with the hand-written parser. Cell positions are stored
+// relative to anchor, so with a non-zero anchor the same anchor must be passed
+// to Execute and Print*.
+FormulaAST ParseFormulaAST(std::string_view in, Position anchor = {});
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+
+// Rebuilds an AST from its postfix form. Throws ParsingError if the nodes
+// do not form a single expression.
+FormulaAST FormulaASTFromPostfix(const ASTImpl::PostfixNode* nodes, size_t count);
+
+// Tokenizes a formula into a key with cell references written as offsets from
+// anchor (R<row>C<col>). Formulas with equal keys parse into identical
+// relative ASTs. Throws ParsingError on a lexing error and FormulaException
+// on an invalid position.
+std::string GetRelativeFormulaKey(std::string_view in, Position anchor);
+
+#ifdef SPREADSHEET_WITH_ANTLR
+// The ANTLR-generated parser; kept as the reference for differential tests and benchmarks.
+FormulaAST ParseFormulaASTAntlr(std::string_view in);
+FormulaAST ParseFormulaASTAntlr(std::istream& in);
+#endif
\ No newline at end of file
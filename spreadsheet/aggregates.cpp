@@ -0,0 +1,129 @@
+#include "aggregates.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SPREADSHEET_HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+double SumValuesScalar(const double* values, size_t count)
+{
+    double sum = 0;
+    for (size_t i = 0; i < count; ++i) {
+        sum += values[i];
+    }
+    return sum;
+}
+
+double MinValuesScalar(const double* values, size_t count)
+{
+    if (count == 0) {
+        return 0;
+    }
+    return *std::min_element(values, values + count);
+}
+
+double MaxValuesScalar(const double* values, size_t count)
+{
+    if (count == 0) {
+        return 0;
+    }
+    return *std::max_element(values, values + count);
+}
+
+#ifdef SPREADSHEET_HAS_SSE2
+namespace {
+// Чисел за одну итерацию: четыре вектора по два
+constexpr size_t BLOCK = 8;
+
+double HorizontalSum(__m128d v)
+{
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+// Свёртка операцией op (min или max) по векторам с досчётом хвоста op_scalar
+template <typename VectorOp, typename ScalarOp>
+double Reduce(const double* values, size_t count, VectorOp op, ScalarOp op_scalar)
+{
+    if (count < BLOCK) {
+        double result = values[0];
+        for (size_t i = 1; i < count; ++i) {
+            result = op_scalar(result, values[i]);
+        }
+        return result;
+    }
+
+    __m128d acc0 = _mm_loadu_pd(values);
+    __m128d acc1 = _mm_loadu_pd(values + 2);
+    __m128d acc2 = _mm_loadu_pd(values + 4);
+    __m128d acc3 = _mm_loadu_pd(values + 6);
+    size_t i = BLOCK;
+    for (; i + BLOCK <= count; i += BLOCK) {
+        acc0 = op(acc0, _mm_loadu_pd(values + i));
+        acc1 = op(acc1, _mm_loadu_pd(values + i + 2));
+        acc2 = op(acc2, _mm_loadu_pd(values + i + 4));
+        acc3 = op(acc3, _mm_loadu_pd(values + i + 6));
+    }
+    __m128d acc = op(op(acc0, acc1), op(acc2, acc3));
+    double result = op_scalar(_mm_cvtsd_f64(acc), _mm_cvtsd_f64(_mm_unpackhi_pd(acc, acc)));
+    for (; i < count; ++i) {
+        result = op_scalar(result, values[i]);
+    }
+    return result;
+}
+}  // namespace
+
+double SumValues(const double* values, size_t count)
+{
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    __m128d acc2 = _mm_setzero_pd();
+    __m128d acc3 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + BLOCK <= count; i += BLOCK) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(values + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(values + i + 2));
+        acc2 = _mm_add_pd(acc2, _mm_loadu_pd(values + i + 4));
+        acc3 = _mm_add_pd(acc3, _mm_loadu_pd(values + i + 6));
+    }
+    double sum = HorizontalSum(_mm_add_pd(_mm_add_pd(acc0, acc1), _mm_add_pd(acc2, acc3)));
+    for (; i < count; ++i) {
+        sum += values[i];
+    }
+    return sum;
+}
+
+double MinValues(const double* values, size_t count)
+{
+    if (count == 0) {
+        return 0;
+    }
+    return Reduce(values, count, [](__m128d a, __m128d b) { return _mm_min_pd(a, b); },
+                  [](double a, double b) { return std::min(a, b); });
+}
+
+double MaxValues(const double* values, size_t count)
+{
+    if (count == 0) {
+        return 0;
+    }
+    return Reduce(values, count, [](__m128d a, __m128d b) { return _mm_max_pd(a, b); },
+                  [](double a, double b) { return std::max(a, b); });
+}
+#else
+double SumValues(const double* values, size_t count)
+{
+    return SumValuesScalar(values, count);
+}
+
+double MinValues(const double* values, size_t count)
+{
+    return MinValuesScalar(values, count);
+}
+
+double MaxValues(const double* values, size_t count)
+{
+    return MaxValuesScalar(values, count);
+}
+#endif
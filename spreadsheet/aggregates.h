@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+// Свёртки массивов чисел для агрегатных функций формул. Где доступен SSE2,
+// массив обрабатывается векторами по два числа в нескольких независимых
+// сумматорах, поэтому сумма может отличаться от последовательной в последних
+// знаках. Скалярные варианты - эталон для тестов и замеров.
+
+double SumValues(const double* values, size_t count);
+// Для count == 0 возвращают 0
+double MinValues(const double* values, size_t count);
+double MaxValues(const double* values, size_t count);
+
+double SumValuesScalar(const double* values, size_t count);
+double MinValuesScalar(const double* values, size_t count);
+double MaxValuesScalar(const double* values, size_t count);
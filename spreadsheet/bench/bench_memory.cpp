@@ -0,0 +1,125 @@
+#include "bench_memory.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+std::atomic<size_t> allocations{0};
+std::atomic<size_t> allocated_bytes{0};
+std::atomic<size_t> live_bytes{0};
+
+// Размер блока хранится перед ним, чтобы освобождение уменьшало live_bytes.
+// Заголовок сохраняет выравнивание malloc.
+constexpr size_t HEADER_SIZE = alignof(std::max_align_t);
+
+void* Allocate(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    live_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size + HEADER_SIZE)) {
+        *static_cast<size_t*>(ptr) = size;
+        return static_cast<char*>(ptr) + HEADER_SIZE;
+    }
+    throw std::bad_alloc();
+}
+
+void Deallocate(void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    void* block = static_cast<char*>(ptr) - HEADER_SIZE;
+    live_bytes.fetch_sub(*static_cast<size_t*>(block), std::memory_order_relaxed);
+    std::free(block);
+}
+}  // namespace
+
+void* operator new(size_t size) {
+    return Allocate(size);
+}
+
+void* operator new[](size_t size) {
+    return Allocate(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    Deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    Deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    Deallocate(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    Deallocate(ptr);
+}
+
+AllocationCounters GetAllocationCounters() {
+    return {allocations.load(std::memory_order_relaxed), allocated_bytes.load(std::memory_order_relaxed),
+            live_bytes.load(std::memory_order_relaxed)};
+}
+
+size_t GetPeakRssKb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize / 1024;
+    }
+    return 0;
+#else
+#ifdef __linux__
+    // В отличие от ru_maxrss, VmHWM сбрасывается через clear_refs
+    std::ifstream status("/proc/self/status");
+    for (std::string line; std::getline(status, line);) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return std::stoul(line.substr(6));
+        }
+    }
+#endif
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss) / 1024;
+#else
+    return static_cast<size_t>(usage.ru_maxrss);
+#endif
+#endif
+}
+
+bool ResetPeakRss() {
+#ifdef __linux__
+    // Сброс пика поддерживается не везде (песочницы, ядра до 4.0); тогда
+    // ошибку сообщает write
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool is_written = write(fd, "5", 1) == 1;
+    close(fd);
+    return is_written;
+#else
+    return false;
+#endif
+}
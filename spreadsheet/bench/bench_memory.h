@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+
+// Счётчики выделений памяти через глобальный operator new. Замена operator new
+// действует только в исполняемом файле бенчмарков.
+struct AllocationCounters {
+    size_t allocations = 0;
+    size_t bytes = 0;
+    // Выделенные и ещё не освобождённые байты
+    size_t live_bytes = 0;
+};
+
+AllocationCounters GetAllocationCounters();
+
+// Пиковый объём резидентной памяти процесса в килобайтах; 0, если неизвестен.
+size_t GetPeakRssKb();
+
+// Сбрасывает пик до текущего объёма, чтобы пик относился к одному бенчмарку.
+// Возвращает false, если система этого не умеет или не разрешает: тогда пик
+// растёт за весь процесс.
+bool ResetPeakRss();
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "bench_memory.h"
+
+#include <chrono>
+#include <cstddef>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Не даёт компилятору выбросить вычисление, результат которого не используется.
+template <class T>
+inline void DoNotOptimize(T value) {
+    volatile T sink = value;
+    (void)sink;
+}
+
+// Дополнительные показатели выполняемого бенчмарка, например перцентили
+// задержек. Попадают в его результат после возврата из функции бенчмарка.
+inline std::vector<std::pair<std::string, double>>& BenchMetrics() {
+    static std::vector<std::pair<std::string, double>> metrics;
+    return metrics;
+}
+
+inline void ReportBenchMetric(std::string name, double value) {
+    BenchMetrics().emplace_back(std::move(name), value);
+}
+
+class BenchRunner {
+public:
+    struct Result {
+        std::string name;
+        size_t ops = 0;
+        double ns_per_op = 0;
+        double ops_per_s = 0;
+        // Пик памяти за время бенчмарка; пусто, если система не даёт его измерить
+        std::optional<size_t> peak_rss_kb;
+        size_t allocations = 0;
+        size_t allocated_bytes = 0;
+        std::vector<std::pair<std::string, double>> metrics;
+    };
+
+    BenchRunner() = default;
+
+    // Аргументы командной строки: --json выводит результаты в stdout одним
+    // JSON-документом, остальной аргумент - подстрока имён запускаемых бенчмарков.
+    BenchRunner(int argc, char* argv[]) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            if (arg == "--json") {
+                json_ = true;
+            } else {
+                filter_ = std::move(arg);
+            }
+        }
+    }
+
+    ~BenchRunner() {
+        if (json_) {
+            PrintJson(std::cout);
+        }
+    }
+
+    // Функция бенчмарка возвращает число выполненных операций.
+    template <class BenchFunc>
+    void RunBench(BenchFunc func, const std::string& bench_name) {
+        if (bench_name.find(filter_) == std::string::npos) {
+            return;
+        }
+        bool is_peak_reset = ResetPeakRss();
+        BenchMetrics().clear();
+        AllocationCounters before = GetAllocationCounters();
+        auto start = std::chrono::steady_clock::now();
+        size_t ops = func();
+        auto finish = std::chrono::steady_clock::now();
+        AllocationCounters after = GetAllocationCounters();
+
+        double ns = std::chrono::duration<double, std::nano>(finish - start).count();
+        Result result;
+        result.name = bench_name;
+        result.ops = ops;
+        result.ns_per_op = ops > 0 ? ns / ops : 0;
+        result.ops_per_s = ns > 0 ? ops * 1e9 / ns : 0;
+        if (size_t peak_rss_kb = GetPeakRssKb(); is_peak_reset && peak_rss_kb > 0) {
+            result.peak_rss_kb = peak_rss_kb;
+        }
+        result.allocations = after.allocations - before.allocations;
+        result.allocated_bytes = after.bytes - before.bytes;
+        result.metrics = std::move(BenchMetrics());
+        BenchMetrics().clear();
+        results_.push_back(result);
+
+        double allocs_per_op = ops > 0 ? static_cast<double>(result.allocations) / ops : 0;
+        std::cerr << std::left << std::setw(40) << bench_name << std::right
+                  << std::setw(12) << std::fixed << std::setprecision(1) << result.ns_per_op << " ns/op"
+                  << std::setw(16) << std::setprecision(0) << result.ops_per_s << " ops/s"
+                  << std::setw(12) << std::setprecision(2) << allocs_per_op << " allocs/op";
+        if (result.peak_rss_kb.has_value()) {
+            std::cerr << std::setw(10) << *result.peak_rss_kb / 1024 << " MB peak" << std::endl;
+        } else {
+            std::cerr << std::setw(10) << "n/a" << " MB peak" << std::endl;
+        }
+        for (const auto& [name, value] : result.metrics) {
+            std::cerr << "  " << std::left << std::setw(38) << name << std::right
+                      << std::setw(12) << std::setprecision(1) << value << std::endl;
+        }
+    }
+
+    const std::vector<Result>& GetResults() const {
+        return results_;
+    }
+
+    void PrintJson(std::ostream& out) const {
+        out << "{\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results_.size(); ++i) {
+            const Result& r = results_[i];
+            out << (i > 0 ? ",\n" : "\n") << std::setprecision(6) << std::defaultfloat
+                << "    {\"name\": \"" << r.name << "\", \"ops\": " << r.ops
+                << ", \"ns_per_op\": " << r.ns_per_op << ", \"ops_per_s\": " << r.ops_per_s
+                << ", \"peak_rss_kb\": ";
+            if (r.peak_rss_kb.has_value()) {
+                out << *r.peak_rss_kb;
+            } else {
+                out << "null";
+            }
+            out << ", \"allocations\": " << r.allocations
+                << ", \"allocated_bytes\": " << r.allocated_bytes;
+            if (!r.metrics.empty()) {
+                out << ", \"metrics\": {";
+                for (size_t j = 0; j < r.metrics.size(); ++j) {
+                    out << (j > 0 ? ", " : "") << "\"" << r.metrics[j].first << "\": " << r.metrics[j].second;
+                }
+                out << "}";
+            }
+            out << "}";
+        }
+        out << "\n  ]\n}" << std::endl;
+    }
+
+private:
+    bool json_ = false;
+    std::string filter_;
+    std::vector<Result> results_;
+};
+
+#define RUN_BENCH(br, func) br.RunBench(func, #func)
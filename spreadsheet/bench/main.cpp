@@ -0,0 +1,1196 @@
+#include "bench_runner.h"
+
+#include "aggregates.h"
+#include "common.h"
+#include "formula.h"
+#include "FormulaAST.h"
+#include "number_codec.h"
+#include "sheet.h"
+#include "sheet_io.h"
+#include "snapshot.h"
+#include "tiled_storage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// Заполненный прямоугольный блок, типичный для наших листов
+constexpr int BLOCK_ROWS = 1000;
+constexpr int BLOCK_COLS = 100;
+constexpr size_t LOOKUPS = 5'000'000;
+
+struct Payload {
+    double value = 0;
+};
+
+using MapStorage = std::unordered_map<Position, std::unique_ptr<Payload>, Position::Hasher,
+                                      Position::EqualTo>;
+
+const MapStorage& GetMapStorage() {
+    static MapStorage storage = [] {
+        MapStorage result;
+        for (int r = 0; r < BLOCK_ROWS; ++r) {
+            for (int c = 0; c < BLOCK_COLS; ++c) {
+                result[Position{r, c}] = std::make_unique<Payload>(Payload{double(r + c)});
+            }
+        }
+        return result;
+    }();
+    return storage;
+}
+
+const TiledStorage<Payload>& GetTiledStorage() {
+    static TiledStorage<Payload> storage;
+    if (storage.Size() == 0) {
+        for (int r = 0; r < BLOCK_ROWS; ++r) {
+            for (int c = 0; c < BLOCK_COLS; ++c) {
+                storage.Emplace(Position{r, c}).value = double(r + c);
+            }
+        }
+    }
+    return storage;
+}
+
+std::vector<Position> GetLookupPositions() {
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> rows(0, BLOCK_ROWS - 1);
+    std::uniform_int_distribution<int> cols(0, BLOCK_COLS - 1);
+    std::vector<Position> result(LOOKUPS);
+    for (auto& pos : result) {
+        pos = Position{rows(gen), cols(gen)};
+    }
+    return result;
+}
+
+size_t BenchMapLookup() {
+    const auto& storage = GetMapStorage();
+    static const auto positions = GetLookupPositions();
+    double sum = 0;
+    for (Position pos : positions) {
+        auto it = storage.find(pos);
+        if (it != storage.end()) {
+            sum += it->second->value;
+        }
+    }
+    DoNotOptimize(sum);
+    return positions.size();
+}
+
+size_t BenchTiledLookup() {
+    const auto& storage = GetTiledStorage();
+    static const auto positions = GetLookupPositions();
+    double sum = 0;
+    for (Position pos : positions) {
+        if (const Payload* item = storage.Find(pos)) {
+            sum += item->value;
+        }
+    }
+    DoNotOptimize(sum);
+    return positions.size();
+}
+
+size_t BenchMapScan() {
+    const auto& storage = GetMapStorage();
+    constexpr int PASSES = 20;
+    double sum = 0;
+    for (int i = 0; i < PASSES; ++i) {
+        for (int r = 0; r < BLOCK_ROWS; ++r) {
+            for (int c = 0; c < BLOCK_COLS; ++c) {
+                auto it = storage.find(Position{r, c});
+                if (it != storage.end()) {
+                    sum += it->second->value;
+                }
+            }
+        }
+    }
+    DoNotOptimize(sum);
+    return size_t{PASSES} * BLOCK_ROWS * BLOCK_COLS;
+}
+
+size_t BenchTiledScan() {
+    const auto& storage = GetTiledStorage();
+    constexpr int PASSES = 20;
+    double sum = 0;
+    for (int i = 0; i < PASSES; ++i) {
+        storage.ForEach([&sum](Position, const Payload& item) {
+            sum += item.value;
+        });
+    }
+    DoNotOptimize(sum);
+    return size_t{PASSES} * BLOCK_ROWS * BLOCK_COLS;
+}
+
+size_t BenchSheetFillAndPrint() {
+    Sheet sheet;
+    for (int r = 0; r < BLOCK_ROWS; ++r) {
+        for (int c = 0; c < BLOCK_COLS; ++c) {
+            sheet.SetCell(Position{r, c}, std::to_string(r * c));
+        }
+    }
+    std::ostringstream out;
+    sheet.PrintValues(out);
+    DoNotOptimize(out.str().size());
+    return size_t{BLOCK_ROWS} * BLOCK_COLS;
+}
+
+// Глубокая формула: цепочка вложенных скобок, стек вычисления растёт до глубины формулы
+const FormulaAST& GetDeepFormula() {
+    static const FormulaAST ast = [] {
+        std::string formula = "A1";
+        for (int i = 2; i <= 200; ++i) {
+            formula = "A" + std::to_string(i) + "+(" + formula + ")*0.5";
+        }
+        return ParseFormulaAST(formula);
+    }();
+    return ast;
+}
+
+// Широкая формула: длинная сумма ссылок, стек остаётся неглубоким
+const FormulaAST& GetWideFormula() {
+    static const FormulaAST ast = [] {
+        std::string formula = "A1";
+        for (int i = 2; i <= 200; ++i) {
+            formula += (i % 2 == 0 ? "+B" : "-C") + std::to_string(i) + "*2";
+        }
+        return ParseFormulaAST(formula);
+    }();
+    return ast;
+}
+
+constexpr size_t EVALUATIONS = 100'000;
+
+double BenchCellValue(Position pos) {
+    return pos.row * 0.25 + pos.col;
+}
+
+size_t BenchDeepFormulaTree() {
+    const auto& ast = GetDeepFormula();
+    double sum = 0;
+    for (size_t i = 0; i < EVALUATIONS; ++i) {
+        sum += ast.ExecuteTree(BenchCellValue);
+    }
+    DoNotOptimize(sum);
+    return EVALUATIONS;
+}
+
+size_t BenchDeepFormulaBytecode() {
+    const auto& ast = GetDeepFormula();
+    double sum = 0;
+    for (size_t i = 0; i < EVALUATIONS; ++i) {
+        sum += ast.Execute(BenchCellValue);
+    }
+    DoNotOptimize(sum);
+    return EVALUATIONS;
+}
+
+size_t BenchWideFormulaTree() {
+    const auto& ast = GetWideFormula();
+    double sum = 0;
+    for (size_t i = 0; i < EVALUATIONS; ++i) {
+        sum += ast.ExecuteTree(BenchCellValue);
+    }
+    DoNotOptimize(sum);
+    return EVALUATIONS;
+}
+
+size_t BenchWideFormulaBytecode() {
+    const auto& ast = GetWideFormula();
+    double sum = 0;
+    for (size_t i = 0; i < EVALUATIONS; ++i) {
+        sum += ast.Execute(BenchCellValue);
+    }
+    DoNotOptimize(sum);
+    return EVALUATIONS;
+}
+
+// Формула над столбцом текстовых ячеек с числами, как в импортированных таблицах
+size_t BenchTextOperands() {
+    constexpr int ROWS = 100;
+    constexpr int PASSES = 10'000;
+    Sheet sheet;
+    std::string expression = "A1";
+    for (int row = 0; row < ROWS; ++row) {
+        sheet.SetCell(Position{row, 0}, std::to_string(row * 0.5));
+        if (row > 0) {
+            expression += "+" + Position{row, 0}.ToString();
+        }
+    }
+    auto formula = ParseFormula(expression);
+    double sum = 0;
+    for (int i = 0; i < PASSES; ++i) {
+        sum += std::get<double>(formula->Evaluate(sheet));
+    }
+    DoNotOptimize(sum);
+    return size_t{PASSES} * ROWS;
+}
+
+// Тысячи независимых цепочек формул, растущих из одной общей ячейки A1:
+// правка A1 делает грязными все формулы листа.
+Sheet& GetChainsSheet() {
+    constexpr int CHAINS = 2000;
+    constexpr int LENGTH = 50;
+    static Sheet sheet;
+    if (sheet.GetPrintableSize().rows == 0) {
+        sheet.SetCell(Position{0, 0}, "1");
+        for (int col = 1; col <= CHAINS; ++col) {
+            sheet.SetCell(Position{0, col}, "=A1+" + std::to_string(col));
+            for (int row = 1; row < LENGTH; ++row) {
+                sheet.SetCell(Position{row, col}, "=" + Position{row - 1, col}.ToString() + "*0.5+1");
+            }
+        }
+        sheet.Recalculate();
+    }
+    return sheet;
+}
+
+size_t RecalculateChains(size_t threads) {
+    constexpr int PASSES = 5;
+    Sheet& sheet = GetChainsSheet();
+    sheet.SetRecalculationThreads(threads);
+    for (int i = 0; i < PASSES; ++i) {
+        sheet.SetCell(Position{0, 0}, std::to_string(i));
+        sheet.Recalculate();
+    }
+    return size_t{PASSES} * sheet.GetPrintableSize().rows * (sheet.GetPrintableSize().cols - 1);
+}
+
+size_t BenchParallelRecalculation1() {
+    return RecalculateChains(1);
+}
+
+size_t BenchParallelRecalculation2() {
+    return RecalculateChains(2);
+}
+
+size_t BenchParallelRecalculation4() {
+    return RecalculateChains(4);
+}
+
+size_t BenchParallelRecalculation8() {
+    return RecalculateChains(8);
+}
+
+// Одна длинная цепочка формул: правка её начала пересчитывает все звенья
+size_t BenchLongChainEdit() {
+    constexpr int LENGTH = 10'000;
+    constexpr int PASSES = 20;
+    Sheet sheet;
+    sheet.SetCell(Position{0, 0}, "0");
+    for (int row = 1; row < LENGTH; ++row) {
+        sheet.SetCell(Position{row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+    }
+    double sum = 0;
+    for (int i = 0; i < PASSES; ++i) {
+        sheet.SetCell(Position{0, 0}, std::to_string(i));
+        sum += std::get<double>(sheet.GetCell(Position{LENGTH - 1, 0})->GetValue());
+    }
+    DoNotOptimize(sum);
+    return size_t{PASSES} * LENGTH;
+}
+
+// Широкое ветвление: тысячи формул ссылаются на одну ячейку
+size_t BenchWideFanOutEdit() {
+    constexpr int WIDTH = 10'000;
+    constexpr int PASSES = 20;
+    Sheet sheet;
+    sheet.SetCell(Position{0, 0}, "1");
+    for (int row = 0; row < WIDTH; ++row) {
+        sheet.SetCell(Position{row, 1}, "=A1*" + std::to_string(row));
+    }
+    double sum = 0;
+    for (int i = 0; i < PASSES; ++i) {
+        sheet.SetCell(Position{0, 0}, std::to_string(i));
+        sheet.Recalculate();
+        sum += std::get<double>(sheet.GetCell(Position{WIDTH - 1, 1})->GetValue());
+    }
+    DoNotOptimize(sum);
+    return size_t{PASSES} * WIDTH;
+}
+
+// Случайные правки по большому разреженному листу: числа, формулы на соседние
+// ячейки и очистки
+size_t BenchRandomSparseEdits() {
+    constexpr int EDITS = 100'000;
+    constexpr int ROWS = 10'000;
+    constexpr int COLS = 1'000;
+    Sheet sheet;
+    std::mt19937 random(42);
+    std::uniform_int_distribution<int> row(0, ROWS - 1);
+    std::uniform_int_distribution<int> col(0, COLS - 1);
+    std::uniform_int_distribution<int> offset(-3, 3);
+    std::uniform_int_distribution<int> kind(0, 9);
+    for (int i = 0; i < EDITS; ++i) {
+        Position pos{row(random), col(random)};
+        int k = kind(random);
+        if (k < 7) {
+            sheet.SetCell(pos, std::to_string(i));
+        } else if (k < 9) {
+            Position ref{std::max(0, pos.row + offset(random)), std::max(0, pos.col + offset(random))};
+            try {
+                sheet.SetCell(pos, "=" + ref.ToString() + "+1");
+            } catch (const CircularDependencyException&) {
+            }
+        } else {
+            sheet.ClearCell(pos);
+        }
+    }
+    sheet.Recalculate();
+    DoNotOptimize(sheet.GetPrintableSize().rows);
+    return EDITS;
+}
+
+// Плотная модель из чисел и формул для замера полной выгрузки значений
+const Sheet& GetExportSheet() {
+    static const std::unique_ptr<Sheet> sheet = [] {
+        auto sheet = std::make_unique<Sheet>();
+        for (int r = 0; r < BLOCK_ROWS; ++r) {
+            for (int c = 0; c < BLOCK_COLS; ++c) {
+                sheet->SetCell(Position{r, c}, c % 4 == 3 ? "=" + Position{r, c - 1}.ToString() + "/7"
+                                                          : std::to_string(r * 0.25 + c));
+            }
+        }
+        sheet->Recalculate();
+        return sheet;
+    }();
+    return *sheet;
+}
+
+size_t BenchExportPrintValues() {
+    std::ostringstream out;
+    GetExportSheet().PrintValues(out);
+    DoNotOptimize(out.str().size());
+    return size_t{BLOCK_ROWS} * BLOCK_COLS;
+}
+
+// Публикация версии после правки одной ячейки плотной модели: копируются
+// только затронутые плитки
+Sheet& GetVersionedSheet() {
+    static const std::unique_ptr<Sheet> sheet = [] {
+        auto sheet = std::make_unique<Sheet>();
+        for (int r = 0; r < BLOCK_ROWS; ++r) {
+            for (int c = 0; c < BLOCK_COLS; ++c) {
+                sheet->SetCell(Position{r, c}, std::to_string(r * c));
+            }
+        }
+        sheet->PublishVersion();
+        return sheet;
+    }();
+    return *sheet;
+}
+
+size_t BenchPublishVersion() {
+    constexpr int PUBLICATIONS = 2'000;
+    Sheet& sheet = GetVersionedSheet();
+    for (int i = 0; i < PUBLICATIONS; ++i) {
+        sheet.SetCell(Position{(i * 37) % BLOCK_ROWS, (i * 11) % BLOCK_COLS}, std::to_string(i));
+        sheet.PublishVersion();
+    }
+    return PUBLICATIONS;
+}
+
+size_t BenchVersionedRead() {
+    constexpr int PINS = 20'000;
+    constexpr int READS_PER_PIN = 100;
+    const Sheet& sheet = GetVersionedSheet();
+    size_t found = 0;
+    for (int i = 0; i < PINS; ++i) {
+        auto version = sheet.ReadVersion();
+        for (int j = 0; j < READS_PER_PIN; ++j) {
+            found += version->Find(Position{(i + j * 7) % BLOCK_ROWS, j % BLOCK_COLS}) != nullptr;
+        }
+    }
+    DoNotOptimize(found);
+    return size_t{PINS} * READS_PER_PIN;
+}
+
+// Импорт, много раз переписывающий одни и те же ячейки, от которых зависят
+// итоговые формулы
+constexpr int REWRITE_ROWS = 1'000;
+constexpr int REWRITE_PASSES = 10;
+
+size_t RewriteImport(bool batch) {
+    Sheet sheet;
+    for (int row = 0; row < REWRITE_ROWS; ++row) {
+        sheet.SetCell(Position{row, 0}, "0");
+    }
+    sheet.SetCell(Position{0, 3}, "=SUM(A1:A" + std::to_string(REWRITE_ROWS) + ")");
+    for (int row = 0; row < REWRITE_ROWS; ++row) {
+        sheet.SetCell(Position{row, 1}, "=A" + std::to_string(row + 1) + "*2+D1");
+    }
+    sheet.Recalculate();
+    if (batch) {
+        sheet.BeginBatch();
+    }
+    for (int pass = 0; pass < REWRITE_PASSES; ++pass) {
+        for (int row = 0; row < REWRITE_ROWS; ++row) {
+            sheet.SetCell(Position{row, 0}, "=" + std::to_string(pass) + "+" + std::to_string(row));
+        }
+    }
+    if (batch) {
+        sheet.Commit();
+    }
+    DoNotOptimize(std::get<double>(sheet.GetCell(Position{0, 1})->GetValue()));
+    return size_t{REWRITE_PASSES} * REWRITE_ROWS;
+}
+
+size_t BenchRewriteSetCell() {
+    return RewriteImport(false);
+}
+
+size_t BenchRewriteBatch() {
+    return RewriteImport(true);
+}
+
+// Реестр: число, удвоенное число и итог по столбцу B. Вставка и удаление
+// строки возвращают лист к исходному виду.
+constexpr int LEDGER_ROWS = 10000;
+
+Sheet& GetLedgerSheet() {
+    static Sheet sheet;
+    if (sheet.GetPrintableSize().rows == 0) {
+        for (int row = 0; row < LEDGER_ROWS; ++row) {
+            std::string r = std::to_string(row + 1);
+            sheet.SetCell(Position{row, 0}, r);
+            sheet.SetCell(Position{row, 1}, "=A" + r + "*2");
+        }
+        sheet.SetCell(Position{0, 3}, "=SUM(B1:B" + std::to_string(LEDGER_ROWS) + ")");
+        sheet.Recalculate();
+    }
+    return sheet;
+}
+
+size_t InsertDeleteLedgerRow(int row) {
+    constexpr int PASSES = 100;
+    Sheet& sheet = GetLedgerSheet();
+    for (int i = 0; i < PASSES; ++i) {
+        sheet.InsertRows(row);
+        sheet.DeleteRows(row);
+    }
+    sheet.Recalculate();
+    return size_t{PASSES} * 2;
+}
+
+// Затронуты 10 строк в конце и итог
+size_t BenchInsertDeleteRowNearEnd() {
+    return InsertDeleteLedgerRow(LEDGER_ROWS - 10);
+}
+
+// Сдвигается весь реестр
+size_t BenchInsertDeleteRowNearStart() {
+    return InsertDeleteLedgerRow(10);
+}
+
+// Над сдвигаемой строкой много формул с диапазонами: их не нужно перебирать
+size_t BenchInsertDeleteRowBelowRangeFormulas() {
+    constexpr int FORMULAS = 15'000;
+    constexpr int PASSES = 1'000;
+    Sheet sheet;
+    for (int row = 0; row < FORMULAS; ++row) {
+        std::string r = std::to_string(row + 1);
+        sheet.SetCell(Position{row, 0}, "=SUM(B" + r + ":C" + r + ")");
+    }
+    for (int i = 0; i < PASSES; ++i) {
+        sheet.InsertRows(FORMULAS - 10);
+        sheet.DeleteRows(FORMULAS - 10);
+    }
+    sheet.Recalculate();
+    return size_t{PASSES} * 2;
+}
+
+// То же, что BenchInsertDeleteRowNearEnd, переписыванием сдвигаемых ячеек
+// через SetCell с пересобранными текстами формул
+size_t BenchInsertDeleteRowBySetCell() {
+    constexpr int PASSES = 100;
+    const int first = LEDGER_ROWS - 10;
+    Sheet& sheet = GetLedgerSheet();
+    auto set_row = [&sheet](int row, int value_row) {
+        std::string r = std::to_string(row + 1);
+        sheet.SetCell(Position{row, 0}, std::to_string(value_row + 1));
+        sheet.SetCell(Position{row, 1}, "=A" + r + "*2");
+    };
+    for (int i = 0; i < PASSES; ++i) {
+        for (int row = LEDGER_ROWS; row > first; --row) {
+            set_row(row, row - 1);
+        }
+        sheet.ClearCell(Position{first, 0});
+        sheet.ClearCell(Position{first, 1});
+        sheet.SetCell(Position{0, 3}, "=SUM(B1:B" + std::to_string(LEDGER_ROWS + 1) + ")");
+
+        for (int row = first; row < LEDGER_ROWS; ++row) {
+            set_row(row, row);
+        }
+        sheet.ClearCell(Position{LEDGER_ROWS, 0});
+        sheet.ClearCell(Position{LEDGER_ROWS, 1});
+        sheet.SetCell(Position{0, 3}, "=SUM(B1:B" + std::to_string(LEDGER_ROWS) + ")");
+    }
+    sheet.Recalculate();
+    return size_t{PASSES} * 2;
+}
+
+// Интерактивная работа: правка A1, пауза пользователя, чтение случайной
+// ячейки. Задержки чтения и правки выводятся перцентилями; время на операцию
+// включает паузу.
+size_t EditThenRead(EvaluationPolicy policy) {
+    constexpr int CHAINS = 200;
+    constexpr int LENGTH = 25;
+    constexpr int EDITS = 100;
+    constexpr auto PAUSE = std::chrono::milliseconds(5);
+    Sheet sheet;
+    sheet.SetEvaluationPolicy(policy);
+    sheet.SetCell(Position{0, 0}, "1");
+    for (int col = 1; col <= CHAINS; ++col) {
+        sheet.SetCell(Position{0, col}, "=A1+" + std::to_string(col));
+        for (int row = 1; row < LENGTH; ++row) {
+            sheet.SetCell(Position{row, col}, "=" + Position{row - 1, col}.ToString() + "*0.5+1");
+        }
+    }
+    sheet.WaitForQuiescence();
+
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> row_dist(0, LENGTH - 1);
+    std::uniform_int_distribution<int> col_dist(1, CHAINS);
+    std::vector<double> edit_ns;
+    std::vector<double> read_ns;
+    for (int i = 0; i < EDITS; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        sheet.SetCell(Position{0, 0}, std::to_string(i));
+        auto edited = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(PAUSE);
+        auto read_start = std::chrono::steady_clock::now();
+        DoNotOptimize(std::get<double>(sheet.GetCell(Position{row_dist(rng), col_dist(rng)})->GetValue()));
+        auto read_finish = std::chrono::steady_clock::now();
+        edit_ns.push_back(std::chrono::duration<double, std::nano>(edited - start).count());
+        read_ns.push_back(std::chrono::duration<double, std::nano>(read_finish - read_start).count());
+    }
+
+    auto percentile = [](std::vector<double>& samples, double p) {
+        size_t index = static_cast<size_t>(p * (samples.size() - 1));
+        std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+        return samples[index];
+    };
+    ReportBenchMetric("edit_p50_ns", percentile(edit_ns, 0.5));
+    ReportBenchMetric("edit_p99_ns", percentile(edit_ns, 0.99));
+    ReportBenchMetric("read_p50_ns", percentile(read_ns, 0.5));
+    ReportBenchMetric("read_p99_ns", percentile(read_ns, 0.99));
+    return EDITS;
+}
+
+size_t BenchEditThenReadLazy() {
+    return EditThenRead(EvaluationPolicy::Lazy);
+}
+
+size_t BenchEditThenReadEagerSync() {
+    return EditThenRead(EvaluationPolicy::EagerSync);
+}
+
+size_t BenchEditThenReadEagerBackground() {
+    return EditThenRead(EvaluationPolicy::EagerBackground);
+}
+
+// Память листа на ячейку: всё, что выделено при заполнении блока ячеек и не
+// освобождено, включая плитки хранилища, слепок значений и связи формул
+constexpr int FOOTPRINT_SIZE = 256;
+
+size_t CellFootprint(const std::function<std::string(int, int)>& make_text) {
+    size_t live_before = GetAllocationCounters().live_bytes;
+    auto sheet = std::make_unique<Sheet>();
+    for (int row = 0; row < FOOTPRINT_SIZE; ++row) {
+        for (int col = 0; col < FOOTPRINT_SIZE; ++col) {
+            sheet->SetCell(Position{row, col}, make_text(row, col));
+        }
+    }
+    sheet->Recalculate();
+    size_t cells = size_t{FOOTPRINT_SIZE} * FOOTPRINT_SIZE;
+    size_t live_bytes = GetAllocationCounters().live_bytes - live_before + sizeof(Sheet);
+    ReportBenchMetric("bytes_per_cell", static_cast<double>(live_bytes) / cells);
+    ReportBenchMetric("sizeof_cell", sizeof(Cell));
+    return cells;
+}
+
+size_t BenchCellFootprintText() {
+    return CellFootprint([](int row, int col) {
+        return "item " + std::to_string(row * FOOTPRINT_SIZE + col);
+    });
+}
+
+size_t BenchCellFootprintNumber() {
+    return CellFootprint([](int row, int col) {
+        return std::to_string(row * FOOTPRINT_SIZE + col);
+    });
+}
+
+size_t BenchCellFootprintFormula() {
+    return CellFootprint([](int row, int col) {
+        return col == 0 ? "=" + std::to_string(row) : "=" + Position{row, col - 1}.ToString() + "+1";
+    });
+}
+
+// Позиции по всему листу, как в ссылках формул
+const std::vector<Position>& GetCodecPositions() {
+    static const std::vector<Position> positions = [] {
+        std::vector<Position> positions;
+        std::mt19937 random(42);
+        for (int i = 0; i < 10'000; ++i) {
+            positions.push_back({int(random() % Position::MAX_ROWS), int(random() % Position::MAX_COLS)});
+        }
+        return positions;
+    }();
+    return positions;
+}
+
+size_t BenchPositionToString() {
+    size_t length = 0;
+    for (Position pos : GetCodecPositions()) {
+        length += pos.ToString().size();
+    }
+    DoNotOptimize(length);
+    return GetCodecPositions().size();
+}
+
+size_t BenchPositionFromString() {
+    static const std::vector<std::string> texts = [] {
+        std::vector<std::string> texts;
+        for (Position pos : GetCodecPositions()) {
+            texts.push_back(pos.ToString());
+        }
+        return texts;
+    }();
+    int sum = 0;
+    for (const auto& text : texts) {
+        sum += Position::FromString(text).col;
+    }
+    DoNotOptimize(sum);
+    return texts.size();
+}
+
+// Числа разных порядков без экспоненты в записи, как в значениях ячеек
+const std::vector<double>& GetNumbers() {
+    static const std::vector<double> numbers = [] {
+        std::vector<double> numbers;
+        std::mt19937 random(42);
+        std::uniform_real_distribution<double> mantissa(1.0, 10.0);
+        std::uniform_int_distribution<int> exponent(-4, 12);
+        for (int i = 0; i < 10'000; ++i) {
+            numbers.push_back(mantissa(random) * std::pow(10.0, exponent(random)));
+        }
+        return numbers;
+    }();
+    return numbers;
+}
+
+// Столбец чисел, сложенный одной функцией и цепочкой ссылок
+constexpr int SUM_ROWS = 500;
+constexpr int SUM_PASSES = 2'000;
+
+const Sheet& GetSumSheet() {
+    static const std::unique_ptr<Sheet> sheet = [] {
+        auto sheet = std::make_unique<Sheet>();
+        for (int row = 0; row < SUM_ROWS; ++row) {
+            sheet->SetCell(Position{row, 0}, std::to_string(row * 0.5));
+        }
+        return sheet;
+    }();
+    return *sheet;
+}
+
+size_t EvaluateSum(const std::string& expression) {
+    const Sheet& sheet = GetSumSheet();
+    auto formula = ParseFormula(expression);
+    double sum = 0;
+    for (int i = 0; i < SUM_PASSES; ++i) {
+        sum += std::get<double>(formula->Evaluate(sheet));
+    }
+    DoNotOptimize(sum);
+    return size_t{SUM_PASSES} * SUM_ROWS;
+}
+
+size_t BenchSumChain() {
+    std::string expression = "A1";
+    for (int row = 1; row < SUM_ROWS; ++row) {
+        expression += "+" + Position{row, 0}.ToString();
+    }
+    return EvaluateSum(expression);
+}
+
+size_t BenchSumRange() {
+    return EvaluateSum("SUM(A1:A" + std::to_string(SUM_ROWS) + ")");
+}
+
+// Формулы с диапазоном почти на весь лист и правки внутри него. Связи
+// хранятся на уровне диапазонов, поэтому цена не зависит от их площади.
+size_t BenchWideRangeFormulas() {
+    constexpr int FORMULAS = 1'000;
+    constexpr int EDITS = 10'000;
+    Sheet sheet;
+    for (int row = 0; row < FORMULAS; ++row) {
+        sheet.SetCell(Position{row, 0}, "=SUM(B1:CV16384)");
+    }
+    for (int i = 0; i < EDITS; ++i) {
+        sheet.SetCell(Position{i % 100, 1 + i % 50}, std::to_string(i));
+    }
+    DoNotOptimize(std::get<double>(sheet.GetCell(Position{0, 0})->GetValue()));
+    return FORMULAS + EDITS;
+}
+
+// Столбец нарастающих итогов: правки рядом со столбцом не должны перебирать
+// все его длинные диапазоны
+size_t BenchRunningTotalNeighbourEdits() {
+    constexpr int FORMULAS = 5'000;
+    constexpr int EDITS = 100'000;
+    Sheet sheet;
+    for (int row = 0; row < FORMULAS; ++row) {
+        sheet.SetCell(Position{row, 1}, "=SUM(A1:A" + std::to_string(row + 1) + ")");
+    }
+    for (int i = 0; i < EDITS; ++i) {
+        sheet.SetCell(Position{i % FORMULAS, 2}, std::to_string(i));
+    }
+    DoNotOptimize(std::get<double>(sheet.GetCell(Position{FORMULAS - 1, 1})->GetValue()));
+    return FORMULAS + EDITS;
+}
+
+template <typename Kernel>
+size_t ReduceNumbers(Kernel kernel) {
+    constexpr int PASSES = 20'000;
+    const std::vector<double>& numbers = GetNumbers();
+    double sum = 0;
+    for (int i = 0; i < PASSES; ++i) {
+        sum += kernel(numbers.data(), numbers.size());
+    }
+    DoNotOptimize(sum);
+    return PASSES * numbers.size();
+}
+
+size_t BenchSumValuesScalar() {
+    return ReduceNumbers(SumValuesScalar);
+}
+
+size_t BenchSumValues() {
+    return ReduceNumbers(SumValues);
+}
+
+size_t BenchMaxValuesScalar() {
+    return ReduceNumbers(MaxValuesScalar);
+}
+
+size_t BenchMaxValues() {
+    return ReduceNumbers(MaxValues);
+}
+
+const std::vector<std::string>& GetNumberTexts() {
+    static const std::vector<std::string> texts = [] {
+        std::vector<std::string> texts;
+        for (double number : GetNumbers()) {
+            texts.push_back(FormatNumber(number));
+        }
+        return texts;
+    }();
+    return texts;
+}
+
+size_t BenchFormatNumberStream() {
+    std::ostringstream out;
+    for (double number : GetNumbers()) {
+        out << number << '\t';
+    }
+    DoNotOptimize(out.str().size());
+    return GetNumbers().size();
+}
+
+size_t BenchFormatNumberCodec() {
+    std::string out;
+    for (double number : GetNumbers()) {
+        AppendNumber(out, number, 6);
+        out += '\t';
+    }
+    DoNotOptimize(out.size());
+    return GetNumbers().size();
+}
+
+size_t BenchParseNumberStod() {
+    double sum = 0;
+    for (const auto& text : GetNumberTexts()) {
+        sum += std::stod(text);
+    }
+    DoNotOptimize(sum);
+    return GetNumberTexts().size();
+}
+
+size_t BenchParseNumberCodec() {
+    double sum = 0;
+    for (const auto& text : GetNumberTexts()) {
+        sum += ParseCellNumber(text).value_or(0);
+    }
+    DoNotOptimize(sum);
+    return GetNumberTexts().size();
+}
+
+// Набор формул типичной длины для замера скорости разбора
+const std::vector<std::string>& GetParseCorpus() {
+    static const std::vector<std::string> corpus = [] {
+        std::vector<std::string> formulas;
+        std::mt19937 random(42);
+        for (int i = 0; i < 1000; ++i) {
+            std::string formula = Position{int(random() % 1000), int(random() % 100)}.ToString();
+            for (int term = random() % 8; term > 0; --term) {
+                formula += "+-*/"[random() % 4];
+                if (random() % 2 == 0) {
+                    formula += "(" + std::to_string(random() % 1000) + ".5-"
+                               + Position{int(random() % 1000), int(random() % 100)}.ToString() + ")";
+                } else {
+                    formula += std::to_string(random() % 100);
+                }
+            }
+            formulas.push_back(std::move(formula));
+        }
+        return formulas;
+    }();
+    return corpus;
+}
+
+template <typename Parser>
+size_t ParseCorpus(Parser parser) {
+    constexpr int PASSES = 20;
+    size_t cells = 0;
+    for (int i = 0; i < PASSES; ++i) {
+        for (const auto& formula : GetParseCorpus()) {
+            FormulaAST ast = parser(formula);
+            cells += !ast.GetCells().empty();
+        }
+    }
+    DoNotOptimize(cells);
+    return PASSES * GetParseCorpus().size();
+}
+
+size_t BenchParseNative() {
+    return ParseCorpus([](const std::string& formula) {
+        return ParseFormulaAST(formula);
+    });
+}
+
+// Формула, протянутая вниз по столбцу: строки отличаются только сдвигом ссылок
+constexpr int FILL_DOWN_ROWS = 10'000;
+
+std::string GetFillDownFormula(int row) {
+    std::string r = std::to_string(row + 1);
+    return "A" + r + "*B" + r + "+C" + r + "/(1+D" + r + ")";
+}
+
+size_t BenchFillDownSeparateASTs() {
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    for (int row = 0; row < FILL_DOWN_ROWS; ++row) {
+        formulas.push_back(ParseFormula(GetFillDownFormula(row)));
+    }
+    DoNotOptimize(formulas.size());
+    return FILL_DOWN_ROWS;
+}
+
+size_t BenchFillDownSharedASTs() {
+    FormulaInternTable table;
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    for (int row = 0; row < FILL_DOWN_ROWS; ++row) {
+        formulas.push_back(table.Parse(GetFillDownFormula(row), Position{row, 4}));
+    }
+    DoNotOptimize(formulas.size());
+    return FILL_DOWN_ROWS;
+}
+
+// Загрузка модели: формулы ссылаются на ячейки, которые задаются позже
+std::vector<std::pair<Position, std::string>> GetModelCells() {
+    constexpr int ROWS = 10'000;
+    constexpr int COLS = 10;
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = ROWS - 1; row >= 0; --row) {
+        for (int col = 0; col < COLS; ++col) {
+            Position pos{row, col};
+            if (col == 0 || row + 1 == ROWS) {
+                cells.emplace_back(pos, std::to_string(row));
+            } else {
+                cells.emplace_back(pos, "=" + Position{row + 1, col}.ToString() + "+"
+                                            + Position{row, col - 1}.ToString() + "/2");
+            }
+        }
+    }
+    return cells;
+}
+
+size_t BenchLoadModelSetCell() {
+    auto cells = GetModelCells();
+    Sheet sheet;
+    for (auto& [pos, text] : cells) {
+        sheet.SetCell(pos, std::move(text));
+    }
+    DoNotOptimize(sheet.GetPrintableSize().rows);
+    return cells.size();
+}
+
+size_t BenchLoadModelSetCells() {
+    auto cells = GetModelCells();
+    size_t count = cells.size();
+    Sheet sheet;
+    sheet.SetCells(std::move(cells));
+    DoNotOptimize(sheet.GetPrintableSize().rows);
+    return count;
+}
+
+constexpr int IMPORT_ROWS = 10'000;
+
+// Выгрузка листа в TSV-файл: числа, текст и протянутые формулы
+const std::string& GetExportFile() {
+    static const std::string path = [] {
+        auto path = (std::filesystem::temp_directory_path() / "spreadsheet_bench_export.tsv").string();
+        std::ofstream file(path, std::ios::binary);
+        for (int row = 0; row < IMPORT_ROWS; ++row) {
+            std::string r = std::to_string(row + 1);
+            file << row << '\t' << "item " << row % 97 << '\t' << "=A" << r << "*2+D" << r << '\t'
+                 << row * 0.5 << "\t'=escaped\t=B" << r << "\n";
+        }
+        return path;
+    }();
+    return path;
+}
+
+size_t BenchImportSetCellPerLine() {
+    std::ifstream file(GetExportFile(), std::ios::binary);
+    Sheet sheet;
+    std::string line;
+    size_t cells = 0;
+    for (int row = 0; std::getline(file, line); ++row) {
+        std::istringstream fields(line);
+        std::string field;
+        for (int col = 0; std::getline(fields, field, '\t'); ++col) {
+            if (!field.empty()) {
+                sheet.SetCell(Position{row, col}, field);
+                ++cells;
+            }
+        }
+    }
+    DoNotOptimize(sheet.GetPrintableSize().rows);
+    return cells;
+}
+
+size_t BenchImportMappedFile() {
+    Sheet sheet;
+    ImportTableFile(sheet, GetExportFile());
+    DoNotOptimize(sheet.GetPrintableSize().rows);
+    return size_t{IMPORT_ROWS} * 6;
+}
+
+// Лист из выгрузки, пересчитанный и сохранённый в снимок и в текст
+struct SavedModel {
+    std::string texts;
+    std::string snapshot;
+};
+
+const SavedModel& GetSavedModel() {
+    static const SavedModel model = [] {
+        Sheet sheet;
+        ImportTableFile(sheet, GetExportFile());
+        SavedModel model;
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        model.texts = texts.str();
+        std::ostringstream snapshot;
+        SheetSnapshot::Save(sheet, snapshot);
+        model.snapshot = snapshot.str();
+        return model;
+    }();
+    return model;
+}
+
+size_t BenchReopenFromText() {
+    Sheet sheet;
+    ImportTable(sheet, GetSavedModel().texts);
+    sheet.Recalculate();
+    DoNotOptimize(sheet.GetPrintableSize().rows);
+    return size_t{IMPORT_ROWS} * 6;
+}
+
+size_t BenchReopenFromSnapshot() {
+    auto sheet = SheetSnapshot::Load(GetSavedModel().snapshot);
+    DoNotOptimize(sheet->GetPrintableSize().rows);
+    return size_t{IMPORT_ROWS} * 6;
+}
+
+// Разреженный лист: печатная область велика, занятых ячеек мало
+constexpr int SPARSE_SIZE = 2'000;
+
+const Sheet& GetSparseSheet() {
+    static const std::unique_ptr<Sheet> sheet = [] {
+        auto sheet = std::make_unique<Sheet>();
+        for (int i = 0; i < SPARSE_SIZE; ++i) {
+            Position pos{(i * 7) % SPARSE_SIZE, (i * 13) % SPARSE_SIZE};
+            // Формулы ссылаются на пустые ячейки за печатной областью
+            sheet->SetCell(pos, i % 3 == 0 ? "=" + Position{i % 97, SPARSE_SIZE}.ToString() + "+1/3"
+                                           : std::to_string(i));
+        }
+        return sheet;
+    }();
+    return *sheet;
+}
+
+// Вывод значений по каждой позиции печатной области, как до потокового вывода
+size_t BenchSparsePrintPerPosition() {
+    const Sheet& sheet = GetSparseSheet();
+    std::ostringstream out;
+    Size size = sheet.GetPrintableSize();
+    for (int r = 0; r < size.rows; ++r) {
+        for (int c = 0; c < size.cols; ++c) {
+            if (const CellInterface* cell = sheet.GetCell(Position{r, c})) {
+                std::visit([&out](const auto& arg) { out << arg; }, cell->GetValue());
+            }
+            if (c < size.cols - 1) {
+                out << "\t";
+            }
+        }
+        out << "\n";
+    }
+    DoNotOptimize(out.str().size());
+    return size_t{SPARSE_SIZE} * SPARSE_SIZE;
+}
+
+size_t BenchSparsePrintValues() {
+    std::ostringstream out;
+    GetSparseSheet().PrintValues(out);
+    DoNotOptimize(out.str().size());
+    return size_t{SPARSE_SIZE} * SPARSE_SIZE;
+}
+
+size_t BenchSparsePrintTexts() {
+    std::ostringstream out;
+    GetSparseSheet().PrintTexts(out);
+    DoNotOptimize(out.str().size());
+    return size_t{SPARSE_SIZE} * SPARSE_SIZE;
+}
+
+// Сумма числовых значений: проба каждой позиции печатной области против
+// обхода занятых ячеек
+size_t BenchSparseSumByProbing() {
+    const Sheet& sheet = GetSparseSheet();
+    double sum = 0;
+    Size size = sheet.GetPrintableSize();
+    for (int r = 0; r < size.rows; ++r) {
+        for (int c = 0; c < size.cols; ++c) {
+            const CellInterface* cell = sheet.GetCell(Position{r, c});
+            if (cell == nullptr || cell->GetText().empty()) {
+                continue;
+            }
+            CellInterface::Value value = cell->GetValue();
+            if (const double* number = std::get_if<double>(&value)) {
+                sum += *number;
+            }
+        }
+    }
+    DoNotOptimize(sum);
+    return size_t{SPARSE_SIZE} * SPARSE_SIZE;
+}
+
+size_t BenchSparseSumForEachCell() {
+    double sum = 0;
+    GetSparseSheet().ForEachCell([&sum](Position, const CellInterface& cell) {
+        CellInterface::Value value = cell.GetValue();
+        if (const double* number = std::get_if<double>(&value)) {
+            sum += *number;
+        }
+    });
+    DoNotOptimize(sum);
+    return size_t{SPARSE_SIZE} * SPARSE_SIZE;
+}
+
+#ifdef SPREADSHEET_WITH_ANTLR
+size_t BenchParseAntlr() {
+    return ParseCorpus([](const std::string& formula) {
+        return ParseFormulaASTAntlr(formula);
+    });
+}
+#endif
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    BenchRunner br(argc, argv);
+    RUN_BENCH(br, BenchMapLookup);
+    RUN_BENCH(br, BenchTiledLookup);
+    RUN_BENCH(br, BenchMapScan);
+    RUN_BENCH(br, BenchTiledScan);
+    RUN_BENCH(br, BenchSheetFillAndPrint);
+    RUN_BENCH(br, BenchLongChainEdit);
+    RUN_BENCH(br, BenchWideFanOutEdit);
+    RUN_BENCH(br, BenchRandomSparseEdits);
+    GetExportSheet();
+    RUN_BENCH(br, BenchExportPrintValues);
+    GetVersionedSheet();
+    RUN_BENCH(br, BenchPublishVersion);
+    RUN_BENCH(br, BenchVersionedRead);
+    RUN_BENCH(br, BenchDeepFormulaTree);
+    RUN_BENCH(br, BenchDeepFormulaBytecode);
+    RUN_BENCH(br, BenchWideFormulaTree);
+    RUN_BENCH(br, BenchWideFormulaBytecode);
+    RUN_BENCH(br, BenchTextOperands);
+    RUN_BENCH(br, BenchPositionToString);
+    RUN_BENCH(br, BenchPositionFromString);
+    RUN_BENCH(br, BenchFormatNumberStream);
+    RUN_BENCH(br, BenchFormatNumberCodec);
+    RUN_BENCH(br, BenchParseNumberStod);
+    RUN_BENCH(br, BenchParseNumberCodec);
+    GetSumSheet();
+    RUN_BENCH(br, BenchSumChain);
+    RUN_BENCH(br, BenchSumRange);
+    RUN_BENCH(br, BenchWideRangeFormulas);
+    RUN_BENCH(br, BenchRunningTotalNeighbourEdits);
+    RUN_BENCH(br, BenchSumValuesScalar);
+    RUN_BENCH(br, BenchSumValues);
+    RUN_BENCH(br, BenchMaxValuesScalar);
+    RUN_BENCH(br, BenchMaxValues);
+    RUN_BENCH(br, BenchParseNative);
+    RUN_BENCH(br, BenchFillDownSeparateASTs);
+    RUN_BENCH(br, BenchFillDownSharedASTs);
+    RUN_BENCH(br, BenchLoadModelSetCell);
+    RUN_BENCH(br, BenchLoadModelSetCells);
+    RUN_BENCH(br, BenchRewriteSetCell);
+    RUN_BENCH(br, BenchRewriteBatch);
+    GetLedgerSheet();
+    RUN_BENCH(br, BenchInsertDeleteRowNearEnd);
+    RUN_BENCH(br, BenchInsertDeleteRowNearStart);
+    RUN_BENCH(br, BenchInsertDeleteRowBySetCell);
+    RUN_BENCH(br, BenchInsertDeleteRowBelowRangeFormulas);
+    RUN_BENCH(br, BenchEditThenReadLazy);
+    RUN_BENCH(br, BenchEditThenReadEagerSync);
+    RUN_BENCH(br, BenchEditThenReadEagerBackground);
+    RUN_BENCH(br, BenchCellFootprintText);
+    RUN_BENCH(br, BenchCellFootprintNumber);
+    RUN_BENCH(br, BenchCellFootprintFormula);
+    GetExportFile();
+    RUN_BENCH(br, BenchImportSetCellPerLine);
+    RUN_BENCH(br, BenchImportMappedFile);
+    GetSavedModel();
+    RUN_BENCH(br, BenchReopenFromText);
+    RUN_BENCH(br, BenchReopenFromSnapshot);
+    std::filesystem::remove(GetExportFile());
+    GetSparseSheet();
+    RUN_BENCH(br, BenchSparsePrintPerPosition);
+    RUN_BENCH(br, BenchSparsePrintValues);
+    RUN_BENCH(br, BenchSparsePrintTexts);
+    RUN_BENCH(br, BenchSparseSumByProbing);
+    RUN_BENCH(br, BenchSparseSumForEachCell);
+#ifdef SPREADSHEET_WITH_ANTLR
+    RUN_BENCH(br, BenchParseAntlr);
+#endif
+    GetChainsSheet();
+    RUN_BENCH(br, BenchParallelRecalculation1);
+    RUN_BENCH(br, BenchParallelRecalculation2);
+    RUN_BENCH(br, BenchParallelRecalculation4);
+    RUN_BENCH(br, BenchParallelRecalculation8);
+}
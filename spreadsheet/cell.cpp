@@ -1,215 +1,266 @@
 #include "cell.h"
 
+#include "number_codec.h"
+#include "sheet.h"
+
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <string>
 #include <optional>
-#include <stack>
 
-// Реализуйте следующие методы
-Cell::Cell(SheetInterface* sheet)
-: impl_(std::make_unique<EmptyImpl>()),
-sheet_(sheet)
+namespace {
+// Число, которое записывает текст ячейки, как операнд формулы
+std::variant<double, FormulaError> ParseTextNumber(std::string_view text)
 {
+    if (!text.empty() && text[0] == ESCAPE_SIGN) {
+        text.remove_prefix(1);
+    }
+    if (auto number = ParseCellNumber(text)) {
+        return *number;
+    }
+    return FormulaError(FormulaError::Category::Value);
 }
+}  // namespace
 
-Cell::~Cell() {
-    Clear();
+// Реализуйте следующие методы
+Cell::Cell(Sheet* sheet, Position pos)
+: sheet_(sheet),
+pos_(pos)
+{
 }
 
+Cell::~Cell() = default;
+
 void Cell::Clear() {
     Set("");
 }
 
+void Cell::ReplaceFormula(std::unique_ptr<FormulaInterface> formula)
+{
+    text_ = FORMULA_SIGN + formula->GetExpression();
+    formula_ = std::move(formula);
+}
+
+void Cell::MoveFrom(Cell& other)
+{
+    text_ = std::move(other.text_);
+    formula_ = std::move(other.formula_);
+    cache_ = other.cache_;
+    is_dirty_ = other.is_dirty_;
+    topo_index_ = other.topo_index_;
+    graph_node_ = other.graph_node_;
+    link_to_ = std::move(other.link_to_);
+
+    other.Clear();
+    other.is_dirty_ = false;
+    other.graph_node_ = DependencyGraph::NO_NODE;
+    other.link_to_.clear();
+}
+
 void Cell::Set(std::string text) {
     switch (Cell::GetCellType(text))
     {
     case CellType::EMPTY:
-        impl_ = std::make_unique<EmptyImpl>();
+        formula_.reset();
+        std::string().swap(text_);
+        cache_ = 0.0;
         break;
     case CellType::TEXT:
-        impl_ = std::make_unique<TextImpl>(text);
+        formula_.reset();
+        std::visit([this](auto number) {
+            cache_ = number;
+        }, ParseTextNumber(text));
+        text_ = std::move(text);
         break;
     case CellType::FORMULA:
-    {
-        std::string tmp = this->GetText();
-        if (!HasCircularDependency(text)) {
-            impl_ = std::make_unique<FormulaImpl>(sheet_, text);
-        } else {
-            this->Set(tmp);
-            throw CircularDependencyException("");
-        }
+        Set(text, ParseFormula(text.substr(1, text.size())));
         break;
-    }        
     default:
         break;
     }
 }
 
+void Cell::Set(std::string text, std::unique_ptr<FormulaInterface> formula) {
+    assert(Cell::GetCellType(text) == CellType::FORMULA);
+    text_ = FORMULA_SIGN + formula->GetExpression();
+    formula_ = std::move(formula);
+    cache_ = std::monostate{};
+}
+
+void Cell::Restore(std::string text, std::unique_ptr<FormulaInterface> formula,
+                   std::optional<FormulaInterface::Value> value) {
+    if (formula == nullptr) {
+        Set(std::move(text));
+        return;
+    }
+    text_ = std::move(text);
+    formula_ = std::move(formula);
+    cache_ = std::monostate{};
+    if (value.has_value()) {
+        std::visit([this](auto restored) {
+            cache_ = restored;
+        }, *value);
+    }
+}
+
 Cell::Value Cell::GetValue() const {
-    if (cache_.has_value()) {
-        if (std::holds_alternative<double>(cache_.value())) {
-            return std::get<double>(cache_.value());
-        } else {
-            return std::get<FormulaError>(cache_.value());
+    if (formula_ == nullptr) {
+        if (text_.empty()) {
+            return .0;
         }
+        return text_[0] == ESCAPE_SIGN ? text_.substr(1, text_.size()) : text_;
+    }
+
+    if (is_dirty_) {
+        // Пересчитывает все грязные ячейки в порядке зависимостей. Во время
+        // самого пересчёта вызов ничего не делает.
+        sheet_->RecalculateDirty();
     }
 
-    Cell::Value value = impl_->GetValue();
+    if (const double* number = std::get_if<double>(&cache_)) {
+        sheet_->metrics_.Add(MetricsCollector::Counter::ValueCacheHits);
+        return *number;
+    }
+    if (const FormulaError* error = std::get_if<FormulaError>(&cache_)) {
+        sheet_->metrics_.Add(MetricsCollector::Counter::ValueCacheHits);
+        return *error;
+    }
 
-    if (impl_->GetType() == CellType::FORMULA) {
-        if (std::holds_alternative<double>(value)) {
-            cache_ = std::get<double>(value);
-        } else {
-            cache_ = std::get<FormulaError>(value);
-        }
+    sheet_->metrics_.Add(MetricsCollector::Counter::ValueCacheMisses);
+    FormulaInterface::Value value;
+    {
+        ScopedTimer timer(sheet_->metrics_, MetricsCollector::Timer::Evaluate);
+        value = formula_->Evaluate(*sheet_);
+    }
+
+    if (const double* number = std::get_if<double>(&value)) {
+        cache_ = *number;
+        return *number;
     }
-    
-    return value;
+    cache_ = std::get<FormulaError>(value);
+    return std::get<FormulaError>(value);
 }
 
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    return text_;
 }
 
-Cell::CellType Cell::GetCellType() const
+const std::string& Cell::GetTextRef() const
 {
-    return impl_->GetType();
+    return text_;
 }
 
-void Cell::ResetCache()
+bool Cell::HasValue() const
 {
-    cache_.reset();
-    for (const auto& cell : link_from_) {
-        cell->ResetCache();
-    }
+    return formula_ == nullptr || (!is_dirty_ && !std::holds_alternative<std::monostate>(cache_));
 }
 
-void Cell::AddLinkFrom(Cell* cell)
+Position Cell::GetPosition() const
 {
-    this->is_referenced_ = true;
-    link_from_.insert(cell);
+    return pos_;
 }
 
-bool Cell::HasCircularDependency(std::string text)
+FormulaInterface::Value Cell::GetNumericValue() const
 {
-    std::stack<CellInterface*> stack;
-    std::unordered_set<CellInterface*> visited;
-    this->impl_ = std::make_unique<FormulaImpl>(sheet_, text);
-    
-    stack.push(this);
-
-    while (!stack.empty())
-    {
-        CellInterface* cell = stack.top();
-        stack.pop();
-        if (cell != nullptr) {
-            if (visited.count(cell) == 0) {
-                visited.insert(cell);
-                for (const auto& link_cell : cell->GetReferencedCells()) {
-                    stack.push(sheet_->GetCell(link_cell));
-                }
-            } else {
-                return true;
-            }
+    if (formula_ != nullptr) {
+        Value value = GetValue();
+        if (const double* number = std::get_if<double>(&value)) {
+            return *number;
         }
+        return std::get<FormulaError>(value);
     }
-    
-    return false;
-}
-
-std::vector<Position> Cell::GetReferencedCells() const
-{
-    return impl_->GetReferencedCells();
-}
-
-bool Cell::IsReferenced() const
-{
-    return is_referenced_;
+    if (const double* number = std::get_if<double>(&cache_)) {
+        return *number;
+    }
+    return std::get<FormulaError>(cache_);
 }
 
-Cell::EmptyImpl::EmptyImpl()
+Cell::CellType Cell::GetCellType() const
 {
+    if (formula_ != nullptr) {
+        return CellType::FORMULA;
+    }
+    return text_.empty() ? CellType::EMPTY : CellType::TEXT;
 }
 
-Cell::Value Cell::EmptyImpl::GetValue() const
+const FormulaInterface* Cell::GetFormula() const
 {
-    return .0;
+    return formula_.get();
 }
 
-std::string Cell::EmptyImpl::GetText() const
+void Cell::ResetCache()
 {
-    return text_;
+    // Число текстовой ячейки от других ячеек не зависит
+    if (formula_ != nullptr) {
+        cache_ = std::monostate{};
+    }
 }
 
-Cell::CellType Cell::EmptyImpl::GetType() const
+DependencyGraph::NodeId Cell::GetGraphNode() const
 {
-    return CellType::EMPTY;
+    return graph_node_;
 }
 
-std::vector<Position> Cell::EmptyImpl::GetReferencedCells() const
+void Cell::SetGraphNode(DependencyGraph::NodeId node)
 {
-    return std::vector<Position>{};
+    graph_node_ = node;
 }
 
-Cell::TextImpl::TextImpl(std::string text)
-: text_(text)
+const std::vector<Cell*>& Cell::GetLinksTo() const
 {
+    return link_to_;
 }
 
-Cell::Value Cell::TextImpl::GetValue() const
+void Cell::AddLinkTo(Cell* cell)
 {
-    return text_[0] == ESCAPE_SIGN ? text_.substr(1, text_.size()) : text_;
+    link_to_.push_back(cell);
 }
 
-std::string Cell::TextImpl::GetText() const
+void Cell::RemoveLinkTo(Cell* cell)
 {
-    return text_;
+    auto it = std::find(link_to_.begin(), link_to_.end(), cell);
+    assert(it != link_to_.end());
+    link_to_.erase(it);
 }
 
-Cell::CellType Cell::TextImpl::GetType() const
+void Cell::ClearLinksTo()
 {
-    return CellType::TEXT;
+    link_to_.clear();
 }
 
-std::vector<Position> Cell::TextImpl::GetReferencedCells() const
+int Cell::GetTopoIndex() const
 {
-    return std::vector<Position>{};
+    return topo_index_;
 }
 
-Cell::FormulaImpl::FormulaImpl(SheetInterface* sheet, std::string text) 
-: formula_(ParseFormula(text.substr(1, text.size()))),
-sheet_(sheet)
+void Cell::SetTopoIndex(int index)
 {
-    text_ = FORMULA_SIGN + formula_->GetExpression();
+    topo_index_ = index;
 }
 
-Cell::Value Cell::FormulaImpl::GetValue() const
+std::vector<Position> Cell::GetReferencedCells() const
 {
-    FormulaInterface::Value value = formula_->Evaluate(*sheet_);
-    if (std::holds_alternative<double>(value)) {
-        return std::get<double>(value);
-    }
-    return std::get<FormulaError>(value);
+    return formula_ != nullptr ? formula_->GetReferencedCells() : std::vector<Position>{};
 }
 
-std::string Cell::FormulaImpl::GetText() const
+bool Cell::IsReferenced() const
 {
-    return text_;
+    return sheet_->graph_.HasDependents(graph_node_);
 }
 
-Cell::CellType Cell::FormulaImpl::GetType() const
+bool Cell::IsDirty() const
 {
-    return CellType::FORMULA;
+    return is_dirty_;
 }
 
-std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const
+void Cell::SetDirty(bool dirty)
 {
-    return formula_->GetReferencedCells();
+    is_dirty_ = dirty;
 }
 
 Cell::CellType Cell::GetCellType(std::string_view text) {
-    if (text[0] == FORMULA_SIGN && text.size() > 1) {
+    if (text.size() > 1 && text[0] == FORMULA_SIGN) {
         return Cell::CellType::FORMULA;
     } else if (!text.empty()) {
         return Cell::CellType::TEXT;
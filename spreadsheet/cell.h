@@ -1,10 +1,14 @@
 #pragma once
 
 #include "common.h"
+#include "dependency_graph.h"
 #include "formula.h"
 
+#include <memory>
 #include <optional>
-#include <unordered_set>
+#include <string>
+#include <variant>
+#include <vector>
 
 class Sheet;
 
@@ -16,101 +20,81 @@ public:
         TEXT
     };
 
-    Cell(SheetInterface* sheet);
+    Cell(Sheet* sheet, Position pos);
     ~Cell();
 
     void Set(std::string text);
+    // Устанавливает формулу, уже разобранную из text
+    void Set(std::string text, std::unique_ptr<FormulaInterface> formula);
+    // Восстанавливает ячейку из снимка: text - уже канонический текст формулы,
+    // value - её вычисленное значение
+    void Restore(std::string text, std::unique_ptr<FormulaInterface> formula,
+                 std::optional<FormulaInterface::Value> value);
     void Clear();
+    // Заменяет формулу равносильной ей, например переписанной после сдвига
+    // ячеек; кэш значения сохраняется
+    void ReplaceFormula(std::unique_ptr<FormulaInterface> formula);
+    // Забирает содержимое, связи и состояние пересчёта ячейки other, которая
+    // становится пустой ячейкой без связей. Позиция ячейки не меняется.
+    void MoveFrom(Cell& other);
 
     Value GetValue() const override;
     std::string GetText() const override;
+    FormulaInterface::Value GetNumericValue() const override;
+    // Текст ячейки без копирования; действителен до её изменения
+    const std::string& GetTextRef() const;
+    // Значение известно без вычисления: ячейка не формула либо формула с
+    // актуальным кэшем
+    bool HasValue() const;
+
+    Position GetPosition() const;
 
     CellType GetCellType() const;
+    // Формула ячейки либо nullptr
+    const FormulaInterface* GetFormula() const;
+    static CellType GetCellType(std::string_view text);
 
     void ResetCache();
 
-    void AddLinkFrom(Cell* cell);
+    // Узел ячейки в графе зависимостей листа либо DependencyGraph::NO_NODE.
+    // Через граф проходят ячейки, формулы которых ссылаются на данную.
+    DependencyGraph::NodeId GetGraphNode() const;
+    void SetGraphNode(DependencyGraph::NodeId node);
 
-    std::vector<Position> GetReferencedCells() const override;
+    // Ячейки, на которые ссылается формула данной
+    const std::vector<Cell*>& GetLinksTo() const;
+    void AddLinkTo(Cell* cell);
+    void RemoveLinkTo(Cell* cell);
+    void ClearLinksTo();
 
-    bool IsReferenced() const;
-
-private:
-    class Impl {
-        public:
-            virtual ~Impl() = default;
+    // Место ячейки в топологическом порядке графа зависимостей: ячейка стоит
+    // после всех ячеек, на которые ссылается
+    int GetTopoIndex() const;
+    void SetTopoIndex(int index);
 
-            virtual Cell::Value GetValue() const = 0;
-
-            virtual std::string GetText() const = 0;
-
-            virtual CellType GetType() const = 0;
-
-            virtual std::vector<Position> GetReferencedCells() const = 0;
-    };
-
-    class EmptyImpl : public Impl {
-        public:
-            EmptyImpl();
-
-            ~EmptyImpl() = default;
-
-            Cell::Value GetValue() const override;
-
-            std::string GetText() const override;
-
-            CellType GetType() const override;
-
-            std::vector<Position> GetReferencedCells() const override;
-
-        private:
-            std::string text_ = {};
-    };
-
-    class TextImpl : public Impl {
-        public:
-            TextImpl(std::string text);
-
-            ~TextImpl() = default;
-
-            Cell::Value GetValue() const override;
-
-            std::string GetText() const override;
-
-            CellType GetType() const override;
-
-            std::vector<Position> GetReferencedCells() const override;
-
-        private:
-            std::string text_;
-    };
-
-    class FormulaImpl : public Impl {
-        public:
-            FormulaImpl(SheetInterface* sheet, std::string text);
-
-            ~FormulaImpl() = default;
-
-            Cell::Value GetValue() const override;
-
-            std::string GetText() const override;
+    std::vector<Position> GetReferencedCells() const override;
 
-            CellType GetType() const override;
+    // На ячейку ссылается хотя бы одна формула
+    bool IsReferenced() const;
 
-            std::vector<Position> GetReferencedCells() const override;
+    // Ячейка входит в множество, ожидающее пересчёта в Sheet::RecalculateDirty()
+    bool IsDirty() const;
+    void SetDirty(bool dirty);
 
-        private:
-            std::unique_ptr<FormulaInterface> formula_;
-            std::string text_;
-            SheetInterface* sheet_;
-    };
-    
-    std::unique_ptr<Impl> impl_;
-    mutable std::optional<FormulaInterface::Value> cache_ = std::nullopt;
-    SheetInterface* sheet_;
-    bool is_referenced_ = false;
-    std::unordered_set<Cell*> link_from_;
-
-    CellType GetCellType(std::string_view text);
-    bool HasCircularDependency(std::string text);
-};
\ No newline at end of file
+private:
+    // Значение формулы в кэше; у остальных ячеек - число, которое записывает
+    // их текст, разобранное при установке. monostate - значения нет.
+    using CachedValue = std::variant<std::monostate, double, FormulaError>;
+
+    // Пустой у пустой ячейки, у формулы - канонический текст
+    std::string text_;
+    // Задана только у ячейки-формулы
+    std::unique_ptr<FormulaInterface> formula_;
+    mutable CachedValue cache_ = 0.0;
+    Sheet* sheet_;
+    Position pos_;
+    bool is_dirty_ = false;
+    int topo_index_ = 0;
+    DependencyGraph::NodeId graph_node_ = DependencyGraph::NO_NODE;
+    std::vector<Cell*> link_to_;
+};
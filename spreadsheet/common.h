@@ -19,11 +19,17 @@ struct Position {
 
     bool IsValid() const;
     std::string ToString() const;
+    // Записывает позицию в buffer размером не меньше MAX_STRING_LENGTH без
+    // завершающего нуля и возвращает указатель за последним символом. Для
+    // некорректной позиции ничего не записывает.
+    char* ToChars(char* buffer) const;
 
     static Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    // Длина самой длинной записи позиции, "XFD16384"
+    static const int MAX_STRING_LENGTH = 8;
     static const Position NONE;
 
     struct Hasher {
@@ -42,6 +48,21 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольный диапазон ячеек от левого верхнего угла first до правого
+// нижнего last включительно.
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(Range rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+
+    // Диапазон между двумя противоположными углами, заданными в любом порядке
+    static Range FromCorners(Position lhs, Position rhs);
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -102,9 +123,15 @@ public:
     // содержащий экранирующие символы). В случае формулы - её выражение.
     virtual std::string GetText() const = 0;
 
+    // Возвращает значение ячейки как операнда формулы. Текст, записывающий
+    // число, трактуется как это число, пустой текст - как ноль, любой другой
+    // текст даёт ошибку #VALUE!.
+    virtual std::variant<double, FormulaError> GetNumericValue() const;
+
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек. В случае текстовой ячейки список пуст.
+    // ячеек. Ячейки диапазонов в него не входят. В случае текстовой ячейки
+    // список пуст.
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
@@ -152,6 +179,11 @@ virtual ~SheetInterface() = default;
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Добавляет в values числовые значения (см. CellInterface::GetNumericValue)
+    // непустых ячеек диапазона; порядок значений не задан. Если значение
+    // ячейки - ошибка, бросает первую построчно как FormulaError.
+    virtual void GetNumericValues(Range range, std::vector<double>& values) const;
 };
 
 // Создаёт готовую к работе пустую таблицу.
@@ -0,0 +1,140 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <cassert>
+
+DependencyGraph::NodeId DependencyGraph::AddNode(Cell* cell)
+{
+    if (!free_nodes_.empty()) {
+        NodeId node = free_nodes_.back();
+        free_nodes_.pop_back();
+        cells_[node] = cell;
+        return node;
+    }
+    assert(cells_.size() < REMOVED);
+    cells_.push_back(cell);
+    dependent_counts_.push_back(0);
+    delta_heads_.push_back(NO_ENTRY);
+    return static_cast<NodeId>(cells_.size() - 1);
+}
+
+void DependencyGraph::RemoveNode(NodeId node)
+{
+    assert(dependent_counts_[node] == 0);
+    cells_[node] = nullptr;
+    free_nodes_.push_back(node);
+}
+
+void DependencyGraph::AddEdge(NodeId node, NodeId dependent)
+{
+    // Ребро, удалённое после уплотнения, восстанавливается на месте
+    std::uint32_t index = FindCompacted(node, dependent);
+    if (index != NO_ENTRY) {
+        assert((targets_[index] & REMOVED) != 0);
+        targets_[index] = dependent;
+        --removed_count_;
+    } else {
+        delta_.push_back({dependent, delta_heads_[node]});
+        delta_heads_[node] = static_cast<std::uint32_t>(delta_.size() - 1);
+    }
+    ++dependent_counts_[node];
+    ++edge_count_;
+    CompactIfNeeded();
+}
+
+void DependencyGraph::MoveNode(NodeId node, Cell* cell)
+{
+    cells_[node] = cell;
+}
+
+bool DependencyGraph::RemoveEdge(NodeId node, NodeId dependent)
+{
+    std::uint32_t index = FindCompacted(node, dependent);
+    if (index != NO_ENTRY && (targets_[index] & REMOVED) == 0) {
+        targets_[index] |= REMOVED;
+        ++removed_count_;
+    } else {
+        // Звено списка выпадает из него; место освободит уплотнение
+        std::uint32_t* link = &delta_heads_[node];
+        while (*link != NO_ENTRY && delta_[*link].dependent != dependent) {
+            link = &delta_[*link].next;
+        }
+        if (*link == NO_ENTRY) {
+            return false;
+        }
+        *link = delta_[*link].next;
+    }
+    --dependent_counts_[node];
+    --edge_count_;
+    CompactIfNeeded();
+    return true;
+}
+
+bool DependencyGraph::HasDependents(NodeId node) const
+{
+    return node < cells_.size() && dependent_counts_[node] > 0;
+}
+
+size_t DependencyGraph::GetEdgeCount() const
+{
+    return edge_count_;
+}
+
+void DependencyGraph::Compact()
+{
+    std::vector<std::uint32_t> offsets(cells_.size() + 1);
+    for (size_t node = 0; node < cells_.size(); ++node) {
+        offsets[node + 1] = offsets[node] + dependent_counts_[node];
+    }
+
+    std::vector<NodeId> targets(edge_count_);
+    for (size_t node = 0; node < cells_.size(); ++node) {
+        auto out = targets.begin() + offsets[node];
+        // Живые рёбра отрезка уже отсортированы
+        if (node + 1 < offsets_.size()) {
+            out = std::copy_if(targets_.begin() + offsets_[node], targets_.begin() + offsets_[node + 1], out,
+                               [](NodeId target) { return (target & REMOVED) == 0; });
+        }
+        auto sorted_end = out;
+        for (std::uint32_t i = delta_heads_[node]; i != NO_ENTRY; i = delta_[i].next) {
+            *out++ = delta_[i].dependent;
+        }
+        if (sorted_end != out) {
+            std::sort(targets.begin() + offsets[node], out);
+        }
+        assert(out == targets.begin() + offsets[node + 1]);
+    }
+
+    offsets_ = std::move(offsets);
+    targets_ = std::move(targets);
+    removed_count_ = 0;
+    std::fill(delta_heads_.begin(), delta_heads_.end(), NO_ENTRY);
+    delta_.clear();
+}
+
+std::uint32_t DependencyGraph::FindCompacted(NodeId node, NodeId dependent) const
+{
+    if (node + 1 >= offsets_.size()) {
+        return NO_ENTRY;
+    }
+    auto first = targets_.begin() + offsets_[node];
+    auto last = targets_.begin() + offsets_[node + 1];
+    auto it = std::lower_bound(first, last, dependent, [](NodeId target, NodeId value) {
+        return (target & ~REMOVED) < value;
+    });
+    if (it == last || (*it & ~REMOVED) != dependent) {
+        return NO_ENTRY;
+    }
+    return static_cast<std::uint32_t>(it - targets_.begin());
+}
+
+void DependencyGraph::CompactIfNeeded()
+{
+    // Уплотнение стоит O(узлов + рёбер), поэтому выполняется, когда буфер и
+    // пометки набирают долю от размера графа
+    constexpr size_t MIN_PENDING = 4096;
+    size_t pending = delta_.size() + removed_count_;
+    if (pending > std::max(MIN_PENDING, (cells_.size() + targets_.size()) / 4)) {
+        Compact();
+    }
+}
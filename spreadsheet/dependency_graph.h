@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+class Cell;
+
+// Обратные связи формул листа: для каждой ячейки - ячейки, формулы которых на
+// неё ссылаются. Узлы нумеруются подряд и выдаются только ячейкам со связями.
+// Основная часть рёбер хранится в формате CSR: зависимые всех узлов лежат
+// подряд в одном массиве, у каждого узла - отсортированный отрезок. Удалённое
+// ребро помечается старшим битом на месте, новые рёбра копятся в буфере
+// списками по узлам. Когда буфер и пометки разрастаются относительно графа,
+// Compact сливает всё в новый массив, так что обход зависимых остаётся
+// линейным проходом по непрерывной памяти.
+class DependencyGraph {
+public:
+    using NodeId = std::uint32_t;
+    static constexpr NodeId NO_NODE = std::numeric_limits<NodeId>::max();
+
+    NodeId AddNode(Cell* cell);
+    // Узел не должен иметь рёбер; его номер достанется следующему AddNode
+    void RemoveNode(NodeId node);
+    // Узел переходит к ячейке, перенесённой на новое место
+    void MoveNode(NodeId node, Cell* cell);
+
+    // Ребро node -> dependent: формула dependent ссылается на node. Ребро
+    // не должно уже существовать.
+    void AddEdge(NodeId node, NodeId dependent);
+    // Возвращает false, если ребра не было
+    bool RemoveEdge(NodeId node, NodeId dependent);
+
+    // Принимает и NO_NODE: у ячейки без узла зависимых нет
+    bool HasDependents(NodeId node) const;
+    size_t GetEdgeCount() const;
+
+    // Вызывает func(Cell*) для каждой зависимой ячейки. Граф во время обхода
+    // не должен меняться.
+    template <typename Func>
+    void ForEachDependent(NodeId node, Func func) const;
+
+    // Сливает буфер новых рёбер в CSR и выбрасывает удалённые рёбра
+    void Compact();
+
+private:
+    static constexpr std::uint32_t REMOVED = std::uint32_t{1} << 31;
+    static constexpr std::uint32_t NO_ENTRY = std::numeric_limits<std::uint32_t>::max();
+
+    struct DeltaEntry {
+        NodeId dependent;
+        std::uint32_t next;
+    };
+
+    // Положение ребра в отрезке CSR узла либо NO_ENTRY
+    std::uint32_t FindCompacted(NodeId node, NodeId dependent) const;
+    void CompactIfNeeded();
+
+    std::vector<Cell*> cells_;
+    std::vector<NodeId> free_nodes_;
+    // Число живых зависимых узла
+    std::vector<std::uint32_t> dependent_counts_;
+    // Зависимые узла node - targets_[offsets_[node], offsets_[node + 1]);
+    // узлы, появившиеся после уплотнения, отрезка не имеют
+    std::vector<std::uint32_t> offsets_{0};
+    std::vector<NodeId> targets_;
+    std::uint32_t removed_count_ = 0;
+    // Рёбра после уплотнения: односвязные списки по узлам в общем массиве
+    std::vector<std::uint32_t> delta_heads_;
+    std::vector<DeltaEntry> delta_;
+    size_t edge_count_ = 0;
+};
+
+template <typename Func>
+void DependencyGraph::ForEachDependent(NodeId node, Func func) const {
+    if (node >= cells_.size()) {
+        return;
+    }
+    if (node + 1 < offsets_.size()) {
+        for (std::uint32_t i = offsets_[node]; i < offsets_[node + 1]; ++i) {
+            if ((targets_[i] & REMOVED) == 0) {
+                func(cells_[targets_[i]]);
+            }
+        }
+    }
+    for (std::uint32_t i = delta_heads_[node]; i != NO_ENTRY; i = delta_[i].next) {
+        func(cells_[delta_[i].dependent]);
+    }
+}
@@ -1,17 +1,57 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "number_codec.h"
 
 #include <algorithm>
 #include <cassert>
-#include <cctype>
+#include <memory>
 #include <sstream>
 #include <set>
+#include <utility>
 
 using namespace std::literals;
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#ARITHM!";
+    switch (fe.GetCategory()) {
+    case FormulaError::Category::Ref:
+        return output << "#REF!";
+    case FormulaError::Category::Value:
+        return output << "#VALUE!";
+    default:
+        return output << "#ARITHM!";
+    }
+}
+
+std::variant<double, FormulaError> CellInterface::GetNumericValue() const {
+    Value value = GetValue();
+    if (const double* number = std::get_if<double>(&value)) {
+        return *number;
+    }
+    if (const std::string* text = std::get_if<std::string>(&value)) {
+        if (auto number = ParseCellNumber(*text)) {
+            return *number;
+        }
+        return FormulaError(FormulaError::Category::Value);
+    }
+    return std::get<FormulaError>(value);
+}
+
+void SheetInterface::GetNumericValues(Range range, std::vector<double>& values) const {
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            const CellInterface* cell = GetCell(Position{row, col});
+            if (cell == nullptr || cell->GetText().empty()) {
+                continue;
+            }
+            FormulaInterface::Value value = cell->GetNumericValue();
+            if (const double* number = std::get_if<double>(&value)) {
+                values.push_back(*number);
+            } else {
+                throw std::get<FormulaError>(value);
+            }
+        }
+    }
 }
 
 namespace {
@@ -19,48 +59,35 @@ namespace {
     public:
         explicit Formula(std::string expression) 
         try
-        : ast_(ParseFormulaAST(expression))
+        : ast_(std::make_shared<FormulaAST>(ParseFormulaAST(expression)))
         {
         } catch(const std::exception& fex) {
             throw FormulaException(fex.what());
         } 
 
+        // Формула с общим деревом, ссылки которого отсчитываются от anchor
+        Formula(std::shared_ptr<const FormulaAST> ast, Position anchor)
+            : ast_(std::move(ast))
+            , anchor_(anchor) {
+        }
+
         Value Evaluate(const SheetInterface& sheet) const override {
             try {
                 auto lmbd = [&](const Position& pos){
-                    if (sheet.GetCell(pos) != nullptr) {
-                        CellInterface::Value value = sheet.GetCell(pos)->GetValue();
-                        if (std::holds_alternative<double>(value)) {
-                            return std::get<double>(value);
-                        }
-                        if (std::holds_alternative<std::string>(value)) {
-                            std::string str = std::get<std::string>(value);
-                            auto has_alpha = [&](const std::string& s){
-                                for (const auto& c : s) {
-                                    if (std::isalpha(c)) {
-                                        return true;
-                                        break;
-                                    }
-                                }
-                                return false;
-                            };
-                            if (!str.empty() && has_alpha(str)) {
-                                throw FormulaError(FormulaError::Category::Value);
-                            } else if (!str.empty() && !has_alpha(str)) {
-                                try {
-                                    return std::stod(str);
-                                } catch (...) {
-                                    throw FormulaError(FormulaError::Category::Value);
-                                }
-                            }
-                        }
-                        if (std::holds_alternative<FormulaError>(value)) {
-                            throw std::get<FormulaError>(value);
-                        }
+                    const CellInterface* cell = sheet.GetCell(pos);
+                    if (cell == nullptr) {
+                        return .0;
+                    }
+                    Value value = cell->GetNumericValue();
+                    if (const double* number = std::get_if<double>(&value)) {
+                        return *number;
                     }
-                    return .0;
+                    throw std::get<FormulaError>(value);
                 };
-                return ast_.Execute(lmbd);
+                auto range_values = [&sheet](Range range, std::vector<double>& values) {
+                    sheet.GetNumericValues(range, values);
+                };
+                return ast_->Execute(lmbd, range_values, anchor_);
             } catch (const FormulaError& ferr) {
                 return ferr;
             }
@@ -68,23 +95,196 @@ namespace {
 
         std::string GetExpression() const override {
             std::ostringstream ss;
-            ast_.PrintFormula(ss);
+            ast_->PrintFormula(ss, anchor_);
             return ss.str();
         } 
 
+        // Ссылки #REF! не входят в список
         std::vector<Position> GetReferencedCells() const override {
-            std::forward_list<Position> cells = ast_.GetCells();
-            cells.sort();
-            cells.unique();
-            std::vector<Position> c(cells.begin(), cells.end());
+            std::vector<Position> c;
+            for (Position offset : ast_->GetCells()) {
+                Position cell = ShiftPosition(offset, anchor_);
+                if (cell.IsValid()) {
+                    c.push_back(cell);
+                }
+            }
+            std::sort(c.begin(), c.end(), [](Position lhs, Position rhs) {
+                return std::pair(lhs.row, lhs.col) < std::pair(rhs.row, rhs.col);
+            });
+            c.erase(std::unique(c.begin(), c.end()), c.end());
             return c;
         }
 
+        std::vector<Range> GetReferencedRanges() const override {
+            std::vector<Range> r;
+            for (const Range& offset : ast_->GetRanges()) {
+                Range range{ShiftPosition(offset.first, anchor_), ShiftPosition(offset.last, anchor_)};
+                if (range.IsValid() && std::find(r.begin(), r.end(), range) == r.end()) {
+                    r.push_back(range);
+                }
+            }
+            return r;
+        }
+
+        FormulaASTRef GetAST() const {
+            return {ast_, anchor_};
+        }
+
     private:
-        FormulaAST ast_;
+        std::shared_ptr<const FormulaAST> ast_;
+        Position anchor_;
     };
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
+}
+
+FormulaASTRef GetFormulaAST(const FormulaInterface& formula) {
+    return dynamic_cast<const Formula&>(formula).GetAST();
+}
+
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position anchor) {
+    return std::make_unique<Formula>(std::move(ast), anchor);
+}
+
+namespace {
+// Смещение ссылки #REF!: некорректно от любой ячейки листа
+const Position REF_OFFSET{-2 * Position::MAX_ROWS, -2 * Position::MAX_COLS};
+
+int& AxisIndex(Position& pos, SheetShift::Axis axis) {
+    return axis == SheetShift::Axis::Rows ? pos.row : pos.col;
+}
+}  // namespace
+
+bool SheetShift::IsDeleted(Position pos) const {
+    int index = AxisIndex(pos, axis);
+    return !is_insert && index >= first && index < first + count;
+}
+
+Position SheetShift::Apply(Position pos) const {
+    int& index = AxisIndex(pos, axis);
+    if (is_insert) {
+        if (index >= first) {
+            index += count;
+        }
+    } else if (index >= first + count) {
+        index -= count;
+    } else if (index >= first) {
+        return Position::NONE;
+    }
+    return pos;
+}
+
+Range SheetShift::Apply(Range range) const {
+    int& begin = AxisIndex(range.first, axis);
+    int& end = AxisIndex(range.last, axis);
+    if (is_insert) {
+        begin += begin >= first ? count : 0;
+        end += end >= first ? count : 0;
+        return range;
+    }
+    // Удалённые края сдвигаются внутрь диапазона
+    begin = begin < first ? begin : std::max(begin - count, first);
+    end = end < first ? end : (end >= first + count ? end - count : first - 1);
+    if (begin > end) {
+        return Range{Position::NONE, Position::NONE};
+    }
+    return range;
+}
+
+std::unique_ptr<FormulaInterface> ShiftFormula(const FormulaInterface& formula, Position anchor,
+                                               const SheetShift& shift) {
+    auto [ast, old_anchor] = GetFormulaAST(formula);
+    auto to_offset = [anchor](Position cell) {
+        return Position{cell.row - anchor.row, cell.col - anchor.col};
+    };
+    auto shift_cell = [&](Position offset) {
+        Position cell = ShiftPosition(offset, old_anchor);
+        if (cell.IsValid()) {
+            cell = shift.Apply(cell);
+        }
+        return cell.IsValid() ? to_offset(cell) : REF_OFFSET;
+    };
+    auto shift_range = [&](Range offset) {
+        Range range{ShiftPosition(offset.first, old_anchor), ShiftPosition(offset.last, old_anchor)};
+        if (range.IsValid()) {
+            range = shift.Apply(range);
+        }
+        return range.IsValid() ? Range{to_offset(range.first), to_offset(range.last)}
+                               : Range{REF_OFFSET, REF_OFFSET};
+    };
+
+    bool changed = false;
+    for (Position offset : ast->GetCells()) {
+        changed = changed || !(shift_cell(offset) == offset);
+    }
+    for (const Range& offset : ast->GetRanges()) {
+        changed = changed || !(shift_range(offset) == offset);
+    }
+    if (!changed) {
+        return MakeFormula(std::move(ast), anchor);
+    }
+
+    // Общее дерево не меняется: копия собирается из постфиксной записи
+    std::vector<ASTImpl::PostfixNode> nodes;
+    ast->Serialize(nodes);
+    for (ASTImpl::PostfixNode& node : nodes) {
+        if (node.type == ASTImpl::PostfixNode::Type::Cell) {
+            node.cell = shift_cell(node.cell);
+        } else if (node.type == ASTImpl::PostfixNode::Type::Range) {
+            Range range = shift_range(Range{node.cell, node.last});
+            node.cell = range.first;
+            node.last = range.last;
+        }
+    }
+    return MakeFormula(std::make_shared<FormulaAST>(FormulaASTFromPostfix(nodes.data(), nodes.size())), anchor);
+}
+
+std::unique_ptr<FormulaInterface> FormulaInternTable::Parse(std::string_view expression, Position anchor) {
+    try {
+        std::string key = GetRelativeFormulaKey(expression, anchor);
+        std::shared_ptr<const FormulaAST> ast;
+        {
+            std::lock_guard lock(mutex_);
+            if (auto it = asts_.find(key); it != asts_.end()) {
+                ast = it->second.lock();
+            }
+        }
+        if (ast == nullptr) {
+            // Разбор идёт без блокировки; если другой поток успел добавить то же
+            // дерево, используется его дерево
+            auto parsed = std::make_shared<FormulaAST>(ParseFormulaAST(expression, anchor));
+            std::lock_guard lock(mutex_);
+            std::weak_ptr<const FormulaAST>& entry = asts_[key];
+            ast = entry.lock();
+            if (ast == nullptr) {
+                ast = std::move(parsed);
+                entry = ast;
+                if (asts_.size() >= purge_threshold_) {
+                    PurgeExpired();
+                }
+            }
+        }
+        return std::make_unique<Formula>(std::move(ast), anchor);
+    } catch (const std::exception& exc) {
+        throw FormulaException(exc.what());
+    }
+}
+
+size_t FormulaInternTable::Size() const {
+    std::lock_guard lock(mutex_);
+    return asts_.size();
+}
+
+void FormulaInternTable::PurgeExpired() {
+    for (auto it = asts_.begin(); it != asts_.end();) {
+        if (it->second.expired()) {
+            it = asts_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    // Очистка раз в удвоение таблицы даёт амортизированно O(1) на вставку
+    purge_threshold_ = std::max(MIN_PURGE_THRESHOLD, asts_.size() * 2);
 }
\ No newline at end of file
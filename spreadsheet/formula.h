@@ -3,12 +3,20 @@
 #include "common.h"
 
 #include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+class FormulaAST;
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции SUM, MIN, MAX, AVERAGE и COUNT от чисел, выражений и
+//   диапазонов ячеек: SUM(A1:B5,C7*2). Пустые ячейки диапазона пропускаются.
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -32,10 +40,76 @@ public:
 
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
-    // ячеек.
+    // ячеек. Ячейки диапазонов в него не входят.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает диапазоны аргументов функций без повторов, кроме #REF!.
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Дерево формулы и позиция, от которой отсчитываются ссылки в нём.
+struct FormulaASTRef {
+    std::shared_ptr<const FormulaAST> ast;
+    Position anchor;
+};
+
+// Дерево формулы, созданной ParseFormula или FormulaInternTable.
+FormulaASTRef GetFormulaAST(const FormulaInterface& formula);
+
+// Формула над готовым деревом, без разбора выражения.
+std::unique_ptr<FormulaInterface> MakeFormula(std::shared_ptr<const FormulaAST> ast, Position anchor);
+
+// Вставка либо удаление строк или столбцов листа.
+struct SheetShift {
+    enum class Axis {
+        Rows,
+        Cols
+    };
+
+    Axis axis = Axis::Rows;
+    // Первая вставляемая либо удаляемая строка (столбец)
+    int first = 0;
+    int count = 0;
+    bool is_insert = true;
+
+    bool IsDeleted(Position pos) const;
+    // Позиция после правки; у удалённой ячейки - некорректная
+    Position Apply(Position pos) const;
+    // Вставка внутри диапазона расширяет его, удаление части - сужает. Если
+    // удалён весь диапазон, результат некорректен.
+    Range Apply(Range range) const;
+};
+
+// Формула ячейки anchor после правки shift. Ссылки пересчитываются без
+// разбора выражения, ссылки на удалённые ячейки становятся #REF!. Если
+// ссылки относительно ячейки не изменились, формула сохраняет общее дерево,
+// иначе получает копию с переписанными позициями.
+std::unique_ptr<FormulaInterface> ShiftFormula(const FormulaInterface& formula, Position anchor,
+                                               const SheetShift& shift);
+
+// Таблица общих деревьев формул листа. Формулы, которые отличаются только
+// сдвигом ссылок относительно своей ячейки (как при протягивании формулы вниз
+// по столбцу), получают одно дерево, а каждая формула хранит лишь позицию своей
+// ячейки. Таблица не владеет деревьями: дерево живёт, пока есть формулы с ним.
+// Parse можно вызывать из нескольких потоков одновременно.
+class FormulaInternTable {
+public:
+    // То же, что ParseFormula, для формулы ячейки anchor.
+    std::unique_ptr<FormulaInterface> Parse(std::string_view expression, Position anchor);
+
+    // Число записей в таблице, включая ещё не удалённые записи без формул.
+    size_t Size() const;
+
+private:
+    static constexpr size_t MIN_PURGE_THRESHOLD = 1024;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, std::weak_ptr<const FormulaAST>> asts_;
+    size_t purge_threshold_ = MIN_PURGE_THRESHOLD;
+
+    void PurgeExpired();
+};
\ No newline at end of file
@@ -1,13 +1,35 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <limits>
+#include <random>
+#include <set>
+#include <thread>
 
+#include "aggregates.h"
 #include "common.h"
+#include "dependency_graph.h"
 #include "formula.h"
+#include "FormulaAST.h"
+#include "number_codec.h"
+#include "range_index.h"
+#include "sheet.h"
+#include "sheet_io.h"
+#include "snapshot.h"
 #include "test_runner_p.h"
+#include "tiled_storage.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
 
+inline std::ostream& operator<<(std::ostream& output, Range range) {
+    return output << range.first << ":" << range.last;
+}
+
 inline Position operator"" _pos(const char* str, std::size_t) {
     return Position::FromString(str);
 }
@@ -75,6 +97,25 @@ void TestStringToPositionInvalid() {
     ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
 }
 
+void TestPositionRoundTripExhaustive() {
+    char buffer[Position::MAX_STRING_LENGTH];
+    for (int row = 0; row < Position::MAX_ROWS; ++row) {
+        for (int col = 0; col < Position::MAX_COLS; ++col) {
+            Position pos{row, col};
+            std::string_view text(buffer, pos.ToChars(buffer) - buffer);
+            if (!(Position::FromString(text) == pos)) {
+                ASSERT_EQUAL(Position::FromString(text), pos);
+            }
+        }
+    }
+    ASSERT((Position{-1, 0}.ToChars(buffer) == buffer));
+    ASSERT((Position{0, Position::MAX_COLS}.ToChars(buffer) == buffer));
+    ASSERT_EQUAL(Position::FromString("A0001"), (Position{0, 0}));
+    ASSERT(!Position::FromString("a1").IsValid());
+    ASSERT(!Position::FromString("A1 ").IsValid());
+    ASSERT(!Position::FromString("AAAA1").IsValid());
+}
+
 void TestEmpty() {
     auto sheet = CreateSheet();
     ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
@@ -192,6 +233,39 @@ void TestFormulaReferencedCells() {
     ASSERT_EQUAL(tricky->GetReferencedCells(), (std::vector{"A1"_pos, "A2"_pos, "A3"_pos}));
 }
 
+void TestFormulaBytecodeMatchesTree() {
+    // C-столбец всегда даёт ошибку значения, остальные ячейки - числа
+    auto lmbd = [](Position pos) -> double {
+        if (pos.col == 2) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        return pos.row - 1.5 * pos.col;
+    };
+    auto run = [&](const FormulaAST& ast, bool tree) -> CellInterface::Value {
+        try {
+            return tree ? ast.ExecuteTree(lmbd) : ast.Execute(lmbd);
+        } catch (const FormulaError& fe) {
+            return fe;
+        }
+    };
+
+    std::string deep = "A1";
+    for (int i = 0; i < 40; ++i) {
+        deep = "B2-(" + deep + ")";
+    }
+
+    std::vector<std::string> formulas = {
+        "1", "-A1", "+-B3*A2", "1/0", "A1/A1", "B1/(A1-A1)", "(A2-B1)*(A3+B2)/D4",
+        "A1/0+C1", "C1+A1/0", "-C5", "1e+200*1e+200", "-(-(-B1))", "0-0", "-0+0",
+        "A1+A2+A3+A4+A5*B1-B2/B3", "SUM(A1:B3,2)/COUNT(A1:B3)", "MIN(A1:D2)", "MAX(C1:C2,1)",
+        "AVERAGE(B5:B1)-1", deep,
+    };
+    for (const auto& formula : formulas) {
+        FormulaAST ast = ParseFormulaAST(formula);
+        AssertEqual(run(ast, false), run(ast, true), formula);
+    }
+}
+
 void TestErrorValue() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "A1");
@@ -202,6 +276,15 @@ void TestErrorValue() {
     sheet->SetCell("E2"_pos, "3D");
     ASSERT_EQUAL(sheet->GetCell("E4"_pos)->GetValue(),
                     CellInterface::Value(FormulaError::Category::Value));
+
+    // Каждая категория ошибки печатается своим текстом
+    std::ostringstream errors;
+    errors << FormulaError(FormulaError::Category::Ref) << FormulaError(FormulaError::Category::Value)
+           << FormulaError(FormulaError::Category::Arithmetic);
+    ASSERT_EQUAL(errors.str(), "#REF!#VALUE!#ARITHM!");
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "\t\t\t\t\n\t\t\t\t3D\n\t\t\t\t\n\t\t\t\t#VALUE!\n");
 }
 
 void TestErrorArithmetic() {
@@ -252,6 +335,51 @@ void TestEmptyCellTreatedAsZero() {
     ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
 }
 
+void TestTextCellNumericValue() {
+    auto sheet = CreateSheet();
+    auto numeric = [&sheet](std::string_view pos) {
+        return sheet->GetCell(Position::FromString(pos))->GetNumericValue();
+    };
+    using NumericValue = FormulaInterface::Value;
+
+    sheet->SetCell("A1"_pos, "12.5");
+    sheet->SetCell("A2"_pos, "'3");
+    sheet->SetCell("A3"_pos, "abc");
+    sheet->SetCell("A4"_pos, "=A1*2");
+    sheet->SetCell("A5"_pos, "=1/0");
+    sheet->SetCell("B1"_pos, "=A1+A2");
+    sheet->SetCell("B2"_pos, "=A3+1");
+    ASSERT(numeric("A1") == NumericValue(12.5));
+    ASSERT(numeric("A2") == NumericValue(3.0));
+    ASSERT(numeric("A3") == NumericValue(FormulaError(FormulaError::Category::Value)));
+    ASSERT(numeric("A4") == NumericValue(25.0));
+    ASSERT(numeric("A5") == NumericValue(FormulaError(FormulaError::Category::Arithmetic)));
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(15.5));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+
+    // Числовое значение разбирается заново при смене текста
+    sheet->SetCell("A3"_pos, " 7");
+    ASSERT(numeric("A3") == NumericValue(7.0));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(8.0));
+
+    // Ячейка переходит между текстом, формулой и пустотой без следов прежнего
+    // содержимого
+    sheet->SetCell("A3"_pos, "=A1+A1");
+    ASSERT(numeric("A3") == NumericValue(25.0));
+    sheet->SetCell("A3"_pos, "'x");
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value("x"));
+    ASSERT(numeric("A3") == NumericValue(FormulaError(FormulaError::Category::Value)));
+    sheet->ClearCell("A3"_pos);
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetText(), "");
+    ASSERT(numeric("A3") == NumericValue(0.0));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    // Без ссылающихся формул очищенная ячейка удаляется
+    sheet->ClearCell("B2"_pos);
+    sheet->ClearCell("A3"_pos);
+    ASSERT(sheet->GetCell("A3"_pos) == nullptr);
+}
+
 void TestFormulaInvalidPosition() {
     auto sheet = CreateSheet();
     auto try_formula = [&](const std::string& formula) {
@@ -312,6 +440,104 @@ void TestCellReferences() {
     ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C3"_pos});
 }
 
+void TestFormulaFunctions() {
+    auto reformat = [](std::string expr) {
+        return ParseFormula(std::move(expr))->GetExpression();
+    };
+    ASSERT_EQUAL(reformat("SUM( A1 : B2 , 3 )"), "SUM(A1:B2,3)");
+    ASSERT_EQUAL(reformat("SUM(B5:A1)"), "SUM(A1:B5)");
+    ASSERT_EQUAL(reformat("-MAX((1+2)*3,A1)*2"), "-MAX((1+2)*3,A1)*2");
+    ASSERT_EQUAL(reformat("AVERAGE(1+2)"), "AVERAGE(1+2)");
+
+    auto isIncorrect = [](std::string expression) {
+        try {
+            ParseFormula(std::move(expression));
+        } catch (const FormulaException&) {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(isIncorrect("A1:B2"));
+    ASSERT(isIncorrect("A1:B2+1"));
+    ASSERT(isIncorrect("FOO(1)"));
+    ASSERT(isIncorrect("sum(1)"));
+    ASSERT(isIncorrect("SUM()"));
+    ASSERT(isIncorrect("SUM(1,)"));
+    ASSERT(isIncorrect("SUM(A1:)"));
+    ASSERT(isIncorrect("SUM(A1:B2:C3)"));
+    ASSERT(isIncorrect("SUM(A1:ZZZZ1)"));
+    ASSERT(isIncorrect("SUM"));
+
+    // Диапазоны не раскрываются в ячейки
+    auto formula = ParseFormula("SUM(A1:B2,C1:C1,A1:B2)+C1");
+    ASSERT_EQUAL(formula->GetReferencedCells(), std::vector{"C1"_pos});
+    ASSERT_EQUAL(formula->GetReferencedRanges(),
+                 (std::vector{Range{"A1"_pos, "B2"_pos}, Range{"C1"_pos, "C1"_pos}}));
+
+    // Пустые ячейки диапазона пропускаются, текст-число считается числом
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "4");
+    sheet.SetCell("A2"_pos, "'-2");
+    sheet.SetCell("A4"_pos, "=A1*3");
+    sheet.SetCell("A5"_pos, "");
+    auto value = [&sheet](std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    sheet.SetCell("B1"_pos, "=SUM(A1:A10)");
+    sheet.SetCell("B2"_pos, "=MIN(A1:A10)");
+    sheet.SetCell("B3"_pos, "=MAX(A1:A10,20)");
+    sheet.SetCell("B4"_pos, "=AVERAGE(A1:A10)");
+    sheet.SetCell("B5"_pos, "=COUNT(A1:A10,A1:A2,7)");
+    sheet.SetCell("B6"_pos, "=AVERAGE(C1:C3)");
+    sheet.SetCell("B7"_pos, "=SUM(C1:C3)+MIN(C1:C3)+COUNT(C1:C3)");
+    ASSERT_EQUAL(value("B1"), CellInterface::Value(14.0));
+    ASSERT_EQUAL(value("B2"), CellInterface::Value(-2.0));
+    ASSERT_EQUAL(value("B3"), CellInterface::Value(20.0));
+    ASSERT_EQUAL(value("B4"), CellInterface::Value(14.0 / 3));
+    ASSERT_EQUAL(value("B5"), CellInterface::Value(6.0));
+    ASSERT_EQUAL(value("B6"), CellInterface::Value(FormulaError::Category::Arithmetic));
+    ASSERT_EQUAL(value("B7"), CellInterface::Value(0.0));
+
+    // Правка внутри диапазона, в том числе в ранее пустой ячейке
+    sheet.SetCell("A9"_pos, "6");
+    ASSERT_EQUAL(value("B1"), CellInterface::Value(20.0));
+    ASSERT_EQUAL(value("B5"), CellInterface::Value(7.0));
+    sheet.SetCell("A3"_pos, "text");
+    ASSERT_EQUAL(value("B1"), CellInterface::Value(FormulaError::Category::Value));
+    sheet.SetCell("A3"_pos, "=1/0");
+    ASSERT_EQUAL(value("B2"), CellInterface::Value(FormulaError::Category::Arithmetic));
+    sheet.ClearCell("A3"_pos);
+    ASSERT_EQUAL(value("B3"), CellInterface::Value(20.0));
+
+    bool caught = false;
+    try {
+        sheet.SetCell("A6"_pos, "=SUM(A1:B1)");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(sheet.GetCell("A6"_pos) == nullptr || sheet.GetCell("A6"_pos)->GetText().empty());
+
+    // Протянутые формулы с диапазонами делят одно дерево
+    FormulaInternTable table;
+    auto first = table.Parse("SUM(A1:A3)", "D1"_pos);
+    auto second = table.Parse("SUM(A2:A4)", "D2"_pos);
+    ASSERT_EQUAL(table.Size(), 1u);
+    ASSERT_EQUAL(second->GetExpression(), "SUM(A2:A4)");
+    ASSERT(second->GetReferencedCells().empty());
+    ASSERT_EQUAL(second->GetReferencedRanges(), (std::vector{Range{"A2"_pos, "A4"_pos}}));
+}
+
+void TestAggregateKernelsMatchScalar() {
+    std::vector<double> values;
+    for (int count = 0; count <= 100; ++count) {
+        ASSERT_EQUAL(SumValues(values.data(), values.size()), SumValuesScalar(values.data(), values.size()));
+        ASSERT_EQUAL(MinValues(values.data(), values.size()), MinValuesScalar(values.data(), values.size()));
+        ASSERT_EQUAL(MaxValues(values.data(), values.size()), MaxValuesScalar(values.data(), values.size()));
+        values.push_back(((count * 37) % 101) - 50.0);
+    }
+}
+
 void TestFormulaIncorrect() {
     auto isIncorrect = [](std::string expression) {
         try {
@@ -329,6 +555,148 @@ void TestFormulaIncorrect() {
     ASSERT(isIncorrect("2+4-"));
 }
 
+void TestNumberCodecRoundTrip() {
+    using limits = std::numeric_limits<double>;
+    std::vector<double> values = {
+        0.0, -0.0, 1.0, 0.1, 1.0 / 3, -2.5, 100000.0, 1e15, 1e16, 123456789012345678.0, 1e-4, 1e-5,
+        limits::min(), limits::denorm_min(), limits::denorm_min() * 3, limits::min() / 7, limits::max(),
+        -limits::max(), 1e300, 1e-300, 4.35e+200, 6.02214076e23,
+    };
+    // Псевдослучайные конечные числа всех порядков
+    uint64_t bits = 0x9E3779B97F4A7C15;
+    while (values.size() < 5000) {
+        bits ^= bits << 13;
+        bits ^= bits >> 7;
+        bits ^= bits << 17;
+        double value = 0;
+        std::memcpy(&value, &bits, sizeof(value));
+        if (std::isfinite(value)) {
+            values.push_back(value);
+        }
+    }
+
+    for (double value : values) {
+        std::string text = FormatNumber(value);
+        auto parsed = ParseNumber(text);
+        ASSERT(parsed.has_value());
+        ASSERT(*parsed == value && std::signbit(*parsed) == std::signbit(value));
+
+        for (int precision : {0, 1, 6, 17}) {
+            std::ostringstream expected;
+            expected.precision(precision);
+            expected << value;
+            std::string actual;
+            AppendNumber(actual, value, precision);
+            ASSERT_EQUAL(actual, expected.str());
+        }
+
+        // Литерал формулы печатается так, что читается в то же число
+        if (value > 0) {
+            auto formula = ParseFormula(text);
+            ASSERT_EQUAL(formula->GetExpression(), text);
+        }
+    }
+    ASSERT_EQUAL(FormatNumber(100000.0), "100000");
+    ASSERT_EQUAL(FormatNumber(0.1), "0.1");
+    ASSERT_EQUAL(FormatNumber(1e16), "1e+16");
+    ASSERT_EQUAL(FormatNumber(1.5e-5), "1.5e-05");
+    ASSERT_EQUAL(ParseFormula("0.1234567+1e-200")->GetExpression(), "0.1234567+1e-200");
+
+    // Числовое значение текста ячейки
+    ASSERT(ParseCellNumber("") == 0.0);
+    ASSERT(ParseCellNumber(" \t12.5 ") == 12.5);
+    ASSERT(ParseCellNumber("+5") == 5.0);
+    ASSERT(ParseCellNumber("-5") == -5.0);
+    ASSERT(ParseCellNumber("1.5.3") == 1.5);
+    ASSERT(ParseCellNumber("12%") == 12.0);
+    for (std::string_view text : {"+-5", "-", " ", "1e5", "12abc", "inf", "0x10"}) {
+        ASSERT(!ParseCellNumber(text).has_value());
+    }
+    ASSERT(!ParseCellNumber("1" + std::string(400, '0')).has_value());
+}
+
+std::string PrintAST(const FormulaAST& ast) {
+    std::ostringstream out;
+    ast.Print(out);
+    return out.str();
+}
+
+void TestFormulaParserPrecedence() {
+    ASSERT_EQUAL(PrintAST(ParseFormulaAST("1-2-3")), "(- (- 1 2) 3)");
+    ASSERT_EQUAL(PrintAST(ParseFormulaAST("COUNT(A1:C3)-1")), "(- (COUNT A1:C3) 1)");
+    ASSERT_EQUAL(PrintAST(ParseFormulaAST("1/2*3")), "(* (/ 1 2) 3)");
+    ASSERT_EQUAL(PrintAST(ParseFormulaAST("1+2*3-4")), "(- (+ 1 (* 2 3)) 4)");
+    ASSERT_EQUAL(PrintAST(ParseFormulaAST("-A1*2")), "(* (- A1) 2)");
+    ASSERT_EQUAL(PrintAST(ParseFormulaAST("2*-+3")), "(* 2 (- (+ 3)))");
+    ASSERT_EQUAL(PrintAST(ParseFormulaAST("-(1+2)")), "(- (+ 1 2))");
+    ASSERT_EQUAL(PrintAST(ParseFormulaAST(" ( ( B2 ) )\t*\n.5e+1 ")), "(* B2 5)");
+
+    FormulaAST ast = ParseFormulaAST("ZZ10+A1-ZZ10");
+    std::vector<Position> cells(ast.GetCells().begin(), ast.GetCells().end());
+    ASSERT_EQUAL(cells, (std::vector{"A1"_pos, "ZZ10"_pos, "ZZ10"_pos}));
+
+    auto throws = [](std::string_view formula) {
+        try {
+            ParseFormulaAST(formula);
+        } catch (const ParsingError&) {
+            return true;
+        }
+        return false;
+    };
+    for (std::string_view formula : {"", "()", "1+", "*1", "1 2", "(1", "1)", "1.", "1e", "a1", "A", "1..2", "A1B"}) {
+        ASSERT(throws(formula));
+    }
+}
+
+#ifdef SPREADSHEET_WITH_ANTLR
+// Оба парсера должны строить одинаковые деревья и отвергать одни и те же формулы
+void TestFormulaParserMatchesAntlr() {
+    enum class Outcome { Parsed, InvalidPosition, SyntaxError };
+    auto parse = [](auto parser, std::string_view formula, std::string& printed) {
+        try {
+            FormulaAST ast = parser(formula);
+            printed = PrintAST(ast);
+            for (const auto& cell : ast.GetCells()) {
+                printed += ' ' + cell.ToString();
+            }
+            for (const auto& range : ast.GetRanges()) {
+                printed += ' ' + range.first.ToString() + ':' + range.last.ToString();
+            }
+            return Outcome::Parsed;
+        } catch (const FormulaException&) {
+            return Outcome::InvalidPosition;
+        } catch (const std::exception&) {
+            return Outcome::SyntaxError;
+        }
+    };
+
+    std::vector<std::string> formulas = {
+        "1", "12.5", ".5", "1e10", "1E-3", "2.5e+2", "1e", "1.", "1..2", "A1", "ZZ99", "A0",
+        "XFE1", "A16385", "a1", "1+2", "1-2-3", "1*2/3", "1+2*3", "(1+2)*3", "-1", "+-1",
+        "--A1*B2", "2*-3", "-(A1+B1)/C1", "((1))", "()", "(1", "1)", "1+", "*1", "1 2",
+        "A1 B1", "", "   ", " 1 +\t2\r\n", "A2B", "3X", "A0++", "2+4-", "1/0", "AB12-CD34*EF56",
+        "SUM(A1:B2,3)", "-MAX(B5:A1)*2", "COUNT(1+2, C3)", "A1:B2", "SUM()", "FOO(1)", "SUM(A1:)",
+        "SUM(A1:A500)", "AVERAGE(B2:B2, C3 * 2)", "MIN(MAX(A1:B2), 1) / COUNT(C1:C3, D4)",
+        "SUM (A1:B2)", "SUM(A1:XFE1)", "SUM(A1:B2:C3)", "SUM(A1,)", "SUM((A1:B2))", "SUM(-A1:B2)",
+        "sum(A1)", "SUM1+1", "SUMA1", "SUMX(1)", "SUM(A1:B2)+MAX(C1:D2)*-2",
+    };
+    std::string deep = "A1";
+    for (int i = 0; i < 50; ++i) {
+        deep = "-(" + deep + ")*B" + std::to_string(i + 1) + "-" + std::to_string(i) + ".25";
+    }
+    formulas.push_back(deep);
+
+    for (const auto& formula : formulas) {
+        std::string native;
+        std::string antlr;
+        auto native_outcome = parse([](std::string_view f) { return ParseFormulaAST(f); }, formula, native);
+        auto antlr_outcome = parse([](std::string_view f) { return ParseFormulaASTAntlr(f); }, formula, antlr);
+        ASSERT_EQUAL(static_cast<int>(native_outcome), static_cast<int>(antlr_outcome));
+        ASSERT_EQUAL(native, antlr);
+    }
+}
+#endif
+
 void TestCellCircularReferences() {
     auto sheet = CreateSheet();
     sheet->SetCell("E2"_pos, "=E4");
@@ -347,6 +715,45 @@ void TestCellCircularReferences() {
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
 
+void TestCircularDependencyRollback() {
+    auto sheet = CreateSheet();
+    auto set_fails = [&](Position pos, const std::string& text) {
+        try {
+            sheet->SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+            return true;
+        }
+        return false;
+    };
+
+    ASSERT(set_fails("A1"_pos, "=A1"));
+    ASSERT(sheet->GetCell("A1"_pos) == nullptr);
+
+    // Цепочка, заданная от конца к началу, переставляет топологический порядок
+    sheet->SetCell("A4"_pos, "=A3+1");
+    sheet->SetCell("A3"_pos, "=A2+1");
+    sheet->SetCell("A2"_pos, "=A1+1");
+    sheet->SetCell("B1"_pos, "=A2+A3");
+    ASSERT(set_fails("A1"_pos, "=A4"));
+    ASSERT(set_fails("A1"_pos, "=B1*2"));
+    ASSERT(set_fails("A2"_pos, "=A3"));
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "=A1+1");
+
+    // Прежние связи пережили неудачные правки
+    sheet->SetCell("A1"_pos, "=C1");
+    sheet->SetCell("C1"_pos, "10");
+    ASSERT_EQUAL(sheet->GetCell("A4"_pos)->GetValue(), CellInterface::Value(13.0));
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(23.0));
+
+    ASSERT(set_fails("C1"_pos, "=A4-B1"));
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetText(), "10");
+
+    // Разрыв цепочки снимает запрет
+    sheet->SetCell("A3"_pos, "5");
+    sheet->SetCell("C1"_pos, "=A4");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+}
+
 void TestBaseSituations() {
     auto sheet = CreateSheet();
     ASSERT_EQUAL(sheet->GetCell("A1"_pos), nullptr);
@@ -373,6 +780,1309 @@ void TestBaseSituations() {
     ASSERT_EQUAL(val, CellInterface::Value(FormulaError::Category::Value));
 }
 
+void TestRecalculationAfterEdits() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "5");
+    sheet->SetCell("B1"_pos, "=A1*2");
+    sheet->SetCell("B2"_pos, "=A1+1");
+    sheet->SetCell("C1"_pos, "=B1+B2");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(16.0));
+
+    // Ромб зависимостей: C1 видит новое значение A1 через оба пути
+    sheet->SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    // Очистка ячейки, на которую ссылаются
+    sheet->ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(0.0));
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    // Формула больше не ссылается на A1
+    sheet->SetCell("B1"_pos, "=7");
+    sheet->SetCell("A1"_pos, "100");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(108.0));
+}
+
+void TestLongDependencyChain() {
+    auto sheet = CreateSheet();
+    constexpr int CHAIN_LENGTH = 10000;
+    for (int row = CHAIN_LENGTH - 1; row > 0; --row) {
+        sheet->SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    sheet->SetCell(Position{0, 0}, "1");
+    ASSERT_EQUAL(sheet->GetCell(Position{CHAIN_LENGTH - 1, 0})->GetValue(),
+                 CellInterface::Value(double(CHAIN_LENGTH)));
+
+    sheet->SetCell(Position{0, 0}, "=-5");
+    ASSERT_EQUAL(sheet->GetCell(Position{CHAIN_LENGTH - 1, 0})->GetValue(),
+                 CellInterface::Value(double(CHAIN_LENGTH - 6)));
+}
+
+void TestSetCellsBatch() {
+    auto print_texts = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        return out.str();
+    };
+    auto print_values = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintValues(out);
+        return out.str();
+    };
+
+    // Большой пакет перестраивает порядок целиком, малый добавляет рёбра по одному
+    for (int rows : {10, 2000}) {
+        std::vector<std::pair<Position, std::string>> batch;
+        for (int row = rows - 1; row >= 0; --row) {
+            std::string next = row + 1 < rows ? Position{row + 1, 0}.ToString() : "0";
+            batch.emplace_back(Position{row, 0}, "=" + next + "+B" + std::to_string(row + 1));
+            batch.emplace_back(Position{row, 1}, std::to_string(row % 7));
+        }
+        batch.emplace_back("C1"_pos, "first");
+        batch.emplace_back("C1"_pos, "=A1*2");
+
+        Sheet batched;
+        batched.SetRecalculationThreads(4);
+        batched.SetCell("A1"_pos, "old");
+        batched.SetCells(batch);
+
+        Sheet sequential;
+        for (const auto& [pos, text] : batch) {
+            sequential.SetCell(pos, text);
+        }
+        ASSERT_EQUAL(print_texts(batched), print_texts(sequential));
+        ASSERT_EQUAL(print_values(batched), print_values(sequential));
+
+        // Ошибка в любой части пакета оставляет лист прежним
+        std::string texts = print_texts(batched);
+        Size size = batched.GetPrintableSize();
+        auto rejected = [&](std::vector<std::pair<Position, std::string>> bad_batch) {
+            bad_batch.insert(bad_batch.begin(), batch.begin(), batch.end());
+            bad_batch.emplace_back("Z100"_pos, "=Z101");
+            try {
+                batched.SetCells(std::move(bad_batch));
+            } catch (const FormulaException&) {
+                return true;
+            } catch (const CircularDependencyException&) {
+                return true;
+            }
+            return false;
+        };
+        ASSERT(rejected({{"D1"_pos, "=1+"}}));
+        ASSERT(rejected({{"B1"_pos, "=A1"}}));
+        ASSERT(rejected({{"D1"_pos, "=E1"}, {"E1"_pos, "=D1"}}));
+        ASSERT(rejected({{"D1"_pos, "=D1"}}));
+        ASSERT_EQUAL(print_texts(batched), texts);
+        ASSERT(batched.GetPrintableSize() == size);
+        ASSERT(batched.GetCell("Z101"_pos) == nullptr);
+
+        batched.SetCell(Position{rows - 1, 1}, "100");
+        sequential.SetCell(Position{rows - 1, 1}, "100");
+        ASSERT_EQUAL(print_values(batched), print_values(sequential));
+    }
+}
+
+void TestEditBatches() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "text");
+
+    // Чтения до Commit видят лист до пакета, из повторных правок действует последняя
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "10");
+    sheet.SetCell("B1"_pos, "=A2*2");
+    sheet.SetCell("A1"_pos, "5");
+    sheet.ClearCell("A3"_pos);
+    sheet.SetCells({{"C1"_pos, "=B1"}, {"C2"_pos, "x"}});
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    bool caught = false;
+    try {
+        sheet.SetCell("D1"_pos, "=1+");
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    // SetCells с ошибкой в формуле не оставляет в пакете ни одной своей правки
+    caught = false;
+    try {
+        sheet.SetCells({{"E1"_pos, "1"}, {"C2"_pos, "y"}, {"E2"_pos, "=1+"}, {"E3"_pos, "=E1"}});
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    sheet.Commit();
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(12.0));
+    ASSERT(sheet.GetCell("A3"_pos) == nullptr);
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("E3"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "x");
+    ASSERT(sheet.GetPrintableSize() == (Size{2, 3}));
+
+    // Откат ничего не меняет
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "100");
+    sheet.ClearCell("A2"_pos);
+    sheet.Rollback();
+    sheet.Commit();
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(12.0));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=A1+1");
+
+    // Цикл обнаруживается при Commit, и пакет отбрасывается целиком
+    sheet.BeginBatch();
+    sheet.SetCell("A1"_pos, "7");
+    sheet.SetCell("A2"_pos, "=C1");
+    caught = false;
+    try {
+        sheet.Commit();
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "5");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(12.0));
+    sheet.SetCell("A1"_pos, "0");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+}
+
+void TestEvaluationPolicies() {
+    constexpr int CHAIN = 300;
+    auto fill = [](Sheet& sheet) {
+        sheet.SetCell(Position{0, 0}, "1");
+        for (int row = 1; row < CHAIN; ++row) {
+            sheet.SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+        }
+        sheet.SetCell("B1"_pos, "=SUM(A1:A" + std::to_string(CHAIN) + ")");
+    };
+    auto is_dirty = [](const Sheet& sheet, Position pos) {
+        return static_cast<const Cell*>(sheet.GetCell(pos))->IsDirty();
+    };
+    auto chain_sum = [](double head) {
+        return CHAIN * head + CHAIN * (CHAIN - 1) / 2.0;
+    };
+    const Position last{CHAIN - 1, 0};
+
+    // Lazy: правка только помечает ячейки, значение считается при чтении
+    {
+        Sheet sheet;
+        fill(sheet);
+        ASSERT(sheet.GetEvaluationPolicy() == EvaluationPolicy::Lazy);
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT(is_dirty(sheet, last));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(chain_sum(2)));
+        ASSERT(!is_dirty(sheet, last));
+    }
+
+    // EagerSync: правка возвращается с уже вычисленными значениями
+    {
+        Sheet sheet;
+        sheet.SetEvaluationPolicy(EvaluationPolicy::EagerSync);
+        fill(sheet);
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT(!is_dirty(sheet, last));
+        sheet.SetCells({{"A1"_pos, "4"}, {"C1"_pos, "=B1/0"}});
+        ASSERT(!is_dirty(sheet, last));
+        ASSERT(!is_dirty(sheet, "C1"_pos));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(chain_sum(4)));
+    }
+
+    // EagerBackground: частые правки прерывают пересчёт, чтения видят
+    // значения после последней правки
+    for (size_t threads : {1, 2}) {
+        Sheet sheet;
+        sheet.SetRecalculationThreads(threads);
+        sheet.SetEvaluationPolicy(EvaluationPolicy::EagerBackground);
+        fill(sheet);
+        for (int i = 0; i < 50; ++i) {
+            sheet.SetCell("A1"_pos, std::to_string(i));
+            if (i % 10 == 0) {
+                ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), CellInterface::Value(i + CHAIN - 1.0));
+            }
+        }
+        sheet.WaitForQuiescence();
+        ASSERT(!is_dirty(sheet, last));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(chain_sum(49)));
+
+        // Неудачная правка не мешает пересчёту предыдущих
+        sheet.SetCell("A1"_pos, "7");
+        bool caught = false;
+        try {
+            sheet.SetCell("A1"_pos, "=B1");
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        sheet.BeginBatch();
+        sheet.SetCell("A2"_pos, "0");
+        sheet.Commit();
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT(!values.str().empty());
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(7 + (CHAIN - 2) * (CHAIN - 1) / 2.0));
+
+        // Смена политики оставляет лист согласованным
+        sheet.SetCell("A2"_pos, "1");
+        sheet.SetEvaluationPolicy(EvaluationPolicy::Lazy);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(7 + (CHAIN - 1) * CHAIN / 2.0));
+    }
+}
+
+void TestTiledStorage() {
+    // Считает живые объекты, чтобы проверить освобождение плиток
+    struct Item {
+        explicit Item(int value, int& alive)
+            : value(value)
+            , alive(alive) {
+            ++alive;
+        }
+        ~Item() {
+            --alive;
+        }
+
+        int value;
+        int& alive;
+    };
+
+    int alive = 0;
+    {
+        TiledStorage<Item> storage;
+        constexpr int EDGE = TiledStorage<Item>::TILE_SIZE;
+        std::vector<Position> positions{{0, 0}, {0, EDGE - 1}, {0, EDGE}, {EDGE - 1, EDGE - 1},
+                                        {EDGE, 0}, {5 * EDGE + 3, 2 * EDGE + 1},
+                                        {Position::MAX_ROWS - 1, Position::MAX_COLS - 1}};
+        for (size_t i = 0; i < positions.size(); ++i) {
+            ASSERT_EQUAL(storage.Emplace(positions[i], static_cast<int>(i), alive).value, static_cast<int>(i));
+        }
+        ASSERT_EQUAL(storage.Size(), positions.size());
+        ASSERT(storage.Find(Position{1, 1}) == nullptr);
+        ASSERT(storage.Find(Position{EDGE, 1}) == nullptr);
+        ASSERT_EQUAL(storage.Find(Position{0, EDGE})->value, 2);
+
+        // Повторный Emplace возвращает тот же объект
+        ASSERT_EQUAL(&storage.Emplace(Position{0, EDGE}, 100, alive), storage.Find(Position{0, EDGE}));
+        ASSERT_EQUAL(storage.Find(Position{0, EDGE})->value, 2);
+
+        auto collect = [&storage](Position first, Position last) {
+            std::vector<Position> visited;
+            storage.ForEachInRange(first, last, [&visited](Position pos, const Item&) {
+                visited.push_back(pos);
+            });
+            return visited;
+        };
+        ASSERT_EQUAL(collect(Position{0, 0}, Position{EDGE - 1, EDGE - 1}),
+                     (std::vector<Position>{{0, 0}, {0, EDGE - 1}, {EDGE - 1, EDGE - 1}}));
+        ASSERT_EQUAL(collect(Position{0, EDGE - 1}, Position{EDGE, EDGE}),
+                     (std::vector<Position>{{0, EDGE - 1}, {0, EDGE}, {EDGE - 1, EDGE - 1}}));
+        // Полосы без плиток между занятыми пропускаются
+        ASSERT_EQUAL(collect(Position{EDGE + 1, 0}, Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}),
+                     (std::vector<Position>{{5 * EDGE + 3, 2 * EDGE + 1},
+                                            {Position::MAX_ROWS - 1, Position::MAX_COLS - 1}}));
+        ASSERT(collect(Position{EDGE + 1, 3 * EDGE}, Position{6 * EDGE, 4 * EDGE}).empty());
+
+        std::vector<Position> all;
+        storage.ForEach([&all](Position pos, const Item&) {
+            all.push_back(pos);
+        });
+        ASSERT_EQUAL(all, positions);
+
+        // Erase освобождает позицию, но не объект: он переиспользуется
+        storage.Erase(Position{0, 0});
+        storage.Erase(Position{0, 0});
+        ASSERT(storage.Find(Position{0, 0}) == nullptr);
+        ASSERT_EQUAL(storage.Size(), positions.size() - 1);
+        ASSERT_EQUAL(storage.Emplace(Position{0, 0}, 7, alive).value, 0);
+        ASSERT_EQUAL(alive, static_cast<int>(positions.size()));
+
+        // Освобождаются только опустевшие плитки
+        storage.Erase(Position{5 * EDGE + 3, 2 * EDGE + 1});
+        storage.Erase(Position{0, 0});
+        storage.ReleaseEmptyTiles();
+        ASSERT_EQUAL(alive, static_cast<int>(positions.size()) - 1);
+        ASSERT_EQUAL(storage.Find(Position{0, EDGE - 1})->value, 1);
+        ASSERT_EQUAL(storage.Emplace(Position{5 * EDGE + 3, 2 * EDGE + 1}, 8, alive).value, 8);
+
+        // Плитка, занятая снова до освобождения, сохраняется
+        storage.Erase(Position{EDGE, 0});
+        storage.Emplace(Position{EDGE, 1}, 9, alive);
+        storage.ReleaseEmptyTiles();
+        ASSERT_EQUAL(storage.Find(Position{EDGE, 1})->value, 9);
+        ASSERT_EQUAL(storage.Size(), positions.size() - 1);
+    }
+    ASSERT_EQUAL(alive, 0);
+
+    // Лист возвращает память очищенной области
+    Sheet sheet;
+    for (int row = 0; row < 200; ++row) {
+        sheet.SetCell(Position{row, 300}, "x");
+    }
+    sheet.SetCell("A1"_pos, "=SUM(KO1:KO200)");
+    for (int row = 0; row < 200; ++row) {
+        sheet.ClearCell(Position{row, 300});
+    }
+    sheet.Recalculate();
+    sheet.SetCell("A2"_pos, "1");
+    ASSERT(sheet.GetCell(Position{10, 300}) == nullptr);
+    ASSERT(sheet.GetPrintableSize() == (Size{2, 1}));
+    sheet.SetCell(Position{10, 300}, "5");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(5.0));
+}
+
+void TestDependencyGraph() {
+    std::vector<std::unique_ptr<Cell>> cells;
+    DependencyGraph graph;
+    std::vector<DependencyGraph::NodeId> nodes;
+    for (int i = 0; i < 8; ++i) {
+        cells.push_back(std::make_unique<Cell>(nullptr, Position{i, 0}));
+        nodes.push_back(graph.AddNode(cells.back().get()));
+    }
+    auto dependents = [&](int i) {
+        std::vector<int> rows;
+        graph.ForEachDependent(nodes[i], [&rows](Cell* cell) {
+            rows.push_back(cell->GetPosition().row);
+        });
+        std::sort(rows.begin(), rows.end());
+        return rows;
+    };
+
+    // Рёбра из буфера и из уплотнённого массива видны одинаково
+    graph.AddEdge(nodes[0], nodes[2]);
+    graph.AddEdge(nodes[0], nodes[1]);
+    graph.AddEdge(nodes[3], nodes[0]);
+    ASSERT_EQUAL(dependents(0), (std::vector<int>{1, 2}));
+    graph.Compact();
+    graph.AddEdge(nodes[0], nodes[4]);
+    ASSERT_EQUAL(dependents(0), (std::vector<int>{1, 2, 4}));
+    ASSERT_EQUAL(graph.GetEdgeCount(), 4u);
+
+    // Удалённые рёбра пропадают и восстанавливаются на месте
+    ASSERT(graph.RemoveEdge(nodes[0], nodes[2]));
+    ASSERT(graph.RemoveEdge(nodes[0], nodes[4]));
+    ASSERT(!graph.RemoveEdge(nodes[0], nodes[2]));
+    ASSERT_EQUAL(dependents(0), (std::vector<int>{1}));
+    graph.AddEdge(nodes[0], nodes[2]);
+    ASSERT_EQUAL(dependents(0), (std::vector<int>{1, 2}));
+    ASSERT(graph.RemoveEdge(nodes[3], nodes[0]));
+    ASSERT(!graph.HasDependents(nodes[3]));
+    ASSERT(!graph.HasDependents(DependencyGraph::NO_NODE));
+
+    // Номер удалённого узла выдаётся снова без прежних рёбер
+    graph.RemoveNode(nodes[3]);
+    ASSERT_EQUAL(graph.AddNode(cells[3].get()), nodes[3]);
+    ASSERT(dependents(3).empty());
+    graph.Compact();
+    ASSERT_EQUAL(dependents(0), (std::vector<int>{1, 2}));
+    ASSERT_EQUAL(graph.GetEdgeCount(), 2u);
+
+    // Случайные правки сверяются с множеством рёбер
+    std::mt19937 rng(11);
+    std::set<std::pair<int, int>> expected{{0, 1}, {0, 2}};
+    for (int step = 0; step < 20'000; ++step) {
+        int from = static_cast<int>(rng() % nodes.size());
+        int to = static_cast<int>(rng() % nodes.size());
+        if (expected.erase({from, to}) > 0) {
+            ASSERT(graph.RemoveEdge(nodes[from], nodes[to]));
+        } else {
+            graph.AddEdge(nodes[from], nodes[to]);
+            expected.insert({from, to});
+        }
+    }
+    for (int i = 0; i < static_cast<int>(nodes.size()); ++i) {
+        std::vector<int> rows;
+        for (auto [from, to] : expected) {
+            if (from == i) {
+                rows.push_back(to);
+            }
+        }
+        ASSERT_EQUAL(dependents(i), rows);
+        ASSERT_EQUAL(graph.HasDependents(nodes[i]), !rows.empty());
+    }
+    ASSERT_EQUAL(graph.GetEdgeCount(), expected.size());
+}
+
+void TestReplacedFormulaDropsDependencies() {
+    Sheet sheet;
+    auto is_dirty = [&sheet](Position pos) {
+        return static_cast<const Cell*>(sheet.GetCell(pos))->IsDirty();
+    };
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A1*10");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    // После замены формулы правка прежней ссылки её не задевает
+    sheet.SetCell("B1"_pos, "=A2*10");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(20.0));
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT(!is_dirty("B1"_pos));
+    sheet.SetCell("A2"_pos, "3");
+    ASSERT(is_dirty("B1"_pos));
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(30.0));
+
+    // Очищенная формула освобождает ячейки, созданные только ради ссылок
+    sheet.SetCell("C1"_pos, "=Z100+A2");
+    sheet.ClearCell("C1"_pos);
+    ASSERT(sheet.GetCell("Z100"_pos) == nullptr);
+    ASSERT(static_cast<const Cell*>(sheet.GetCell("A2"_pos))->IsReferenced());
+    sheet.ClearCell("B1"_pos);
+    ASSERT(!static_cast<const Cell*>(sheet.GetCell("A2"_pos))->IsReferenced());
+}
+
+void TestRangeIndex() {
+    // Диапазоны всех видов: в плитках, столбцы итогов, целые строки и лист.
+    // Ячейки не разыменовываются, поэтому вместо них - адреса байтов.
+    std::vector<char> owners(64);
+    auto owner = [&owners](size_t i) {
+        return reinterpret_cast<Cell*>(&owners[i]);
+    };
+    const Position last{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+    std::vector<Range> ranges{{{0, 0}, {0, 0}}, {{3, 2}, {200, 9}}, {{0, 0}, {1099, 0}},
+                              {{5, 1}, {9000, 1}}, {{4, 0}, {4, last.col}}, {{0, 0}, last},
+                              {{100, 60}, {16000, 2000}}, {{63, 63}, {64, 64}}};
+    std::mt19937 random(3);
+    while (ranges.size() < owners.size()) {
+        auto coord = [&random](int limit) {
+            return static_cast<int>(random() % limit);
+        };
+        Position first{coord(300), coord(300)};
+        Position corner = random() % 2 == 0 ? Position{first.row + coord(3000), first.col + coord(3)}
+                                            : Position{first.row + coord(3), first.col + coord(3000)};
+        ranges.push_back(Range::FromCorners(first, corner));
+    }
+
+    RangeIndex index;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        index.Add(owner(i), {ranges[i]});
+    }
+    ASSERT_EQUAL(index.Size(), ranges.size());
+
+    auto check = [&](const std::vector<bool>& present) {
+        // Углы диапазонов, соседние с ними позиции и позиции внутри
+        std::vector<Position> probes;
+        for (const Range& range : ranges) {
+            for (int drow : {-1, 0, 1}) {
+                for (int dcol : {-1, 0, 1}) {
+                    probes.push_back(Position{range.first.row + drow, range.first.col + dcol});
+                    probes.push_back(Position{range.last.row + drow, range.last.col + dcol});
+                }
+            }
+            for (int i = 0; i < 20; ++i) {
+                probes.push_back(Position{
+                    range.first.row + static_cast<int>(random() % (range.last.row - range.first.row + 1)),
+                    range.first.col + static_cast<int>(random() % (range.last.col - range.first.col + 1))});
+            }
+        }
+        for (Position pos : probes) {
+            if (!pos.IsValid()) {
+                continue;
+            }
+            std::vector<Cell*> expected;
+            for (size_t i = 0; i < ranges.size(); ++i) {
+                if (present[i] && ranges[i].Contains(pos)) {
+                    expected.push_back(owner(i));
+                }
+            }
+            std::vector<Cell*> found;
+            index.ForEachContaining(pos, [&found](Cell* cell) {
+                found.push_back(cell);
+            });
+            std::sort(found.begin(), found.end());
+            ASSERT(found == expected);
+        }
+    };
+    auto check_reaching = [&](const std::vector<bool>& present) {
+        for (int first : {0, 1, 64, 1099, 1100, 3000, last.row}) {
+            for (bool by_row : {true, false}) {
+                std::vector<Cell*> expected;
+                for (size_t i = 0; i < ranges.size(); ++i) {
+                    if (present[i] && (by_row ? ranges[i].last.row : ranges[i].last.col) >= first) {
+                        expected.push_back(owner(i));
+                    }
+                }
+                std::vector<Cell*> found;
+                auto add = [&found](Cell* cell) {
+                    found.push_back(cell);
+                };
+                if (by_row) {
+                    index.ForEachReachingRow(first, add);
+                } else {
+                    index.ForEachReachingCol(first, add);
+                }
+                std::sort(found.begin(), found.end());
+                ASSERT(found == expected);
+            }
+        }
+    };
+    std::vector<bool> present(ranges.size(), true);
+    check(present);
+    check_reaching(present);
+
+    for (size_t i = 0; i < ranges.size(); i += 2) {
+        index.Remove(owner(i));
+        present[i] = false;
+    }
+    index.Remove(owner(0));
+    ASSERT_EQUAL(index.Size(), ranges.size() / 2);
+    check(present);
+    check_reaching(present);
+}
+
+void TestRangeDependencies() {
+    auto value = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    auto expect_cycle = [](auto edit) {
+        try {
+            edit();
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+    };
+
+    // Диапазоны на весь лист не создают пустых ячеек для своих позиций
+    Sheet sheet;
+    std::string last = Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}.ToString();
+    sheet.SetCell("A1"_pos, "=SUM(B1:" + last + ")");
+    sheet.SetCell("A2"_pos, "=COUNT(B1:CV16384)");
+    sheet.SetCell("D3"_pos, "x");
+    ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+    ASSERT_EQUAL(value(sheet, "A1"), CellInterface::Value(FormulaError::Category::Value));
+    sheet.ClearCell("D3"_pos);
+    ASSERT_EQUAL(value(sheet, "A1"), CellInterface::Value(0.0));
+
+    // Правки внутри диапазона, в том числе формулы, которые стоят в нём
+    sheet.SetCell("B5"_pos, "3");
+    ASSERT_EQUAL(value(sheet, "A1"), CellInterface::Value(3.0));
+    sheet.SetCell("CV16384"_pos, "=B5*2");
+    ASSERT_EQUAL(value(sheet, "A1"), CellInterface::Value(9.0));
+    ASSERT_EQUAL(value(sheet, "A2"), CellInterface::Value(2.0));
+    sheet.SetCell("B5"_pos, "10");
+    ASSERT_EQUAL(value(sheet, "A1"), CellInterface::Value(30.0));
+    sheet.SetCell("CV16384"_pos, "5");
+    sheet.SetCell("B5"_pos, "1");
+    ASSERT_EQUAL(value(sheet, "A1"), CellInterface::Value(6.0));
+    sheet.ClearCell("CV16384"_pos);
+    ASSERT_EQUAL(value(sheet, "A1"), CellInterface::Value(1.0));
+
+    // Формула в диапазоне, который через неё зависит от самой формулы, и
+    // диапазон, который содержит свою формулу, замыкают цикл
+    expect_cycle([&sheet] {
+        sheet.SetCell("C1"_pos, "=A1");
+    });
+    expect_cycle([&sheet] {
+        sheet.SetCell("B9"_pos, "=MAX(B1:B10)");
+    });
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+    sheet.SetCell("B5"_pos, "2");
+    ASSERT_EQUAL(value(sheet, "A1"), CellInterface::Value(2.0));
+
+    // Пакет связывает формулы по их содержимому после пакета
+    sheet.SetCells({{"E1"_pos, "=A2+1"}, {"A2"_pos, "=COUNT(B1:B10)"}});
+    ASSERT_EQUAL(value(sheet, "E1"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value(sheet, "A1"), CellInterface::Value(4.0));
+    expect_cycle([&sheet] {
+        sheet.SetCells({{"F1"_pos, "=A1"}, {"E1"_pos, "1"}});
+    });
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=A2+1");
+    sheet.SetCells({{"E1"_pos, "1"}, {"A2"_pos, "=E1*7"}});
+    ASSERT_EQUAL(value(sheet, "A1"), CellInterface::Value(3.0));
+    sheet.SetCell("E1"_pos, "2");
+    ASSERT_EQUAL(value(sheet, "A2"), CellInterface::Value(14.0));
+    ASSERT_EQUAL(value(sheet, "A1"), CellInterface::Value(4.0));
+
+    // Диапазоны восстанавливаются из снимка
+    std::ostringstream snapshot;
+    SheetSnapshot::Save(sheet, snapshot);
+    std::string data = snapshot.str();
+    auto loaded = SheetSnapshot::Load(data);
+    loaded->SetCell("C7"_pos, "10");
+    ASSERT_EQUAL(value(*loaded, "A1"), CellInterface::Value(14.0));
+    expect_cycle([&loaded] {
+        loaded->SetCell("C1"_pos, "=A1");
+    });
+
+    // Сдвиг строк переписывает диапазоны и без ячеек в них
+    Sheet shifted;
+    shifted.SetCell("A1"_pos, "=SUM(B2:B4)");
+    shifted.InsertRows(2);
+    ASSERT_EQUAL(shifted.GetCell("A1"_pos)->GetText(), "=SUM(B2:B5)");
+    shifted.SetCell("B5"_pos, "4");
+    shifted.SetCell("C5"_pos, "=B5");
+    ASSERT_EQUAL(value(shifted, "A1"), CellInterface::Value(4.0));
+    shifted.DeleteRows(1);
+    ASSERT_EQUAL(shifted.GetCell("A1"_pos)->GetText(), "=SUM(B2:B4)");
+    ASSERT_EQUAL(value(shifted, "A1"), CellInterface::Value(4.0));
+    shifted.SetCell("B2"_pos, "=C4");
+    shifted.SetCell("B4"_pos, "5");
+    ASSERT_EQUAL(value(shifted, "A1"), CellInterface::Value(10.0));
+    shifted.DeleteRows(3);
+    ASSERT_EQUAL(shifted.GetCell("A1"_pos)->GetText(), "=SUM(B2:B3)");
+    ASSERT_EQUAL(value(shifted, "A1"), CellInterface::Value(FormulaError::Category::Ref));
+    shifted.SetCell("B2"_pos, "1");
+    ASSERT_EQUAL(value(shifted, "A1"), CellInterface::Value(1.0));
+}
+
+void TestInsertDeleteRowsCols() {
+    auto texts = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        return out.str();
+    };
+    auto values = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintValues(out);
+        return out.str();
+    };
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "3");
+    sheet.SetCell("B1"_pos, "=SUM(A1:A3)");
+    sheet.SetCell("B3"_pos, "=A3*10");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+    // Вставка внутри диапазона расширяет его, ссылки ниже сдвигаются
+    sheet.InsertRows(1);
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "3");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=SUM(A1:A4)");
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetText(), "=A4*10");
+    ASSERT(sheet.GetPrintableSize() == (Size{4, 2}));
+    sheet.SetCell("A2"_pos, "4");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+    sheet.SetCell("A4"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("B4"_pos)->GetValue(), CellInterface::Value(50.0));
+
+    sheet.InsertCols(0, 2);
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "=SUM(C1:C4)");
+    ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetText(), "=C4*10");
+    sheet.DeleteCols(0, 2);
+    ASSERT_EQUAL(texts(sheet), "1\t=SUM(A1:A4)\n4\t\n2\t\n5\t=A4*10\n");
+
+    // Удаление сжимает диапазон, ссылка на удалённую ячейку становится #REF!
+    sheet.DeleteRows(3);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=SUM(A1:A3)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(7.0));
+    sheet.SetCell("C1"_pos, "=A3+B1");
+    sheet.SetCell("D1"_pos, "=C1*2");
+    sheet.DeleteRows(2);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=#REF!+B1");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
+    ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT_EQUAL(values(sheet), "1\t5\t#REF!\t#REF!\n4\t\t\t\n");
+    sheet.DeleteCols(0);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=SUM(#REF!)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=#REF!+A1");
+    ASSERT(sheet.GetPrintableSize() == (Size{1, 3}));
+
+    // Протянутые формулы по-прежнему делят дерево и вычисляются верно
+    Sheet fill;
+    for (int row = 0; row < 10; ++row) {
+        std::string r = std::to_string(row + 1);
+        fill.SetCell(Position{row, 0}, r);
+        fill.SetCell(Position{row, 1}, "=A" + r + "*2");
+    }
+    fill.InsertRows(5, 3);
+    fill.DeleteRows(0);
+    ASSERT_EQUAL(fill.GetCell("B4"_pos)->GetText(), "=A4*2");
+    ASSERT_EQUAL(fill.GetCell("B12"_pos)->GetText(), "=A12*2");
+    fill.SetCell("A12"_pos, "7");
+    ASSERT_EQUAL(fill.GetCell("B12"_pos)->GetValue(), CellInterface::Value(14.0));
+
+    // Снимок сохраняет ссылки #REF!
+    std::ostringstream snapshot;
+    SheetSnapshot::Save(sheet, snapshot);
+    std::string data = snapshot.str();
+    auto loaded = SheetSnapshot::Load(data);
+    ASSERT_EQUAL(texts(*loaded), texts(sheet));
+    ASSERT_EQUAL(values(*loaded), values(sheet));
+
+    // Сдвиг за край листа отклоняется, и лист не меняется
+    sheet.SetCell(Position{Position::MAX_ROWS - 1, 0}, "last");
+    std::string before = texts(sheet);
+    try {
+        sheet.InsertRows(0);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    ASSERT_EQUAL(texts(sheet), before);
+    try {
+        sheet.DeleteRows(-1);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    for (int count : {Position::MAX_ROWS + 1, std::numeric_limits<int>::max()}) {
+        try {
+            sheet.InsertRows(1, count);
+            ASSERT(false);
+        } catch (const InvalidPositionException&) {
+        }
+    }
+    ASSERT_EQUAL(texts(sheet), before);
+
+    // Отказ проверяется с учётом открытого пакета и не применяет его
+    sheet.BeginBatch();
+    sheet.ClearCell(Position{Position::MAX_ROWS - 1, 0});
+    sheet.SetCell(Position{Position::MAX_ROWS - 1, 1}, "new last");
+    sheet.SetCell("A1"_pos, "batched");
+    try {
+        sheet.InsertRows(0);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    ASSERT_EQUAL(texts(sheet), before);
+    sheet.ClearCell(Position{Position::MAX_ROWS - 1, 1});
+    sheet.InsertRows(0);
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "batched");
+    ASSERT(sheet.GetCell(Position{Position::MAX_ROWS - 1, 0}) == nullptr);
+
+    // Пустая ячейка, на которую ссылается формула, уходит за край, а ссылка
+    // становится #REF!
+    Sheet edge;
+    std::string last_row = std::to_string(Position::MAX_ROWS);
+    edge.SetCell("A1"_pos, "=A" + last_row + "+A2");
+    edge.InsertRows(1);
+    ASSERT_EQUAL(edge.GetCell("A1"_pos)->GetText(), "=#REF!+A3");
+    ASSERT_EQUAL(edge.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT(edge.GetCell(Position{Position::MAX_ROWS - 1, 0}) == nullptr);
+
+    // Стёртая ячейка из списка грязных не переносится сдвигом и снова
+    // попадает в список, когда её позицию занимают
+    Sheet stale;
+    stale.SetCell("B2"_pos, "8");
+    stale.ClearCell("B2"_pos);
+    stale.SetCell("A1"_pos, "=A9+1");
+    stale.DeleteRows(5);
+    stale.SetCell("B2"_pos, "=A1*2");
+    ASSERT_EQUAL(stale.GetCell("A1"_pos)->GetText(), "=A8+1");
+    ASSERT_EQUAL(stale.GetCell("B2"_pos)->GetValue(), CellInterface::Value(2.0));
+}
+
+void TestForEachCell() {
+    Sheet sheet;
+    sheet.SetCell("C3"_pos, "3");
+    sheet.SetCell("A1"_pos, "=C3+Z500");
+    sheet.SetCell("B100"_pos, "text");
+    sheet.SetCell("ZZ2"_pos, "'=escaped");
+    sheet.SetCell("D1"_pos, "4");
+    sheet.ClearCell("D1"_pos);
+
+    // Пустые ячейки, созданные ради ссылок, и очищенные ячейки не видны
+    std::vector<Position> visited;
+    std::vector<std::string> texts;
+    sheet.ForEachCell([&](Position pos, const CellInterface& cell) {
+        visited.push_back(pos);
+        texts.push_back(cell.GetText());
+    });
+    ASSERT_EQUAL(visited, (std::vector{"A1"_pos, "ZZ2"_pos, "C3"_pos, "B100"_pos}));
+    ASSERT_EQUAL(texts, (std::vector<std::string>{"=C3+Z500", "'=escaped", "3", "text"}));
+
+    visited.clear();
+    double sum = 0;
+    sheet.ForEachCell(Range{"A1"_pos, "C100"_pos}, [&](Position pos, const CellInterface& cell) {
+        visited.push_back(pos);
+        CellInterface::Value value = cell.GetValue();
+        if (const auto* number = std::get_if<double>(&value)) {
+            sum += *number;
+        }
+    });
+    ASSERT_EQUAL(visited, (std::vector{"A1"_pos, "C3"_pos, "B100"_pos}));
+    // Числом является только значение формулы, текст "3" остаётся строкой
+    ASSERT_EQUAL(sum, 3.0);
+
+    visited.clear();
+    sheet.ForEachCell(Range{"A4"_pos, "A16384"_pos}, [&](Position pos, const CellInterface&) {
+        visited.push_back(pos);
+    });
+    ASSERT(visited.empty());
+
+    try {
+        sheet.ForEachCell(Range{"B2"_pos, "A1"_pos}, [](Position, const CellInterface&) {});
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestImportTable() {
+    auto print_texts = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        return out.str();
+    };
+
+    Sheet source;
+    source.SetCell("A1"_pos, "=B2*2");
+    source.SetCell("B2"_pos, "'=not a formula");
+    source.SetCell("C1"_pos, "12");
+    source.SetCell("A3"_pos, "=C1+B1");
+    source.SetCell("D3"_pos, "text with spaces");
+
+    Sheet imported;
+    ImportTable(imported, print_texts(source));
+    ASSERT_EQUAL(print_texts(imported), print_texts(source));
+    ASSERT(imported.GetPrintableSize() == source.GetPrintableSize());
+    ASSERT_EQUAL(imported.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(imported.GetCell("A3"_pos)->GetValue(), CellInterface::Value(12.0));
+    ASSERT_EQUAL(imported.GetCell("B2"_pos)->GetValue(), CellInterface::Value(std::string("=not a formula")));
+
+    Sheet csv;
+    ImportTable(csv, "1,\"a,\"\"b\"\"\",=A1*2\r\n,,\"\"\r\n\"x\ny\"", ',');
+    ASSERT_EQUAL(csv.GetCell("B1"_pos)->GetText(), "a,\"b\"");
+    ASSERT_EQUAL(csv.GetCell("C1"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT(csv.GetCell("C2"_pos) == nullptr);
+    ASSERT_EQUAL(csv.GetCell("A3"_pos)->GetText(), "x\ny");
+    ASSERT(csv.GetPrintableSize() == (Size{3, 3}));
+
+    auto path = (std::filesystem::temp_directory_path() / "spreadsheet_import_test.tsv").string();
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << print_texts(source);
+    }
+    Sheet from_file;
+    ImportTableFile(from_file, path);
+    std::filesystem::remove(path);
+    ASSERT_EQUAL(print_texts(from_file), print_texts(source));
+
+    // Загрузка атомарна
+    bool caught = false;
+    try {
+        ImportTable(from_file, "=B1\t=A1\n");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(print_texts(from_file), print_texts(source));
+}
+
+void TestSnapshotRoundTrip() {
+    auto print = [](const Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintTexts(out);
+        sheet.PrintValues(out);
+        return out.str();
+    };
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "'=escaped");
+    sheet.SetCell("C5"_pos, "=+A1/(0-0)");
+    sheet.SetCell("D1"_pos, "=-(+A1)*Z99");
+    sheet.SetCell("E1"_pos, "=SUM(A1:B50)/COUNT(B2:B50)");
+    for (int row = 0; row < 50; ++row) {
+        sheet.SetCell(Position{row, 1}, row == 0 ? "=A1" : "=B" + std::to_string(row) + "*1.5+A1");
+    }
+
+    std::ostringstream snapshot;
+    SheetSnapshot::Save(sheet, snapshot);
+    std::string data = snapshot.str();
+    auto loaded = SheetSnapshot::Load(data);
+    ASSERT_EQUAL(print(*loaded), print(sheet));
+    ASSERT(loaded->GetPrintableSize() == sheet.GetPrintableSize());
+    ASSERT_EQUAL(loaded->GetCell("D1"_pos)->GetReferencedCells(), (std::vector{"A1"_pos, "Z99"_pos}));
+
+    // Граф и порядок восстановлены: правки пересчитывают зависимые и ловят циклы
+    loaded->SetCell("A1"_pos, "3");
+    sheet.SetCell("A1"_pos, "3");
+    loaded->SetCell("Z99"_pos, "=B50");
+    sheet.SetCell("Z99"_pos, "=B50");
+    ASSERT_EQUAL(print(*loaded), print(sheet));
+    bool caught = false;
+    try {
+        loaded->SetCell("A1"_pos, "=D1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    auto path = (std::filesystem::temp_directory_path() / "spreadsheet_snapshot_test.bin").string();
+    SheetSnapshot::SaveFile(sheet, path);
+    auto from_file = SheetSnapshot::LoadFile(path);
+    std::filesystem::remove(path);
+    ASSERT_EQUAL(print(*from_file), print(sheet));
+
+    auto rejected = [](std::string bad) {
+        try {
+            SheetSnapshot::Load(bad);
+        } catch (const SnapshotError&) {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(rejected(""));
+    ASSERT(rejected(data.substr(0, data.size() / 2)));
+    std::string corrupted = data;
+    corrupted[corrupted.size() - 20] ^= 1;
+    ASSERT(rejected(corrupted));
+    std::string newer = data;
+    ++newer[12];
+    ASSERT(rejected(newer));
+
+    // Целый граф от другого листа того же размера: контрольные суммы сходятся,
+    // но связи B1 не совпадают с её ссылками
+    auto save = [](const Sheet& sheet) {
+        std::ostringstream out;
+        SheetSnapshot::Save(sheet, out);
+        return out.str();
+    };
+    Sheet linked_to_a;
+    Sheet linked_to_c;
+    for (Sheet* linked : {&linked_to_a, &linked_to_c}) {
+        linked->SetCell("A1"_pos, "1");
+        linked->SetCell("C1"_pos, "2");
+    }
+    linked_to_a.SetCell("B1"_pos, "=A1");
+    linked_to_c.SetCell("B1"_pos, "=C1");
+    std::string spliced = save(linked_to_a);
+    std::string donor = save(linked_to_c);
+    ASSERT_EQUAL(spliced.size(), donor.size());
+    ASSERT(!rejected(spliced));
+    bool found = false;
+    for (size_t entry = 24; entry + 32 <= spliced.size() && !found; entry += 32) {
+        uint32_t id;
+        uint64_t offset;
+        uint64_t size;
+        std::memcpy(&id, spliced.data() + entry, sizeof(id));
+        std::memcpy(&offset, spliced.data() + entry + 8, sizeof(offset));
+        std::memcpy(&size, spliced.data() + entry + 16, sizeof(size));
+        // Секция зависимых - пятая по счёту (id 4)
+        if (id == 4) {
+            spliced.replace(entry, 32, donor, entry, 32);
+            spliced.replace(offset, size, donor, offset, size);
+            found = true;
+        }
+    }
+    ASSERT(found);
+    ASSERT(rejected(spliced));
+}
+
+void TestPrintMatchesPerCellOutput() {
+    // Прежний вывод: каждая позиция печатной области по отдельности
+    auto print_per_cell = [](const Sheet& sheet, std::ostream& output, bool values) {
+        Size size = sheet.GetPrintableSize();
+        for (int r = 0; r < size.rows; ++r) {
+            for (int c = 0; c < size.cols; ++c) {
+                const CellInterface* cell = sheet.GetCell(Position{r, c});
+                if (cell != nullptr) {
+                    if (values) {
+                        output << cell->GetValue();
+                    } else {
+                        output << cell->GetText();
+                    }
+                }
+                if (c < size.cols - 1) {
+                    output << "\t";
+                }
+            }
+            output << "\n";
+        }
+    };
+    auto check = [&print_per_cell](const Sheet& sheet) {
+        for (bool values : {false, true}) {
+            std::ostringstream expected;
+            std::ostringstream actual;
+            expected.precision(3);
+            actual.precision(3);
+            print_per_cell(sheet, expected, values);
+            if (values) {
+                sheet.PrintValues(actual);
+            } else {
+                sheet.PrintTexts(actual);
+            }
+            ASSERT_EQUAL(actual.str(), expected.str());
+        }
+    };
+
+    Sheet sheet;
+    check(sheet);
+    sheet.SetCell("A1"_pos, "=1/3");
+    sheet.SetCell("C2"_pos, "'escaped");
+    sheet.SetCell("BL70"_pos, "=C2");
+    sheet.SetCell("BM3"_pos, "=1/0");
+    // Пустая ячейка печатной области, на которую ссылается формула
+    sheet.SetCell("B5"_pos, "=D4+1");
+    sheet.SetCell("E71"_pos, "x");
+    check(sheet);
+    sheet.ClearCell("E71"_pos);
+    sheet.ClearCell("BL70"_pos);
+    check(sheet);
+
+    // Вывод больше одного блока буфера
+    Sheet wide;
+    for (int r = 0; r < 300; ++r) {
+        wide.SetCell(Position{r, (r * 37) % 500}, std::to_string(r * 1.5));
+    }
+    check(wide);
+}
+
+void TestSharedFillDownFormulas() {
+    FormulaInternTable table;
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    for (int row = 1; row <= 1000; ++row) {
+        std::string r = std::to_string(row);
+        formulas.push_back(table.Parse("A" + r + " * B" + r + "+C" + std::to_string(row + 1), Position{row - 1, 3}));
+    }
+    ASSERT_EQUAL(table.Size(), 1u);
+    ASSERT_EQUAL(formulas[0]->GetExpression(), "A1*B1+C2");
+    ASSERT_EQUAL(formulas[41]->GetExpression(), "A42*B42+C43");
+    ASSERT_EQUAL(formulas[41]->GetReferencedCells(), (std::vector{"A42"_pos, "B42"_pos, "C43"_pos}));
+
+    // Другая позиция ссылок или другие токены - другое дерево
+    table.Parse("A1*B1+C2", "D2"_pos);
+    table.Parse("A1*B1-C2", "D1"_pos);
+    ASSERT_EQUAL(table.Size(), 3u);
+
+    auto isIncorrect = [&table](std::string_view expression) {
+        try {
+            table.Parse(expression, "D1"_pos);
+        } catch (const FormulaException&) {
+            return true;
+        }
+        return false;
+    };
+    ASSERT(isIncorrect("1 2"));
+    ASSERT(isIncorrect("A1*"));
+    ASSERT(isIncorrect("ZZZZ1"));
+    ASSERT(!isIncorrect("12"));
+
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+        std::string r = std::to_string(row + 1);
+        sheet.SetCell(Position{row, 0}, r);
+        sheet.SetCell(Position{row, 1}, "=A" + r + "*2");
+        sheet.SetCell(Position{row, 2}, row == 0 ? "=B1" : "=C" + std::to_string(row) + "+B" + r);
+    }
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetValue(), CellInterface::Value(100.0 * 101));
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetText(), "=C99+B100");
+    sheet.SetCell("A50"_pos, "0");
+    ASSERT_EQUAL(sheet.GetCell("C100"_pos)->GetValue(), CellInterface::Value(100.0 * 101 - 100));
+}
+
+void TestRangeValuesMatchCells() {
+    Sheet sheet;
+    sheet.SetRecalculationThreads(2);
+    auto read = [](const Sheet& sheet, Range range, bool from_plane) {
+        std::vector<double> values;
+        try {
+            if (from_plane) {
+                sheet.GetNumericValues(range, values);
+            } else {
+                sheet.SheetInterface::GetNumericValues(range, values);
+            }
+        } catch (const FormulaError& fe) {
+            return "error " + std::to_string(static_cast<int>(fe.GetCategory()));
+        }
+        std::sort(values.begin(), values.end());
+        std::ostringstream out;
+        for (double value : values) {
+            out << value << ' ';
+        }
+        return out.str();
+    };
+
+    // Правки вокруг границы плиток, в том числе формулы с диапазонами
+    std::mt19937 random(7);
+    auto random_pos = [&random] {
+        return Position{static_cast<int>(random() % 80), static_cast<int>(random() % 70)};
+    };
+    for (int edit = 0; edit < 3000; ++edit) {
+        Position pos = random_pos();
+        std::string text;
+        switch (random() % 8) {
+        case 0:
+        case 1:
+            text = std::to_string(random() % 100);
+            break;
+        case 2:
+            text = "'" + std::to_string(random() % 10);
+            break;
+        case 3:
+            text = random() % 4 == 0 ? "text" : "";
+            break;
+        case 4:
+            text = "=" + random_pos().ToString() + "*2";
+            break;
+        case 5:
+            text = "=SUM(" + random_pos().ToString() + ":" + random_pos().ToString() + ")/10";
+            break;
+        case 6:
+            text = "=1/0";
+            break;
+        default:
+            sheet.ClearCell(pos);
+            continue;
+        }
+        try {
+            sheet.SetCell(pos, text);
+        } catch (const CircularDependencyException&) {
+        }
+        if (edit % 10 == 0) {
+            Range range = Range::FromCorners(random_pos(), random_pos());
+            ASSERT_EQUAL(read(sheet, range, true), read(sheet, range, false));
+        }
+    }
+
+    Range all{"A1"_pos, Position{79, 69}};
+    ASSERT_EQUAL(read(sheet, all, true), read(sheet, all, false));
+    std::ostringstream snapshot;
+    SheetSnapshot::Save(sheet, snapshot);
+    auto loaded = SheetSnapshot::Load(snapshot.str());
+    ASSERT_EQUAL(read(*loaded, all, true), read(sheet, all, false));
+}
+
+void TestSheetMetrics() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2*2");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(4.0));
+    try {
+        sheet.SetCell("A1"_pos, "=A3");
+    } catch (const CircularDependencyException&) {
+    }
+
+    SheetMetrics metrics = sheet.GetMetrics();
+#ifdef SPREADSHEET_METRICS
+    ASSERT_EQUAL(metrics.set_cell.count, 4u);
+    ASSERT_EQUAL(metrics.parse.count, 3u);
+    ASSERT_EQUAL(metrics.cycle_check.count, 4u);
+    ASSERT_EQUAL(metrics.cycles_found, 1u);
+    ASSERT_EQUAL(metrics.cache_resets, 3u);
+    ASSERT_EQUAL(metrics.value_cache_misses, 2u);
+    ASSERT_EQUAL(metrics.evaluate.count, 2u);
+    ASSERT(metrics.value_cache_hits >= 2);
+    uint64_t in_buckets = 0;
+    for (uint64_t bucket : metrics.set_cell.buckets) {
+        in_buckets += bucket;
+    }
+    ASSERT_EQUAL(in_buckets, metrics.set_cell.count);
+    ASSERT(metrics.set_cell.total_ns > 0);
+#endif
+
+    sheet.ResetMetrics();
+    metrics = sheet.GetMetrics();
+    ASSERT_EQUAL(metrics.set_cell.count, 0u);
+    ASSERT_EQUAL(metrics.evaluate.total_ns, 0u);
+    ASSERT_EQUAL(metrics.value_cache_hits, 0u);
+}
+
+void TestVersionedReads() {
+    Sheet sheet;
+    ASSERT_EQUAL(sheet.ReadVersion()->GetNumber(), 0u);
+    ASSERT(sheet.ReadVersion()->Find("A1"_pos) == nullptr);
+
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A1*3");
+    sheet.SetCell("C70"_pos, "'text");
+    sheet.PublishVersion();
+    auto first = sheet.ReadVersion();
+    ASSERT_EQUAL(first->GetNumber(), 1u);
+    ASSERT(first->GetPrintableSize() == (Size{70, 3}));
+    ASSERT_EQUAL(first->Find("B1"_pos)->text, "=A1*3");
+    ASSERT_EQUAL(first->Find("B1"_pos)->value, CellInterface::Value(6.0));
+    ASSERT_EQUAL(first->Find("C70"_pos)->value, CellInterface::Value("text"));
+
+    // Правки не видны до публикации, а закреплённая версия не меняется и после
+    sheet.SetCell("A1"_pos, "5");
+    sheet.ClearCell("C70"_pos);
+    ASSERT_EQUAL(sheet.ReadVersion()->Find("B1"_pos)->value, CellInterface::Value(6.0));
+    sheet.PublishVersion();
+    auto second = sheet.ReadVersion();
+    ASSERT_EQUAL(second->GetNumber(), 2u);
+    ASSERT_EQUAL(second->Find("B1"_pos)->value, CellInterface::Value(15.0));
+    ASSERT(second->Find("C70"_pos) == nullptr);
+    ASSERT(second->GetPrintableSize() == (Size{1, 2}));
+    ASSERT_EQUAL(first->Find("B1"_pos)->value, CellInterface::Value(6.0));
+    ASSERT_EQUAL(first->Find("C70"_pos)->text, "'text");
+
+    // Писатель правит и публикует, читатели в других потоках проверяют, что
+    // каждая версия согласована: все A-ячейки равны, B1 - их сумма
+    constexpr int CELLS = 40;
+    constexpr int VERSIONS = 300;
+    for (int row = 0; row < CELLS; ++row) {
+        sheet.SetCell(Position{row, 0}, "0");
+    }
+    sheet.SetCell("B1"_pos, "=SUM(A1:A40)");
+    sheet.PublishVersion();
+    std::atomic<bool> done{false};
+    std::atomic<int> inconsistent{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; ++t) {
+        readers.emplace_back([&] {
+            while (!done.load()) {
+                auto version = sheet.ReadVersion();
+                const std::string& first_text = version->Find("A1"_pos)->text;
+                for (int row = 0; row < CELLS; ++row) {
+                    if (version->Find(Position{row, 0})->text != first_text) {
+                        ++inconsistent;
+                    }
+                }
+                if (!(version->Find("B1"_pos)->value == CellInterface::Value(std::stod(first_text) * CELLS))) {
+                    ++inconsistent;
+                }
+            }
+        });
+    }
+    for (int i = 1; i <= VERSIONS; ++i) {
+        for (int row = 0; row < CELLS; ++row) {
+            sheet.SetCell(Position{row, 0}, std::to_string(i));
+        }
+        sheet.PublishVersion();
+    }
+    done = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    ASSERT_EQUAL(inconsistent.load(), 0);
+    ASSERT_EQUAL(sheet.ReadVersion()->Find("B1"_pos)->value, CellInterface::Value(40.0 * VERSIONS));
+}
+
+void TestParallelRecalculationMatchesSerial() {
+    // Независимые цепочки по столбцам и итоговая строка, собирающая их концы
+    auto fill = [](Sheet& sheet) {
+        constexpr int CHAINS = 100;
+        constexpr int LENGTH = 30;
+        for (int col = 0; col < CHAINS; ++col) {
+            std::string column = Position{0, col}.ToString();
+            column.pop_back();
+            sheet.SetCell(Position{0, col}, std::to_string(col));
+            for (int row = 1; row < LENGTH; ++row) {
+                sheet.SetCell(Position{row, col}, "=" + column + std::to_string(row) + "*1.5-" +
+                                                      std::to_string(row) + "/(" + column + "1-3)");
+            }
+            std::string previous = col > 0 ? Position{LENGTH, col - 1}.ToString() : "0";
+            sheet.SetCell(Position{LENGTH, col},
+                          "=" + column + std::to_string(LENGTH) + "+" + previous);
+        }
+        sheet.SetCell(Position{0, 7}, "text");
+        sheet.SetCell(Position{0, 11}, "=1/0");
+    };
+
+    auto print_values = [](Sheet& sheet) {
+        std::ostringstream out;
+        sheet.PrintValues(out);
+        return out.str();
+    };
+
+    Sheet serial;
+    Sheet parallel;
+    parallel.SetRecalculationThreads(4);
+    ASSERT_EQUAL(parallel.GetRecalculationThreads(), 4u);
+
+    fill(serial);
+    fill(parallel);
+    ASSERT_EQUAL(print_values(parallel), print_values(serial));
+
+    for (Sheet* sheet : {&serial, &parallel}) {
+        sheet->SetCell("C1"_pos, "=B1+A1");
+        sheet->SetCell("L1"_pos, "11");
+    }
+    ASSERT_EQUAL(print_values(parallel), print_values(serial));
+}
+
 void PrintSheet(const std::unique_ptr<SheetInterface>& sheet) {
     std::cout << sheet->GetPrintableSize() << std::endl;
     sheet->PrintTexts(std::cout);
@@ -406,6 +2116,7 @@ int main() {
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
     RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestPositionRoundTripExhaustive);
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
@@ -415,17 +2126,47 @@ int main() {
     RUN_TEST(tr, TestFormulaReferences);
     RUN_TEST(tr, TestFormulaExpressionFormatting);
     RUN_TEST(tr, TestFormulaReferencedCells);
+    RUN_TEST(tr, TestFormulaBytecodeMatchesTree);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorArithmetic);
     
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
+    RUN_TEST(tr, TestTextCellNumericValue);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
     
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
+    RUN_TEST(tr, TestFormulaFunctions);
+    RUN_TEST(tr, TestAggregateKernelsMatchScalar);
+    RUN_TEST(tr, TestFormulaParserPrecedence);
+    RUN_TEST(tr, TestNumberCodecRoundTrip);
+#ifdef SPREADSHEET_WITH_ANTLR
+    RUN_TEST(tr, TestFormulaParserMatchesAntlr);
+#endif
     
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestCircularDependencyRollback);
+    RUN_TEST(tr, TestRecalculationAfterEdits);
+    RUN_TEST(tr, TestLongDependencyChain);
+    RUN_TEST(tr, TestTiledStorage);
+    RUN_TEST(tr, TestDependencyGraph);
+    RUN_TEST(tr, TestReplacedFormulaDropsDependencies);
+    RUN_TEST(tr, TestParallelRecalculationMatchesSerial);
+    RUN_TEST(tr, TestRangeValuesMatchCells);
+    RUN_TEST(tr, TestSheetMetrics);
+    RUN_TEST(tr, TestVersionedReads);
+    RUN_TEST(tr, TestSharedFillDownFormulas);
+    RUN_TEST(tr, TestSetCellsBatch);
+    RUN_TEST(tr, TestEditBatches);
+    RUN_TEST(tr, TestEvaluationPolicies);
+    RUN_TEST(tr, TestRangeIndex);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestInsertDeleteRowsCols);
+    RUN_TEST(tr, TestForEachCell);
+    RUN_TEST(tr, TestImportTable);
+    RUN_TEST(tr, TestSnapshotRoundTrip);
+    RUN_TEST(tr, TestPrintMatchesPerCellOutput);
     std::cout << "all done" << '\n';
     
 }
\ No newline at end of file
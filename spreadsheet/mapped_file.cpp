@@ -0,0 +1,63 @@
+#include "mapped_file.h"
+
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SPREADSHEET_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string& path)
+{
+#ifdef SPREADSHEET_HAS_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open file: " + path);
+    }
+    struct stat info {};
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            // Файл читается от начала до конца
+            madvise(data, info.st_size, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(data);
+            size_ = info.st_size;
+            is_mapped_ = true;
+        }
+    }
+    close(fd);
+    if (is_mapped_) {
+        return;
+    }
+#endif
+
+    std::ifstream input(path, std::ios::binary | std::ios::ate);
+    if (!input) {
+        throw std::runtime_error("Cannot open file: " + path);
+    }
+    size_ = static_cast<size_t>(input.tellg());
+    buffer_ = std::make_unique<char[]>(size_);
+    input.seekg(0);
+    if (!input.read(buffer_.get(), size_)) {
+        throw std::runtime_error("Cannot read file: " + path);
+    }
+    data_ = buffer_.get();
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef SPREADSHEET_HAS_MMAP
+    if (is_mapped_) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+}
+
+std::string_view MappedFile::GetData() const
+{
+    return {data_, size_};
+}
@@ -0,0 +1,73 @@
+#include "metrics.h"
+
+#ifdef SPREADSHEET_METRICS
+namespace {
+size_t GetBucket(std::uint64_t ns)
+{
+    size_t bucket = 0;
+    while (ns > 1 && bucket + 1 < TimingHistogram::BUCKETS) {
+        ns >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+TimingHistogram& GetHistogram(SheetMetrics& metrics, MetricsCollector::Timer timer)
+{
+    switch (timer) {
+    case MetricsCollector::Timer::SetCell:
+        return metrics.set_cell;
+    case MetricsCollector::Timer::Parse:
+        return metrics.parse;
+    case MetricsCollector::Timer::CycleCheck:
+        return metrics.cycle_check;
+    default:
+        return metrics.evaluate;
+    }
+}
+}  // namespace
+
+void MetricsCollector::Record(Timer timer, std::uint64_t ns)
+{
+    Histogram& histogram = timers_[static_cast<size_t>(timer)];
+    histogram.count.fetch_add(1, std::memory_order_relaxed);
+    histogram.total_ns.fetch_add(ns, std::memory_order_relaxed);
+    histogram.buckets[GetBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+}
+
+SheetMetrics MetricsCollector::GetSnapshot() const
+{
+    SheetMetrics metrics;
+    for (size_t i = 0; i < timers_.size(); ++i) {
+        const Histogram& source = timers_[i];
+        TimingHistogram& target = GetHistogram(metrics, static_cast<Timer>(i));
+        target.count = source.count.load(std::memory_order_relaxed);
+        target.total_ns = source.total_ns.load(std::memory_order_relaxed);
+        for (size_t bucket = 0; bucket < TimingHistogram::BUCKETS; ++bucket) {
+            target.buckets[bucket] = source.buckets[bucket].load(std::memory_order_relaxed);
+        }
+    }
+    auto counter = [this](Counter c) {
+        return counters_[static_cast<size_t>(c)].load(std::memory_order_relaxed);
+    };
+    metrics.cycles_found = counter(Counter::CyclesFound);
+    metrics.cache_resets = counter(Counter::CacheResets);
+    metrics.value_cache_hits = counter(Counter::ValueCacheHits);
+    metrics.value_cache_misses = counter(Counter::ValueCacheMisses);
+    return metrics;
+}
+
+void MetricsCollector::Reset()
+{
+    for (Histogram& histogram : timers_) {
+        histogram.count.store(0, std::memory_order_relaxed);
+        histogram.total_ns.store(0, std::memory_order_relaxed);
+        for (auto& bucket : histogram.buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+    for (auto& counter : counters_) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+}
+#endif
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Гистограмма длительностей: корзина i считает замеры от 2^i до 2^(i + 1) нс,
+// в корзину 0 попадают и нулевые.
+struct TimingHistogram {
+    static constexpr size_t BUCKETS = 40;
+
+    std::uint64_t count = 0;
+    std::uint64_t total_ns = 0;
+    std::array<std::uint64_t, BUCKETS> buckets{};
+};
+
+// Снимок счётчиков листа с последнего сброса. Без SPREADSHEET_METRICS все
+// значения нулевые.
+struct SheetMetrics {
+    // Вызовы Sheet::SetCell целиком
+    TimingHistogram set_cell;
+    // Разбор текста формул при установке ячеек
+    TimingHistogram parse;
+    // Проверка новых ссылок формул на циклы с поддержанием топологического порядка
+    TimingHistogram cycle_check;
+    std::uint64_t cycles_found = 0;
+    // Ячейки, кэш которых сброшен правками
+    std::uint64_t cache_resets = 0;
+    // Чтения значения формулы из кэша и вычисления при промахе
+    std::uint64_t value_cache_hits = 0;
+    std::uint64_t value_cache_misses = 0;
+    TimingHistogram evaluate;
+};
+
+// Сборщик счётчиков листа. Счётчики атомарны, потому что формулы вычисляются
+// в нескольких потоках. Без SPREADSHEET_METRICS все методы пустые и вызовы
+// вырезаются компилятором.
+class MetricsCollector {
+public:
+    enum class Timer {
+        SetCell,
+        Parse,
+        CycleCheck,
+        Evaluate,
+        COUNT
+    };
+
+    enum class Counter {
+        CyclesFound,
+        CacheResets,
+        ValueCacheHits,
+        ValueCacheMisses,
+        COUNT
+    };
+
+#ifdef SPREADSHEET_METRICS
+    void Add(Counter counter, std::uint64_t value = 1) {
+        counters_[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void Record(Timer timer, std::uint64_t ns);
+
+    SheetMetrics GetSnapshot() const;
+    void Reset();
+
+private:
+    struct Histogram {
+        std::atomic<std::uint64_t> count{0};
+        std::atomic<std::uint64_t> total_ns{0};
+        std::array<std::atomic<std::uint64_t>, TimingHistogram::BUCKETS> buckets{};
+    };
+
+    std::array<Histogram, static_cast<size_t>(Timer::COUNT)> timers_;
+    std::array<std::atomic<std::uint64_t>, static_cast<size_t>(Counter::COUNT)> counters_{};
+#else
+    void Add(Counter, std::uint64_t = 1) {
+    }
+
+    void Record(Timer, std::uint64_t) {
+    }
+
+    SheetMetrics GetSnapshot() const {
+        return {};
+    }
+
+    void Reset() {
+    }
+#endif
+};
+
+// Замеряет время от создания до уничтожения и записывает его в сборщик
+class ScopedTimer {
+public:
+#ifdef SPREADSHEET_METRICS
+    ScopedTimer(MetricsCollector& metrics, MetricsCollector::Timer timer)
+        : metrics_(metrics), timer_(timer), start_(std::chrono::steady_clock::now()) {
+    }
+
+    ~ScopedTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        metrics_.Record(timer_, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+private:
+    MetricsCollector& metrics_;
+    MetricsCollector::Timer timer_;
+    std::chrono::steady_clock::time_point start_;
+#else
+    ScopedTimer(MetricsCollector&, MetricsCollector::Timer) {
+    }
+#endif
+
+public:
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
@@ -0,0 +1,93 @@
+#include "number_codec.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <system_error>
+
+namespace {
+// Длина кратчайшей записи double в любом формате с запасом
+constexpr size_t MAX_SHORTEST_LENGTH = 32;
+// Длина записи %g сверх значащих цифр: знак, точка, экспонента
+constexpr size_t MAX_GENERAL_OVERHEAD = 16;
+
+constexpr double MIN_FIXED_MAGNITUDE = 1e-4;
+constexpr double MAX_FIXED_MAGNITUDE = 1e16;
+
+void AppendChars(std::string& output, size_t max_length, double value,
+                 std::chars_format format, std::optional<int> precision)
+{
+    size_t size = output.size();
+    output.resize(size + max_length);
+    char* first = output.data() + size;
+    char* last = output.data() + output.size();
+    auto result = precision ? std::to_chars(first, last, value, format, *precision)
+                            : std::to_chars(first, last, value, format);
+    output.resize(result.ec == std::errc{} ? result.ptr - output.data() : size);
+}
+}  // namespace
+
+void AppendNumber(std::string& output, double value)
+{
+    double magnitude = std::fabs(value);
+    bool is_fixed = magnitude == 0 || !std::isfinite(magnitude)
+                    || (magnitude >= MIN_FIXED_MAGNITUDE && magnitude < MAX_FIXED_MAGNITUDE);
+    AppendChars(output, MAX_SHORTEST_LENGTH, value,
+                is_fixed ? std::chars_format::fixed : std::chars_format::scientific, std::nullopt);
+}
+
+std::string FormatNumber(double value)
+{
+    std::string result;
+    AppendNumber(result, value);
+    return result;
+}
+
+void AppendNumber(std::string& output, double value, int precision)
+{
+    precision = std::max(precision, 0);
+    AppendChars(output, precision + MAX_GENERAL_OVERHEAD, value, std::chars_format::general, precision);
+}
+
+std::optional<double> ParseNumber(std::string_view text)
+{
+    double value = 0;
+    const char* last = text.data() + text.size();
+    auto [end, error] = std::from_chars(text.data(), last, value);
+    if (error != std::errc{} || end != last) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+std::optional<double> ParseCellNumber(std::string_view text)
+{
+    if (text.empty()) {
+        return 0.0;
+    }
+    bool has_alpha = std::any_of(text.begin(), text.end(), [](char c) {
+        return std::isalpha(static_cast<unsigned char>(c)) != 0;
+    });
+    if (has_alpha) {
+        return std::nullopt;
+    }
+
+    size_t pos = 0;
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) {
+        ++pos;
+    }
+    if (pos < text.size() && text[pos] == '+') {
+        ++pos;
+        // from_chars сам разбирает минус, второй знак недопустим
+        if (pos < text.size() && text[pos] == '-') {
+            return std::nullopt;
+        }
+    }
+
+    double value = 0;
+    if (std::from_chars(text.data() + pos, text.data() + text.size(), value).ec != std::errc{}) {
+        return std::nullopt;
+    }
+    return value;
+}
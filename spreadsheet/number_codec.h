@@ -0,0 +1,24 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Запись и чтение чисел без учёта локали на основе std::to_chars и
+// std::from_chars.
+
+// Кратчайшая запись, которая читается обратно в то же число. Как в %g,
+// порядок выносится в экспоненту, если он меньше -4 или не меньше 16.
+void AppendNumber(std::string& output, double value);
+std::string FormatNumber(double value);
+
+// Запись как у printf("%.*g", precision, value), то есть как у ostream << value
+// с настройками потока по умолчанию и заданной точностью
+void AppendNumber(std::string& output, double value, int precision);
+
+// Число, записанное во всём text, например литерал формулы
+std::optional<double> ParseNumber(std::string_view text);
+
+// Числовое значение текста ячейки в формулах: пустой текст - 0, текст с
+// буквами - не число, иначе число в начале текста после пробелов и знака.
+std::optional<double> ParseCellNumber(std::string_view text);
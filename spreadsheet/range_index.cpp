@@ -0,0 +1,139 @@
+#include "range_index.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace {
+void EraseIndex(std::unordered_map<std::uint64_t, std::vector<std::uint32_t>>& map, std::uint64_t key,
+                std::uint32_t index)
+{
+    auto it = map.find(key);
+    assert(it != map.end());
+    std::vector<std::uint32_t>& indices = it->second;
+    *std::find(indices.begin(), indices.end(), index) = indices.back();
+    indices.pop_back();
+    if (indices.empty()) {
+        map.erase(it);
+    }
+}
+}  // namespace
+
+void RangeIndex::Add(Cell* cell, const std::vector<Range>& ranges)
+{
+    if (ranges.empty()) {
+        return;
+    }
+    std::vector<std::uint32_t>& cell_entries = cell_entries_[cell];
+    assert(cell_entries.empty());
+    for (const Range& range : ranges) {
+        std::uint32_t index;
+        if (!free_entries_.empty()) {
+            index = free_entries_.back();
+            free_entries_.pop_back();
+        } else {
+            index = static_cast<std::uint32_t>(entries_.size());
+            entries_.emplace_back();
+        }
+        Entry& entry = entries_[index];
+        entry.range = range;
+        entry.cell = cell;
+        by_last_row_.emplace(range.last.row, index);
+        by_last_col_.emplace(range.last.col, index);
+        if (IsInTiles(range)) {
+            for (int tile_row = range.first.row / TILE_SIZE; tile_row <= range.last.row / TILE_SIZE; ++tile_row) {
+                for (int tile_col = range.first.col / TILE_SIZE; tile_col <= range.last.col / TILE_SIZE; ++tile_col) {
+                    buckets_[TileKey(tile_row, tile_col)].push_back(index);
+                }
+            }
+        } else {
+            ForEachNode(range, [this, index](std::uint64_t key, int group, int level) {
+                nodes_[key].push_back(index);
+                ++node_counts_[group][level];
+                ++group_counts_[group];
+            });
+        }
+        cell_entries.push_back(index);
+    }
+}
+
+void RangeIndex::Remove(Cell* cell)
+{
+    auto it = cell_entries_.find(cell);
+    if (it == cell_entries_.end()) {
+        return;
+    }
+    for (std::uint32_t index : it->second) {
+        Entry& entry = entries_[index];
+        const Range& range = entry.range;
+        by_last_row_.erase({range.last.row, index});
+        by_last_col_.erase({range.last.col, index});
+        if (IsInTiles(range)) {
+            for (int tile_row = range.first.row / TILE_SIZE; tile_row <= range.last.row / TILE_SIZE; ++tile_row) {
+                for (int tile_col = range.first.col / TILE_SIZE; tile_col <= range.last.col / TILE_SIZE; ++tile_col) {
+                    EraseIndex(buckets_, TileKey(tile_row, tile_col), index);
+                }
+            }
+        } else {
+            ForEachNode(range, [this, index](std::uint64_t key, int group, int level) {
+                EraseIndex(nodes_, key, index);
+                --node_counts_[group][level];
+                --group_counts_[group];
+            });
+        }
+        entry.cell = nullptr;
+        free_entries_.push_back(index);
+    }
+    cell_entries_.erase(it);
+}
+
+size_t RangeIndex::Size() const
+{
+    return entries_.size() - free_entries_.size();
+}
+
+std::uint64_t RangeIndex::TileKey(int tile_row, int tile_col)
+{
+    return (static_cast<std::uint64_t>(tile_row) << 32) | static_cast<std::uint32_t>(tile_col);
+}
+
+std::uint64_t RangeIndex::NodeKey(int group, int band, int level, int node)
+{
+    return (static_cast<std::uint64_t>(group) << 48) | (static_cast<std::uint64_t>(band) << 24)
+           | (static_cast<std::uint64_t>(level) << 16) | static_cast<std::uint64_t>(node);
+}
+
+bool RangeIndex::IsInTiles(const Range& range)
+{
+    std::int64_t tile_rows = range.last.row / TILE_SIZE - range.first.row / TILE_SIZE + 1;
+    std::int64_t tile_cols = range.last.col / TILE_SIZE - range.first.col / TILE_SIZE + 1;
+    return tile_rows * tile_cols <= MAX_TILES;
+}
+
+template <typename Func>
+void RangeIndex::ForEachNode(const Range& range, Func func)
+{
+    // Короткая сторона та, что задевает меньше плиток
+    bool is_tall = range.last.col / TILE_SIZE - range.first.col / TILE_SIZE
+                   <= range.last.row / TILE_SIZE - range.first.row / TILE_SIZE;
+    int short_first = is_tall ? range.first.col : range.first.row;
+    int short_last = is_tall ? range.last.col : range.last.row;
+    int long_first = is_tall ? range.first.row : range.first.col;
+    int long_last = is_tall ? range.last.row : range.last.col;
+
+    size_t width = 0;
+    while ((short_last >> BAND_SHIFTS[width]) - (short_first >> BAND_SHIFTS[width]) >= MAX_BANDS) {
+        ++width;
+    }
+    int group = (is_tall ? 0 : static_cast<int>(BAND_SHIFTS.size())) + static_cast<int>(width);
+    for (int band = short_first >> BAND_SHIFTS[width]; band <= short_last >> BAND_SHIFTS[width]; ++band) {
+        // Отрезок берётся наибольшим из выровненных по своему началу
+        for (int first = long_first; first <= long_last;) {
+            int level = 0;
+            while (level + 1 < LEVELS && first % (2 << level) == 0 && first + (2 << level) - 1 <= long_last) {
+                ++level;
+            }
+            func(NodeKey(group, band, level, first >> level), group, level);
+            first += 1 << level;
+        }
+    }
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class Cell;
+
+// Диапазоны аргументов функций в формулах листа. По позиции находит формулы,
+// диапазоны которых её содержат, не раскрывая диапазоны в ячейки.
+//
+// Диапазон, задевающий не больше MAX_TILES плиток TILE_SIZE x TILE_SIZE,
+// записывается в корзину каждой из них. Длинный диапазон (столбец итогов,
+// целые строки) записывается в полосы вдоль своей короткой стороны: высокий -
+// в полосы столбцов, широкий - в полосы строк. Ширина полос - наименьшая из
+// BAND_SHIFTS, при которой диапазон задевает не больше MAX_BANDS полос. Вдоль
+// длинной стороны диапазон в каждой полосе разбит на двоичные отрезки
+// (отрезок уровня L - это 2^L строк или столбцов, выровненных по 2^L), поэтому
+// поиск по позиции проверяет в полосе по одному отрезку каждого уровня.
+class RangeIndex {
+public:
+    static constexpr int TILE_SIZE = 64;
+    static constexpr int MAX_TILES = 16;
+    static constexpr int MAX_BANDS = 4;
+    // Логарифмы ширины полос: 1, 32, 1024 и 16384 строк (столбцов)
+    static constexpr std::array<int, 4> BAND_SHIFTS{0, 5, 10, 14};
+
+    // Ранее добавленные диапазоны ячейки должны быть удалены
+    void Add(Cell* cell, const std::vector<Range>& ranges);
+    // Удаляет все диапазоны ячейки; ячейка без диапазонов пропускается
+    void Remove(Cell* cell);
+
+    // Вызывает func(Cell*) для каждого диапазона, содержащего pos: формула с
+    // несколькими такими диапазонами встречается несколько раз
+    template <typename Func>
+    void ForEachContaining(Position pos, Func func) const;
+    // Вызывает func(Cell*) для каждого диапазона, последняя строка (столбец)
+    // которого не меньше row (col), - для сдвига строк и столбцов
+    template <typename Func>
+    void ForEachReachingRow(int row, Func func) const;
+    template <typename Func>
+    void ForEachReachingCol(int col, Func func) const;
+
+    // Число диапазонов
+    size_t Size() const;
+
+private:
+    // Группа полос: направление (высокие, затем широкие) и ширина полос
+    static constexpr int GROUPS = 2 * static_cast<int>(BAND_SHIFTS.size());
+    // Уровни двоичных отрезков: отрезок верхнего уровня покрывает весь лист
+    static constexpr int LEVELS = 15;
+    static_assert(Position::MAX_ROWS <= 1 << (LEVELS - 1) && Position::MAX_COLS <= 1 << (LEVELS - 1));
+
+    struct Entry {
+        Range range;
+        // nullptr у свободной записи
+        Cell* cell = nullptr;
+    };
+
+    static std::uint64_t TileKey(int tile_row, int tile_col);
+    static std::uint64_t NodeKey(int group, int band, int level, int node);
+    static bool IsInTiles(const Range& range);
+    // Вызывает func(key, group, level) для каждого отрезка длинного диапазона
+    template <typename Func>
+    static void ForEachNode(const Range& range, Func func);
+
+    std::vector<Entry> entries_;
+    std::vector<std::uint32_t> free_entries_;
+    std::unordered_map<std::uint64_t, std::vector<std::uint32_t>> buckets_;
+    std::unordered_map<std::uint64_t, std::vector<std::uint32_t>> nodes_;
+    // Число записей в отрезках каждого уровня каждой группы: пустые уровни
+    // поиск пропускает
+    std::array<std::array<std::uint32_t, LEVELS>, GROUPS> node_counts_{};
+    std::array<std::uint32_t, GROUPS> group_counts_{};
+    std::unordered_map<Cell*, std::vector<std::uint32_t>> cell_entries_;
+    // Записи, упорядоченные по последней строке и последнему столбцу
+    std::set<std::pair<int, std::uint32_t>> by_last_row_;
+    std::set<std::pair<int, std::uint32_t>> by_last_col_;
+};
+
+template <typename Func>
+void RangeIndex::ForEachContaining(Position pos, Func func) const {
+    auto visit = [&](const std::vector<std::uint32_t>& indices) {
+        for (std::uint32_t index : indices) {
+            if (entries_[index].range.Contains(pos)) {
+                func(entries_[index].cell);
+            }
+        }
+    };
+    if (auto it = buckets_.find(TileKey(pos.row / TILE_SIZE, pos.col / TILE_SIZE)); it != buckets_.end()) {
+        visit(it->second);
+    }
+    for (int group = 0; group < GROUPS; ++group) {
+        if (group_counts_[group] == 0) {
+            continue;
+        }
+        bool is_tall = group < static_cast<int>(BAND_SHIFTS.size());
+        int band = (is_tall ? pos.col : pos.row) >> BAND_SHIFTS[group % BAND_SHIFTS.size()];
+        int index = is_tall ? pos.row : pos.col;
+        for (int level = 0; level < LEVELS; ++level) {
+            if (node_counts_[group][level] == 0) {
+                continue;
+            }
+            if (auto it = nodes_.find(NodeKey(group, band, level, index >> level)); it != nodes_.end()) {
+                visit(it->second);
+            }
+        }
+    }
+}
+
+template <typename Func>
+void RangeIndex::ForEachReachingRow(int row, Func func) const {
+    for (auto it = by_last_row_.lower_bound({row, 0}); it != by_last_row_.end(); ++it) {
+        func(entries_[it->second].cell);
+    }
+}
+
+template <typename Func>
+void RangeIndex::ForEachReachingCol(int col, Func func) const {
+    for (auto it = by_last_col_.lower_bound({col, 0}); it != by_last_col_.end(); ++it) {
+        func(entries_[it->second].cell);
+    }
+}
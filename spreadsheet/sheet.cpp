@@ -2,18 +2,26 @@
 
 #include "cell.h"
 #include "common.h"
+#include "number_codec.h"
 
 #include <algorithm>
+#include <cassert>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <locale>
 #include <optional>
 #include <stack>
+#include <streambuf>
+#include <string_view>
+#include <unordered_set>
+#include <unordered_map>
 
 using namespace std::literals;
 
 Sheet::~Sheet()
 {
-    sheet_.clear();
+    StopBackground();
     row_none_empty_cells_.clear();
     col_none_empty_cells_.clear();
     print_size_ = {0, 0};
@@ -29,8 +37,74 @@ void CheckPositionIsValid(const Position& pos) {
     }
 }
 
+namespace {
+// Поток вычисляет формулы листа: их чтения не ждут фонового пересчёта,
+// который сами и выполняют
+thread_local bool is_evaluating_thread = false;
+
+class EvaluatingScope {
+public:
+    EvaluatingScope()
+    : was_evaluating_(is_evaluating_thread)
+    {
+        is_evaluating_thread = true;
+    }
+
+    ~EvaluatingScope()
+    {
+        is_evaluating_thread = was_evaluating_;
+    }
+
+private:
+    bool was_evaluating_;
+};
+}  // namespace
+
+// Правка листа. При фоновом пересчёте прерывает его и держит лист до конца
+// правки, после чего запускает пересчёт заново; при EagerSync пересчитывает
+// лист в конце успешной правки.
+class Sheet::EditGuard {
+public:
+    explicit EditGuard(Sheet& sheet)
+    : sheet_(sheet),
+    exceptions_(std::uncaught_exceptions())
+    {
+        if (sheet_.policy_ == EvaluationPolicy::EagerBackground) {
+            sheet_.cancel_recalculation_ = true;
+            lock_ = std::unique_lock(sheet_.background_mutex_);
+            sheet_.cancel_recalculation_ = false;
+        }
+        // Указатели на удалённые ячейки остаются только в списке грязных,
+        // поэтому пустые плитки освобождаются, когда пересчитывать нечего
+        if (sheet_.dirty_cells_.empty()) {
+            sheet_.cells_.ReleaseEmptyTiles();
+        }
+    }
+
+    ~EditGuard() noexcept(false)
+    {
+        if (sheet_.policy_ == EvaluationPolicy::EagerBackground) {
+            // Прерванный пересчёт продолжается и после неудачной правки
+            if (!sheet_.dirty_cells_.empty()) {
+                sheet_.background_requested_ = true;
+                sheet_.background_pending_ = true;
+            }
+            lock_.unlock();
+            sheet_.background_cv_.notify_one();
+        } else if (sheet_.policy_ == EvaluationPolicy::EagerSync
+                   && std::uncaught_exceptions() == exceptions_) {
+            sheet_.RecalculateDirty();
+        }
+    }
+
+private:
+    Sheet& sheet_;
+    int exceptions_;
+    std::unique_lock<std::mutex> lock_;
+};
+
 bool Sheet::IsValidCell(const Position& pos) const {
-    if (sheet_.find(pos) == sheet_.end() || 
+    if (cells_.Find(pos) == nullptr || 
         !(pos < Position{print_size_.rows, print_size_.cols})) 
     {
         return false;
@@ -39,104 +113,1408 @@ bool Sheet::IsValidCell(const Position& pos) const {
     return true;
 }
 
-void Sheet::FillLinks(std::unique_ptr<Cell>& main_cell) {
-    auto ref_cells = main_cell->GetReferencedCells();
-    if (ref_cells.size() > 0) {
-        for (const auto& pos_ref : main_cell->GetReferencedCells()) {
-            if (sheet_.count(pos_ref) == 0) {
-                SetCell(pos_ref, "");
-            } 
-            sheet_.at(pos_ref)->AddLinkFrom(main_cell.get());
+Cell& Sheet::GetOrCreateCell(Position pos) {
+    Cell* cell = cells_.Find(pos);
+    if (cell == nullptr) {
+        cell = &cells_.Emplace(pos, this, pos);
+        // Новая ячейка встаёт в конец топологического порядка. У повторно
+        // занятой позиции связей нет, и прежний номер мог достаться другой
+        // ячейке при перестроении порядка, поэтому номер тоже выдаётся новый
+        cell->SetTopoIndex(++next_topo_index_);
+    }
+    return *cell;
+}
+
+// Узел выдаётся ячейке при первой связи: у большинства ячеек связей нет
+DependencyGraph::NodeId Sheet::GetGraphNode(Cell* cell) {
+    if (cell->GetGraphNode() == DependencyGraph::NO_NODE) {
+        cell->SetGraphNode(graph_.AddNode(cell));
+    }
+    return cell->GetGraphNode();
+}
+
+// Удаляет ячейку без связей из хранилища и освобождает её узел
+void Sheet::EraseCell(Position pos, Cell* cell) {
+    if (cell->GetGraphNode() != DependencyGraph::NO_NODE) {
+        graph_.RemoveNode(cell->GetGraphNode());
+        cell->SetGraphNode(DependencyGraph::NO_NODE);
+    }
+    cells_.Erase(pos);
+}
+
+void Sheet::EraseIfUnused(Position pos) {
+    Cell* cell = cells_.Find(pos);
+    if (cell != nullptr && !cell->IsReferenced() && cell->GetText().empty()) {
+        EraseCell(pos, cell);
+    }
+}
+
+void Sheet::RemoveLinks(Cell* main_cell) {
+    for (Cell* ref_cell : main_cell->GetLinksTo()) {
+        [[maybe_unused]] bool removed = graph_.RemoveEdge(ref_cell->GetGraphNode(), main_cell->GetGraphNode());
+        assert(removed);
+    }
+    main_cell->ClearLinksTo();
+}
+
+// Добавляет ребро ref_cell -> main_cell, сохраняя топологический порядок
+// (алгоритм Пирса - Келли). Если ref_cell уже стоит раньше, порядок верен и
+// проверка стоит O(1). Иначе порядок чинится только на отрезке между двумя
+// ячейками: ячейки, достижимые из main_cell вперёд, переставляются после
+// ячеек, из которых достижима ref_cell. Если из main_cell достижима сама
+// ref_cell, ребро замкнуло бы цикл; тогда граф не меняется и возвращается false.
+bool Sheet::AddLink(Cell* ref_cell, Cell* main_cell) {
+    int lower = main_cell->GetTopoIndex();
+    int upper = ref_cell->GetTopoIndex();
+
+    if (upper > lower) {
+        std::vector<Cell*> forward;
+        std::unordered_set<Cell*> visited{main_cell};
+        std::vector<Cell*> stack{main_cell};
+        bool is_cycle = false;
+        while (!stack.empty() && !is_cycle) {
+            Cell* cell = stack.back();
+            stack.pop_back();
+            forward.push_back(cell);
+            graph_.ForEachDependent(cell->GetGraphNode(), [&](Cell* dependent) {
+                if (dependent == ref_cell) {
+                    is_cycle = true;
+                } else if (dependent->GetTopoIndex() < upper && visited.insert(dependent).second) {
+                    stack.push_back(dependent);
+                }
+            });
+        }
+        if (is_cycle) {
+            return false;
+        }
+
+        std::vector<Cell*> backward;
+        visited = {ref_cell};
+        stack = {ref_cell};
+        while (!stack.empty()) {
+            Cell* cell = stack.back();
+            stack.pop_back();
+            backward.push_back(cell);
+            for (Cell* dependency : cell->GetLinksTo()) {
+                if (dependency->GetTopoIndex() > lower && visited.insert(dependency).second) {
+                    stack.push_back(dependency);
+                }
+            }
+        }
+
+        auto by_index = [](const Cell* lhs, const Cell* rhs) {
+            return lhs->GetTopoIndex() < rhs->GetTopoIndex();
+        };
+        std::sort(forward.begin(), forward.end(), by_index);
+        std::sort(backward.begin(), backward.end(), by_index);
+
+        std::vector<int> indices;
+        indices.reserve(forward.size() + backward.size());
+        for (const Cell* cell : backward) {
+            indices.push_back(cell->GetTopoIndex());
+        }
+        for (const Cell* cell : forward) {
+            indices.push_back(cell->GetTopoIndex());
+        }
+        std::sort(indices.begin(), indices.end());
+
+        auto index = indices.begin();
+        for (Cell* cell : backward) {
+            cell->SetTopoIndex(*index++);
+        }
+        for (Cell* cell : forward) {
+            cell->SetTopoIndex(*index++);
+        }
+    } else if (upper == lower) {
+        // Формула ссылается на свою же ячейку
+        return false;
+    }
+
+    graph_.AddEdge(GetGraphNode(ref_cell), GetGraphNode(main_cell));
+    main_cell->AddLinkTo(ref_cell);
+    return true;
+}
+
+void Sheet::RemoveLink(Cell* ref_cell, Cell* main_cell)
+{
+    [[maybe_unused]] bool removed = graph_.RemoveEdge(ref_cell->GetGraphNode(), main_cell->GetGraphNode());
+    assert(removed);
+    main_cell->RemoveLinkTo(ref_cell);
+}
+
+// Формулы, диапазоны которых содержат pos, без повторов
+std::vector<Cell*> Sheet::FindRangeDependents(Position pos) const
+{
+    std::vector<Cell*> dependents;
+    range_index_.ForEachContaining(pos, [&dependents](Cell* cell) {
+        dependents.push_back(cell);
+    });
+    std::sort(dependents.begin(), dependents.end());
+    dependents.erase(std::unique(dependents.begin(), dependents.end()), dependents.end());
+    return dependents;
+}
+
+// Ребро от ячейки-формулы к формуле, в диапазон которой она входит, создано
+// ради диапазона, если формула не ссылается на ячейку ещё и напрямую: иначе
+// ребро у них общее и принадлежит ссылке.
+bool Sheet::IsRangeLink(const Cell* ref_cell, const Cell* main_cell) const
+{
+    std::vector<Position> refs = main_cell->GetReferencedCells();
+    return !std::binary_search(refs.begin(), refs.end(), ref_cell->GetPosition(), [](Position lhs, Position rhs) {
+        return std::make_pair(lhs.row, lhs.col) < std::make_pair(rhs.row, rhs.col);
+    });
+}
+
+// Добавляет к links ячейки-формулы диапазонов ranges. Прочие ячейки диапазона
+// связей не получают: их правки находит range_index_.
+void Sheet::AppendRangeLinks(const std::vector<Range>& ranges, std::vector<Cell*>& links)
+{
+    for (const Range& range : ranges) {
+        cells_.ForEachInRange(range.first, range.last, [&links](Position, Cell& cell) {
+            if (cell.GetCellType() == Cell::FORMULA) {
+                links.push_back(&cell);
+            }
+        });
+    }
+}
+
+// Связывает ячейку, которая становится формулой, с формулами, в диапазоны
+// которых она входит. При цикле возвращает false и оставляет граф прежним.
+bool Sheet::AddRangeLinks(Cell* cell)
+{
+    std::vector<Cell*> added;
+    for (Cell* dependent : FindRangeDependents(cell->GetPosition())) {
+        if (!IsRangeLink(cell, dependent)) {
+            continue;
+        }
+        if (!AddLink(cell, dependent)) {
+            for (Cell* linked : added) {
+                RemoveLink(cell, linked);
+            }
+            return false;
+        }
+        added.push_back(dependent);
+    }
+    return true;
+}
+
+// Снимает связи ячейки, которая перестаёт быть формулой, с диапазонами
+void Sheet::RemoveRangeLinks(Cell* cell)
+{
+    for (Cell* dependent : FindRangeDependents(cell->GetPosition())) {
+        if (IsRangeLink(cell, dependent)) {
+            RemoveLink(cell, dependent);
+        }
+    }
+}
+
+// Заменяет связи ячейки main_cell связями формулы formula; nullptr - ячейка
+// перестаёт быть формулой. Вызывается, пока в ячейке ещё старое содержимое.
+// Формула связана с ячейками своих ссылок и с ячейками-формулами своих
+// диапазонов, пустые ячейки ради диапазонов не создаются. При циклической
+// зависимости бросает CircularDependencyException и оставляет граф прежним.
+void Sheet::SetLinks(Cell* main_cell, const FormulaInterface* formula) {
+    ScopedTimer timer(metrics_, MetricsCollector::Timer::CycleCheck);
+    std::vector<Position> refs;
+    std::vector<Range> ranges;
+    if (formula != nullptr) {
+        refs = formula->GetReferencedCells();
+        ranges = formula->GetReferencedRanges();
+    }
+    auto throw_cycle = [this] {
+        metrics_.Add(MetricsCollector::Counter::CyclesFound);
+        throw CircularDependencyException("Circular dependency");
+    };
+    for (const Range& range : ranges) {
+        if (range.Contains(main_cell->GetPosition())) {
+            throw_cycle();
         }
     }
+
+    std::vector<Position> old_refs = main_cell->GetReferencedCells();
+    std::vector<Cell*> old_links = main_cell->GetLinksTo();
+    std::vector<Cell*> new_links;
+    new_links.reserve(refs.size());
+    for (const auto& pos_ref : refs) {
+        new_links.push_back(&GetOrCreateCell(pos_ref));
+    }
+    AppendRangeLinks(ranges, new_links);
+    std::sort(new_links.begin(), new_links.end());
+    new_links.erase(std::unique(new_links.begin(), new_links.end()), new_links.end());
+    bool was_formula = main_cell->GetCellType() == Cell::FORMULA;
+
+    RemoveLinks(main_cell);
+    bool acyclic = true;
+    for (Cell* ref_cell : new_links) {
+        if (!AddLink(ref_cell, main_cell)) {
+            acyclic = false;
+            break;
+        }
+    }
+    if (acyclic && formula != nullptr && !was_formula) {
+        acyclic = AddRangeLinks(main_cell);
+    }
+    if (!acyclic) {
+        // Возвращает прежние рёбра; прежний граф ацикличен, поэтому
+        // это всегда удаётся
+        RemoveLinks(main_cell);
+        for (Cell* old_ref_cell : old_links) {
+            AddLink(old_ref_cell, main_cell);
+        }
+        for (const auto& pos_ref : refs) {
+            EraseIfUnused(pos_ref);
+        }
+        throw_cycle();
+    }
+    if (was_formula && formula == nullptr) {
+        RemoveRangeLinks(main_cell);
+    }
+    range_index_.Remove(main_cell);
+    range_index_.Add(main_cell, ranges);
+
+    for (const auto& pos_ref : old_refs) {
+        EraseIfUnused(pos_ref);
+    }
+}
+
+// Перенумеровывает все ячейки листа в топологическом порядке (алгоритм Кана).
+// При наличии цикла возвращает false и оставляет номера прежними.
+bool Sheet::RebuildTopologicalOrder() {
+    // На время обхода номер ячейки хранит число её ещё не упорядоченных ссылок
+    std::vector<Cell*> cells;
+    std::vector<int> old_indices;
+    cells.reserve(cells_.Size());
+    old_indices.reserve(cells_.Size());
+    std::vector<Cell*> order;
+    order.reserve(cells_.Size());
+    cells_.ForEach([&](Position, Cell& cell) {
+        cells.push_back(&cell);
+        old_indices.push_back(cell.GetTopoIndex());
+        cell.SetTopoIndex(static_cast<int>(cell.GetLinksTo().size()));
+        if (cell.GetLinksTo().empty()) {
+            order.push_back(&cell);
+        }
+    });
+
+    for (size_t i = 0; i < order.size(); ++i) {
+        graph_.ForEachDependent(order[i]->GetGraphNode(), [&order](Cell* dependent) {
+            int pending_refs = dependent->GetTopoIndex() - 1;
+            dependent->SetTopoIndex(pending_refs);
+            if (pending_refs == 0) {
+                order.push_back(dependent);
+            }
+        });
+    }
+
+    if (order.size() != cells.size()) {
+        for (size_t i = 0; i < cells.size(); ++i) {
+            cells[i]->SetTopoIndex(old_indices[i]);
+        }
+        return false;
+    }
+
+    next_topo_index_ = 0;
+    for (Cell* cell : order) {
+        cell->SetTopoIndex(++next_topo_index_);
+    }
+    return true;
+}
+
+void Sheet::InvalidateFrom(Cell* cell) {
+    // Каждая зависимая ячейка помечается один раз, сколькими бы путями до неё
+    // ни вела правка. Ячейка, которая не формула, не связана с диапазонами,
+    // куда входит, поэтому формулы с ними находятся по range_index_.
+    std::vector<Cell*>& stack = invalidate_stack_;
+    stack.clear();
+    stack.push_back(cell);
+    range_index_.ForEachContaining(cell->GetPosition(), [&stack](Cell* dependent) {
+        if (!dependent->IsDirty()) {
+            stack.push_back(dependent);
+        }
+    });
+    while (!stack.empty()) {
+        Cell* current = stack.back();
+        stack.pop_back();
+        if (current->IsDirty()) {
+            continue;
+        }
+        current->SetDirty(true);
+        current->ResetCache();
+        metrics_.Add(MetricsCollector::Counter::CacheResets);
+        PublishValue(*current);
+        dirty_cells_.push_back(current);
+        graph_.ForEachDependent(current->GetGraphNode(), [&stack](Cell* dependent) {
+            if (!dependent->IsDirty()) {
+                stack.push_back(dependent);
+            }
+        });
+    }
+}
+
+std::vector<std::vector<Cell*>> Sheet::BuildRecalculationLevels() {
+    // Алгоритм Кана на подграфе грязных ячеек, по слоям: формула попадает в
+    // уровень, следующий за уровнем последней грязной ячейки, на которую она
+    // ссылается. Формулы одного уровня друг от друга не зависят.
+    std::unordered_map<Cell*, int> pending_refs;
+    for (Cell* cell : dirty_cells_) {
+        graph_.ForEachDependent(cell->GetGraphNode(), [&pending_refs](Cell* dependent) {
+            if (dependent->IsDirty()) {
+                ++pending_refs[dependent];
+            }
+        });
+    }
+
+    std::vector<Cell*> current;
+    for (Cell* cell : dirty_cells_) {
+        if (pending_refs.count(cell) == 0) {
+            current.push_back(cell);
+        }
+    }
+
+    std::vector<std::vector<Cell*>> levels;
+    [[maybe_unused]] size_t visited = 0;
+    while (!current.empty()) {
+        visited += current.size();
+        std::vector<Cell*> next;
+        std::vector<Cell*> level;
+        for (Cell* cell : current) {
+            if (cell->GetCellType() == Cell::FORMULA) {
+                level.push_back(cell);
+            } else {
+                cell->SetDirty(false);
+            }
+            graph_.ForEachDependent(cell->GetGraphNode(), [&](Cell* dependent) {
+                if (dependent->IsDirty() && --pending_refs[dependent] == 0) {
+                    next.push_back(dependent);
+                }
+            });
+        }
+        if (!level.empty()) {
+            levels.push_back(std::move(level));
+        }
+        current = std::move(next);
+    }
+
+    // Циклов нет: их отсекает проверка при установке формулы
+    assert(visited == dirty_cells_.size());
+    return levels;
+}
+
+// Переносит значение ячейки в слепок values_. Значение формулы, ещё не
+// вычисленной после правки, считается прочим и берётся из ячейки.
+void Sheet::PublishValue(const Cell& cell)
+{
+    Position pos = cell.GetPosition();
+    if (is_versioned_) {
+        unpublished_changes_.push_back(pos);
+    }
+    if (cell.GetTextRef().empty()) {
+        values_.Erase(pos);
+        return;
+    }
+    if (!cell.HasValue()) {
+        values_.SetOther(pos);
+        return;
+    }
+    FormulaInterface::Value value = cell.GetNumericValue();
+    if (const double* number = std::get_if<double>(&value)) {
+        values_.SetNumber(pos, *number);
+    } else {
+        values_.SetOther(pos);
+    }
+}
+
+void Sheet::EvaluateLevel(const std::vector<Cell*>& level) {
+    // Мелкие уровни дешевле посчитать в текущем потоке
+    constexpr size_t MIN_PARALLEL_LEVEL = 64;
+
+    // Каждая ячейка пишет только свой кэш и читает кэши предыдущих уровней
+    auto evaluate = [&level](size_t i) {
+        EvaluatingScope scope;
+        level[i]->GetValue();
+        level[i]->SetDirty(false);
+    };
+
+    if (thread_pool_ != nullptr && level.size() >= MIN_PARALLEL_LEVEL) {
+        thread_pool_->ParallelFor(level.size(), evaluate);
+    } else {
+        for (size_t i = 0; i < level.size(); ++i) {
+            evaluate(i);
+        }
+    }
+    // Слепок пишется в одном потоке, пока формулы уровня его не читают
+    for (Cell* cell : level) {
+        PublishValue(*cell);
+    }
+}
+
+void Sheet::Recalculate() {
+    WaitForQuiescence();
+}
+
+void Sheet::RecalculateDirty() {
+    if (is_recalculating_ || dirty_cells_.empty()) {
+        return;
+    }
+    is_recalculating_ = true;
+
+    // Формула читает только закэшированные значения предыдущих уровней,
+    // поэтому рекурсии по цепочке зависимостей нет.
+    try {
+        for (const auto& level : BuildRecalculationLevels()) {
+            if (cancel_recalculation_.load(std::memory_order_relaxed)) {
+                // Грязные ячейки остаются замкнутыми по зависимым: уровни
+                // после прерванного ещё не вычислены
+                dirty_cells_.erase(std::remove_if(dirty_cells_.begin(), dirty_cells_.end(),
+                                                  [](const Cell* cell) { return !cell->IsDirty(); }),
+                                   dirty_cells_.end());
+                is_recalculating_ = false;
+                return;
+            }
+            EvaluateLevel(level);
+        }
+    } catch (...) {
+        is_recalculating_ = false;
+        throw;
+    }
+
+    dirty_cells_.clear();
+    is_recalculating_ = false;
+}
+
+void Sheet::SetEvaluationPolicy(EvaluationPolicy policy)
+{
+    if (policy == policy_) {
+        return;
+    }
+    StopBackground();
+    policy_ = policy;
+    if (policy_ == EvaluationPolicy::EagerSync) {
+        RecalculateDirty();
+    } else if (policy_ == EvaluationPolicy::EagerBackground) {
+        background_stop_ = false;
+        background_requested_ = !dirty_cells_.empty();
+        background_pending_ = background_requested_;
+        background_ = std::thread([this] {
+            BackgroundLoop();
+        });
+    }
+}
+
+EvaluationPolicy Sheet::GetEvaluationPolicy() const
+{
+    return policy_;
+}
+
+void Sheet::WaitForQuiescence()
+{
+    if (policy_ != EvaluationPolicy::EagerBackground) {
+        RecalculateDirty();
+        return;
+    }
+    if (!background_pending_.load(std::memory_order_acquire)) {
+        return;
+    }
+    // Фоновый поток отдаёт лист после уровня либо после пересчёта, остаток
+    // досчитывается здесь
+    std::lock_guard lock(background_mutex_);
+    RecalculateDirty();
+    background_requested_ = false;
+    background_pending_.store(false, std::memory_order_release);
+}
+
+void Sheet::BackgroundLoop()
+{
+    std::unique_lock lock(background_mutex_);
+    while (true) {
+        background_cv_.wait(lock, [this] {
+            return background_requested_ || background_stop_;
+        });
+        if (background_stop_) {
+            return;
+        }
+        background_requested_ = false;
+        try {
+            RecalculateDirty();
+        } catch (...) {
+            // Ячейки остаются грязными: ошибку получит читающий поток, когда
+            // будет досчитывать их в WaitForQuiescence
+            continue;
+        }
+        if (dirty_cells_.empty()) {
+            background_pending_.store(false, std::memory_order_release);
+        }
+    }
+}
+
+void Sheet::StopBackground()
+{
+    if (!background_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard lock(background_mutex_);
+        background_stop_ = true;
+    }
+    background_cv_.notify_one();
+    background_.join();
+    background_requested_ = false;
+    background_pending_ = false;
+}
+
+// Чтения из формул не ждут: их выполняет сам пересчёт
+void Sheet::WaitForReads() const
+{
+    if (!is_evaluating_thread && policy_ == EvaluationPolicy::EagerBackground) {
+        const_cast<Sheet*>(this)->WaitForQuiescence();
+    }
+}
+
+void Sheet::SetRecalculationThreads(size_t threads) {
+    EditGuard guard(*this);
+    if (threads <= 1) {
+        thread_pool_.reset();
+    } else if (GetRecalculationThreads() != threads) {
+        thread_pool_ = std::make_unique<ThreadPool>(threads);
+    }
+}
+
+size_t Sheet::GetRecalculationThreads() const {
+    return thread_pool_ == nullptr ? 1 : thread_pool_->GetThreadCount();
+}
+
+void Sheet::PublishVersion()
+{
+    EditGuard guard(*this);
+    RecalculateDirty();
+    if (!is_versioned_) {
+        is_versioned_ = true;
+        cells_.ForEach([this](Position pos, const Cell&) {
+            unpublished_changes_.push_back(pos);
+        });
+    }
+
+    auto by_position = [](Position lhs, Position rhs) {
+        return std::make_pair(lhs.row, lhs.col) < std::make_pair(rhs.row, rhs.col);
+    };
+    std::sort(unpublished_changes_.begin(), unpublished_changes_.end(), by_position);
+    unpublished_changes_.erase(std::unique(unpublished_changes_.begin(), unpublished_changes_.end()),
+                               unpublished_changes_.end());
+
+    std::vector<SheetVersion::Change> changes;
+    changes.reserve(unpublished_changes_.size());
+    for (Position pos : unpublished_changes_) {
+        const Cell* cell = cells_.Find(pos);
+        if (cell == nullptr || cell->GetTextRef().empty()) {
+            changes.emplace_back(pos, std::nullopt);
+        } else {
+            changes.emplace_back(pos, SheetVersion::Entry{cell->GetTextRef(), cell->GetValue()});
+        }
+    }
+    unpublished_changes_.clear();
+    versions_.Publish(SheetVersion::Update(versions_.GetLatest(), std::move(changes), print_size_));
+}
+
+VersionManager::Reader Sheet::ReadVersion() const
+{
+    return versions_.Pin();
+}
+
+SheetMetrics Sheet::GetMetrics() const
+{
+    return metrics_.GetSnapshot();
+}
+
+void Sheet::ResetMetrics()
+{
+    metrics_.Reset();
 }
 
 void Sheet::SetCell(Position pos, std::string text) {
+    ScopedTimer timer(metrics_, MetricsCollector::Timer::SetCell);
     CheckPositionIsValid(pos);
+    if (is_batch_open_) {
+        // Формула разбирается сразу, чтобы ошибка в ней была брошена отсюда,
+        // как вне пакета
+        std::unique_ptr<FormulaInterface> formula;
+        if (Cell::GetCellType(text) == Cell::FORMULA) {
+            ScopedTimer parse_timer(metrics_, MetricsCollector::Timer::Parse);
+            formula = formulas_.Parse(std::string_view(text).substr(1), pos);
+        }
+        AddToBatch(pos, std::move(text), std::move(formula), false);
+        return;
+    }
+    EditGuard guard(*this);
+
+    Cell& cell = GetOrCreateCell(pos);
+    bool was_printable = !cell.GetText().empty();
+
+    // Формула разбирается один раз: её ссылки проверяются на цикл, и она же
+    // устанавливается в ячейку
+    std::unique_ptr<FormulaInterface> formula;
+    try {
+        if (Cell::GetCellType(text) == Cell::FORMULA) {
+            ScopedTimer parse_timer(metrics_, MetricsCollector::Timer::Parse);
+            formula = formulas_.Parse(std::string_view(text).substr(1), pos);
+        }
+        SetLinks(&cell, formula.get());
+    } catch (...) {
+        EraseIfUnused(pos);
+        throw;
+    }
+
+    if (formula != nullptr) {
+        cell.Set(std::move(text), std::move(formula));
+    } else {
+        cell.Set(std::move(text));
+    }
+    InvalidateFrom(&cell);
+    PublishValue(cell);
+    UpdatePrintableSize(pos, was_printable, !cell.GetText().empty());
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    // Меньшие пакеты дешевле разобрать в текущем потоке
+    constexpr size_t MIN_PARALLEL_PARSE = 256;
+
+    for (const auto& [pos, text] : cells) {
+        CheckPositionIsValid(pos);
+    }
+
+    // Из повторяющихся позиций действует последняя
+    {
+        std::unordered_map<Position, size_t, Position::Hasher, Position::EqualTo> last_edit;
+        last_edit.reserve(cells.size());
+        for (size_t i = 0; i < cells.size(); ++i) {
+            last_edit[cells[i].first] = i;
+        }
+        if (last_edit.size() != cells.size()) {
+            size_t kept = 0;
+            for (size_t i = 0; i < cells.size(); ++i) {
+                if (last_edit[cells[i].first] != i) {
+                    continue;
+                }
+                if (kept != i) {
+                    cells[kept] = std::move(cells[i]);
+                }
+                ++kept;
+            }
+            cells.resize(kept);
+        }
+    }
+
+    // Разбор формул не трогает ни лист, ни пакет, поэтому ошибка в нём ничего
+    // не меняет
+    std::vector<std::unique_ptr<FormulaInterface>> formulas(cells.size());
+    auto parse = [&](size_t i) {
+        const auto& [pos, text] = cells[i];
+        if (Cell::GetCellType(text) == Cell::FORMULA) {
+            ScopedTimer timer(metrics_, MetricsCollector::Timer::Parse);
+            formulas[i] = formulas_.Parse(std::string_view(text).substr(1), pos);
+        }
+    };
+
+    if (is_batch_open_) {
+        for (size_t i = 0; i < cells.size(); ++i) {
+            parse(i);
+        }
+        for (size_t i = 0; i < cells.size(); ++i) {
+            AddToBatch(cells[i].first, std::move(cells[i].second), std::move(formulas[i]), false);
+        }
+        return;
+    }
+
+    EditGuard guard(*this);
+    if (thread_pool_ != nullptr && cells.size() >= MIN_PARALLEL_PARSE) {
+        thread_pool_->ParallelFor(cells.size(), parse);
+    } else {
+        for (size_t i = 0; i < cells.size(); ++i) {
+            parse(i);
+        }
+    }
+    ApplyEdits(std::move(cells), std::move(formulas));
+}
 
-    if (sheet_.count(pos) == 0) {
-        sheet_[pos] = std::make_unique<Cell>(this);
-    } else if (sheet_.at(pos)->IsReferenced()) {
-        sheet_.at(pos)->ResetCache();
+// Применяет правки с уже разобранными формулами одной атомарной правкой.
+// Позиции cells не повторяются.
+void Sheet::ApplyEdits(std::vector<std::pair<Position, std::string>> cells,
+                       std::vector<std::unique_ptr<FormulaInterface>> formulas)
+{
+    // Пакет, начиная с которого связи проще перестроить целиком, чем
+    // добавлять по одной
+    constexpr size_t MIN_REBUILD_BATCH = 1024;
+
+    // Журнал для отката: прежние связи каждой ячейки пакета, снятые и
+    // добавленные связи ячеек пакета с диапазонами прочих формул и ячейки,
+    // созданные пакетом
+    std::vector<Cell*> targets;
+    std::vector<std::vector<Cell*>> old_links;
+    std::vector<Position> old_refs;
+    std::vector<std::pair<Cell*, Cell*>> removed_range_links;
+    std::vector<std::pair<Cell*, Cell*>> added_range_links;
+    std::vector<Position> created;
+    auto get_or_create = [&](Position pos) -> Cell& {
+        if (cells_.Find(pos) == nullptr) {
+            created.push_back(pos);
+        }
+        return GetOrCreateCell(pos);
+    };
+
+    targets.reserve(cells.size());
+    old_links.reserve(cells.size());
+    std::unordered_map<const Cell*, size_t> target_indices;
+    target_indices.reserve(cells.size());
+    for (size_t i = 0; i < cells.size(); ++i) {
+        Cell& cell = get_or_create(cells[i].first);
+        targets.push_back(&cell);
+        target_indices.emplace(&cell, i);
+        old_links.push_back(cell.GetLinksTo());
+        for (Position pos_ref : cell.GetReferencedCells()) {
+            old_refs.push_back(pos_ref);
+        }
     }
-    
+    // Ячейка - формула после пакета
+    auto is_formula = [&](const Cell& cell) {
+        auto it = target_indices.find(&cell);
+        return it != target_indices.end() ? formulas[it->second] != nullptr : cell.GetCellType() == Cell::FORMULA;
+    };
+
+    auto rollback = [&] {
+        for (Cell* cell : targets) {
+            RemoveLinks(cell);
+            range_index_.Remove(cell);
+        }
+        for (auto [ref_cell, main_cell] : added_range_links) {
+            RemoveLink(ref_cell, main_cell);
+        }
+        // Каждый шаг восстанавливает подграф прежнего ацикличного графа,
+        // поэтому добавление не может замкнуть цикл
+        for (size_t i = 0; i < targets.size(); ++i) {
+            for (Cell* ref_cell : old_links[i]) {
+                [[maybe_unused]] bool added = AddLink(ref_cell, targets[i]);
+                assert(added);
+            }
+            if (const FormulaInterface* formula = targets[i]->GetFormula()) {
+                range_index_.Add(targets[i], formula->GetReferencedRanges());
+            }
+        }
+        for (auto [ref_cell, main_cell] : removed_range_links) {
+            [[maybe_unused]] bool added = AddLink(ref_cell, main_cell);
+            assert(added);
+        }
+        for (Position pos : created) {
+            EraseIfUnused(pos);
+        }
+    };
+
     try {
-        sheet_.at(pos)->Set(text);
-    } catch (const CircularDependencyException&) {
+        ScopedTimer timer(metrics_, MetricsCollector::Timer::CycleCheck);
+        // Связи формул пакета с формулами пакета строятся заново целиком,
+        // поэтому снимаются только связи с диапазонами прочих формул
+        for (Cell* cell : targets) {
+            RemoveLinks(cell);
+        }
+        for (Cell* cell : targets) {
+            if (cell->GetCellType() != Cell::FORMULA) {
+                continue;
+            }
+            for (Cell* dependent : FindRangeDependents(cell->GetPosition())) {
+                if (target_indices.count(dependent) == 0 && IsRangeLink(cell, dependent)) {
+                    RemoveLink(cell, dependent);
+                    removed_range_links.emplace_back(cell, dependent);
+                }
+            }
+        }
+        for (Cell* cell : targets) {
+            range_index_.Remove(cell);
+        }
+
+        bool rebuild = cells.size() >= MIN_REBUILD_BATCH;
+        auto link = [&](Cell* ref_cell, Cell* main_cell) {
+            if (!rebuild) {
+                return AddLink(ref_cell, main_cell);
+            }
+            // Порядок проверяется один раз после всех рёбер
+            graph_.AddEdge(GetGraphNode(ref_cell), GetGraphNode(main_cell));
+            main_cell->AddLinkTo(ref_cell);
+            return true;
+        };
+        bool acyclic = true;
+        std::vector<Cell*> links;
+        for (size_t i = 0; i < targets.size() && acyclic; ++i) {
+            if (formulas[i] == nullptr) {
+                continue;
+            }
+            Cell* cell = targets[i];
+            links.clear();
+            for (Position pos_ref : formulas[i]->GetReferencedCells()) {
+                links.push_back(&get_or_create(pos_ref));
+            }
+            for (const Range& range : formulas[i]->GetReferencedRanges()) {
+                acyclic = acyclic && !range.Contains(cell->GetPosition());
+                cells_.ForEachInRange(range.first, range.last, [&](Position, Cell& member) {
+                    if (is_formula(member)) {
+                        links.push_back(&member);
+                    }
+                });
+            }
+            std::sort(links.begin(), links.end());
+            links.erase(std::unique(links.begin(), links.end()), links.end());
+            for (size_t j = 0; j < links.size() && acyclic; ++j) {
+                acyclic = link(links[j], cell);
+            }
+            // Формулы пакета находят ячейку сами, в индексе остались прочие
+            for (Cell* dependent : FindRangeDependents(cell->GetPosition())) {
+                if (!acyclic) {
+                    break;
+                }
+                if (IsRangeLink(cell, dependent)) {
+                    acyclic = link(cell, dependent);
+                    if (acyclic) {
+                        added_range_links.emplace_back(cell, dependent);
+                    }
+                }
+            }
+        }
+        if (rebuild && acyclic) {
+            graph_.Compact();
+            acyclic = RebuildTopologicalOrder();
+        }
+        if (!acyclic) {
+            metrics_.Add(MetricsCollector::Counter::CyclesFound);
+            throw CircularDependencyException("Circular dependency");
+        }
+        for (size_t i = 0; i < targets.size(); ++i) {
+            if (formulas[i] != nullptr) {
+                range_index_.Add(targets[i], formulas[i]->GetReferencedRanges());
+            }
+        }
+    } catch (...) {
+        rollback();
         throw;
-    } catch (const std::exception& exc) {
-        throw FormulaException(exc.what());
     }
 
-    FillLinks(sheet_.at(pos));
+    for (size_t i = 0; i < cells.size(); ++i) {
+        Cell& cell = *targets[i];
+        bool was_printable = !cell.GetText().empty();
+        if (formulas[i] != nullptr) {
+            cell.Set(std::move(cells[i].second), std::move(formulas[i]));
+        } else {
+            cell.Set(std::move(cells[i].second));
+        }
+        UpdatePrintableSize(cells[i].first, was_printable, !cell.GetText().empty());
+    }
+    for (Cell* cell : targets) {
+        InvalidateFrom(cell);
+        PublishValue(*cell);
+    }
+    for (Position pos_ref : old_refs) {
+        EraseIfUnused(pos_ref);
+    }
+}
 
-    if (!(sheet_.at(pos) == nullptr || sheet_.at(pos)->GetText().empty())) {
-        IncreasePrintableSize(pos);
+void Sheet::BeginBatch()
+{
+    is_batch_open_ = true;
+}
+
+void Sheet::Commit()
+{
+    if (!is_batch_open_) {
+        return;
+    }
+    auto cells = std::move(batch_cells_);
+    auto formulas = std::move(batch_formulas_);
+    std::vector<Position> cleared;
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (batch_clears_[i]) {
+            cleared.push_back(cells[i].first);
+        }
+    }
+    Rollback();
+
+    EditGuard guard(*this);
+    ApplyEdits(std::move(cells), std::move(formulas));
+    for (Position pos : cleared) {
+        EraseIfUnused(pos);
+    }
+    // Иначе пересчёт запускает guard
+    if (policy_ == EvaluationPolicy::Lazy) {
+        RecalculateDirty();
+    }
+}
+
+void Sheet::Rollback()
+{
+    is_batch_open_ = false;
+    batch_cells_.clear();
+    batch_formulas_.clear();
+    batch_clears_.clear();
+    batch_index_.clear();
+}
+
+// Откладывает правку до Commit. Формулу text разбирает вызывающий: правка
+// попадает в пакет только целиком разобранной.
+void Sheet::AddToBatch(Position pos, std::string text, std::unique_ptr<FormulaInterface> formula, bool clear)
+{
+    auto [it, inserted] = batch_index_.emplace(pos, batch_cells_.size());
+    if (inserted) {
+        batch_cells_.emplace_back(pos, std::move(text));
+        batch_formulas_.push_back(std::move(formula));
+        batch_clears_.push_back(clear);
+    } else {
+        batch_cells_[it->second].second = std::move(text);
+        batch_formulas_[it->second] = std::move(formula);
+        batch_clears_[it->second] = clear;
+    }
+}
+
+void Sheet::InsertRows(int before, int count)
+{
+    ShiftCells(SheetShift{SheetShift::Axis::Rows, before, count, true});
+}
+
+void Sheet::InsertCols(int before, int count)
+{
+    ShiftCells(SheetShift{SheetShift::Axis::Cols, before, count, true});
+}
+
+void Sheet::DeleteRows(int first, int count)
+{
+    ShiftCells(SheetShift{SheetShift::Axis::Rows, first, count, false});
+}
+
+void Sheet::DeleteCols(int first, int count)
+{
+    ShiftCells(SheetShift{SheetShift::Axis::Cols, first, count, false});
+}
+
+// Сдвигает ячейки от shift.first до края листа. Затронутые формулы - это
+// сдвинутые формулы и формулы, ссылающиеся на сдвинутые либо удалённые
+// ячейки; остальной лист не обходится.
+void Sheet::ShiftCells(const SheetShift& shift)
+{
+    int limit = shift.axis == SheetShift::Axis::Rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    // Ограничение count не даёт сдвигу переполнить int
+    if (shift.first < 0 || shift.count < 0 || shift.first > limit || shift.count > limit - shift.first) {
+        throw InvalidPositionException("Invalid rows or columns.");
+    }
+    if (shift.count == 0) {
+        return;
+    }
+    auto to_position = [&shift](int index) {
+        return shift.axis == SheetShift::Axis::Rows ? Position{index, 0} : Position{0, index};
+    };
+    const Position sheet_last{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+
+    // Ячейка пропадает, если её строка (столбец) удаляется или уходит за край
+    // листа. За край уходят только пустые ячейки, на которые ссылаются формулы:
+    // ссылки на них становятся #REF!, как при удалении.
+    auto is_removed = [&shift](Position pos) {
+        return shift.IsDeleted(pos) || !shift.Apply(pos).IsValid();
+    };
+    // Непустые ячейки проверяются до применения открытого пакета, с учётом
+    // его правок, чтобы при отказе не менялись ни лист, ни пакет
+    if (shift.is_insert) {
+        auto check = [](const std::string& text) {
+            if (!text.empty()) {
+                throw InvalidPositionException("Cells would move outside the sheet.");
+            }
+        };
+        cells_.ForEachInRange(to_position(limit - shift.count), sheet_last, [&](Position pos, const Cell& cell) {
+            if (batch_index_.count(pos) == 0) {
+                check(cell.GetTextRef());
+            }
+        });
+        for (const auto& [pos, text] : batch_cells_) {
+            if (is_removed(pos)) {
+                check(text);
+            }
+        }
+    }
+    if (is_batch_open_) {
+        Commit();
+    }
+    EditGuard guard(*this);
+
+    std::vector<Position> moved;
+    std::vector<Position> deleted;
+    cells_.ForEachInRange(to_position(shift.first), sheet_last, [&](Position pos, const Cell&) {
+        (is_removed(pos) ? deleted : moved).push_back(pos);
+    });
+
+    // Формулы, ссылки которых переписываются, по прежним позициям: сдвинутые,
+    // ссылающиеся на сдвинутые и удалённые ячейки и формулы с диапазонами,
+    // которые задевают сдвигаемые строки (столбцы)
+    std::vector<Position> affected;
+    auto add_affected = [&affected](const Cell* cell) {
+        if (cell->GetCellType() == Cell::FORMULA) {
+            affected.push_back(cell->GetPosition());
+        }
+    };
+    for (const auto* positions : {&moved, &deleted}) {
+        for (Position pos : *positions) {
+            const Cell* cell = cells_.Find(pos);
+            add_affected(cell);
+            graph_.ForEachDependent(cell->GetGraphNode(), add_affected);
+        }
+    }
+    auto add_reaching = [&affected](const Cell* cell) {
+        affected.push_back(cell->GetPosition());
+    };
+    if (shift.axis == SheetShift::Axis::Rows) {
+        range_index_.ForEachReachingRow(shift.first, add_reaching);
+    } else {
+        range_index_.ForEachReachingCol(shift.first, add_reaching);
+    }
+    auto axis_index = [&shift](Position pos) {
+        return shift.axis == SheetShift::Axis::Rows ? pos.row : pos.col;
+    };
+    auto by_position = [](Position lhs, Position rhs) {
+        return std::make_pair(lhs.row, lhs.col) < std::make_pair(rhs.row, rhs.col);
+    };
+    std::sort(affected.begin(), affected.end(), by_position);
+    affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+    if (moved.empty() && deleted.empty() && affected.empty()) {
+        return;
+    }
+
+    // Новые формулы готовятся до изменения листа. Значение формулы меняется,
+    // только если она теряет ячейки: ссылка становится #REF!, а диапазон
+    // задевает удалённые строки (столбцы) или уходит за край листа.
+    std::vector<std::unique_ptr<FormulaInterface>> formulas;
+    std::vector<bool> loses_cells(affected.size());
+    formulas.reserve(affected.size());
+    for (size_t i = 0; i < affected.size(); ++i) {
+        if (is_removed(affected[i])) {
+            formulas.push_back(nullptr);
+            continue;
+        }
+        const FormulaInterface& formula = *cells_.Find(affected[i])->GetFormula();
+        formulas.push_back(ShiftFormula(formula, shift.Apply(affected[i]), shift));
+        for (Position pos : formula.GetReferencedCells()) {
+            loses_cells[i] = loses_cells[i] || is_removed(pos);
+        }
+        for (const Range& range : formula.GetReferencedRanges()) {
+            bool loses = shift.is_insert ? !shift.Apply(range).IsValid()
+                                         : axis_index(range.first) < shift.first + shift.count
+                                               && axis_index(range.last) >= shift.first;
+            loses_cells[i] = loses_cells[i] || loses;
+        }
+    }
+
+    // Связи затронутых формул снимаются, а после переноса ячеек строятся
+    // заново по новым ссылкам. Зависимые сдвинутых и удалённых ячеек тоже
+    // затронуты, поэтому других рёбер у этих ячеек не остаётся.
+    for (Position pos : affected) {
+        Cell* cell = cells_.Find(pos);
+        RemoveLinks(cell);
+        range_index_.Remove(cell);
+    }
+    // В списке грязных остаются и стёртые ячейки. Их не переносим и снимаем
+    // пометку: Emplace в ту же позицию вернёт этот же объект.
+    std::vector<Position> dirty_positions;
+    for (Cell* cell : dirty_cells_) {
+        Position pos = cell->GetPosition();
+        if (cells_.Find(pos) != cell) {
+            cell->SetDirty(false);
+        } else if (!is_removed(pos)) {
+            dirty_positions.push_back(shift.Apply(pos));
+        }
+    }
+    for (const auto* positions : {&deleted, &moved}) {
+        for (Position pos : *positions) {
+            if (!cells_.Find(pos)->GetTextRef().empty()) {
+                DecreasePrintableSize(pos);
+            }
+            values_.Erase(pos);
+            if (is_versioned_) {
+                unpublished_changes_.push_back(pos);
+            }
+        }
+    }
+
+    for (Position pos : deleted) {
+        Cell* cell = cells_.Find(pos);
+        cell->Clear();
+        cell->SetDirty(false);
+        EraseCell(pos, cell);
+    }
+    // Ячейка переносится на место, которое уже освобождено: при вставке
+    // обход идёт с конца, при удалении - с начала
+    if (shift.is_insert) {
+        std::reverse(moved.begin(), moved.end());
+    }
+    for (Position pos : moved) {
+        Cell* source = cells_.Find(pos);
+        Position new_pos = shift.Apply(pos);
+        Cell& cell = cells_.Emplace(new_pos, this, new_pos);
+        cell.MoveFrom(*source);
+        if (cell.GetGraphNode() != DependencyGraph::NO_NODE) {
+            graph_.MoveNode(cell.GetGraphNode(), &cell);
+        }
+        cells_.Erase(pos);
+        if (!cell.GetTextRef().empty()) {
+            IncreasePrintableSize(new_pos);
+        }
+    }
+    dirty_cells_.clear();
+    for (Position pos : dirty_positions) {
+        dirty_cells_.push_back(cells_.Find(pos));
+    }
+
+    // Связи те же, что до сдвига, между теми же ячейками, поэтому цикл не
+    // появляется
+    std::vector<Cell*> changed;
+    std::vector<Cell*> links;
+    for (size_t i = 0; i < affected.size(); ++i) {
+        if (formulas[i] == nullptr) {
+            continue;
+        }
+        Cell* cell = cells_.Find(shift.Apply(affected[i]));
+        cell->ReplaceFormula(std::move(formulas[i]));
+        std::vector<Range> ranges = cell->GetFormula()->GetReferencedRanges();
+        links.clear();
+        for (Position pos : cell->GetReferencedCells()) {
+            links.push_back(&GetOrCreateCell(pos));
+        }
+        AppendRangeLinks(ranges, links);
+        std::sort(links.begin(), links.end());
+        links.erase(std::unique(links.begin(), links.end()), links.end());
+        for (Cell* ref_cell : links) {
+            [[maybe_unused]] bool linked = AddLink(ref_cell, cell);
+            assert(linked);
+        }
+        range_index_.Add(cell, ranges);
+        if (loses_cells[i]) {
+            changed.push_back(cell);
+        }
+    }
+    for (Position pos : moved) {
+        PublishValue(*cells_.Find(shift.Apply(pos)));
+    }
+    for (Cell* cell : changed) {
+        InvalidateFrom(cell);
     }
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     CheckPositionIsValid(pos);
+    WaitForReads();
 
     if (!IsValidCell(pos)) {
         return nullptr;
     }
-    return sheet_.at(pos).get();
+    return cells_.Find(pos);
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
     CheckPositionIsValid(pos);
+    WaitForReads();
 
     if (!IsValidCell(pos)) {
         return nullptr;
     }
-    return sheet_.at(pos).get();
+    return cells_.Find(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
     CheckPositionIsValid(pos);
+    if (is_batch_open_) {
+        AddToBatch(pos, {}, nullptr, true);
+        return;
+    }
+    EditGuard guard(*this);
 
-    if (pos < Position{print_size_.rows, print_size_.cols} && sheet_.count(pos) != 0) {
-        sheet_.at(pos)->Clear();
-        sheet_.at(pos) = nullptr;
-        DecreasePrintableSize(pos);
+    Cell* cell = cells_.Find(pos);
+    if (cell == nullptr) {
+        return;
+    }
+
+    bool was_printable = !cell->GetText().empty();
+
+    SetLinks(cell, nullptr);
+    cell->Clear();
+    InvalidateFrom(cell);
+    PublishValue(*cell);
+    UpdatePrintableSize(pos, was_printable, false);
+
+    // Ячейка, на которую ссылаются формулы, остаётся пустой, чтобы сохранить связи
+    if (!cell->IsReferenced()) {
+        EraseCell(pos, cell);
     }
 }
 
+namespace {
+// Буфер вывода таблицы: текст копится в строке и уходит в поток блоками.
+// Значения форматируются потоком с настройками output, поэтому вывод совпадает
+// с поэлементным выводом в output. При настройках по умолчанию числа пишутся
+// напрямую через to_chars с точностью output.
+class PrintBuffer : private std::streambuf
+{
+public:
+    explicit PrintBuffer(std::ostream& output)
+    : output_(output),
+    formatter_(this),
+    is_default_format_((output.flags() & NUMBER_FORMAT_FLAGS) == 0 && output.width() == 0
+                       && output.precision() >= 0
+                       && output.getloc() == std::locale::classic())
+    {
+        formatter_.copyfmt(output);
+        buffer_.reserve(BLOCK_SIZE * 2);
+    }
+
+    void Append(std::string_view text)
+    {
+        buffer_.append(text);
+        FlushIfFull();
+    }
+
+    void Append(char ch, int count)
+    {
+        if (count > 0) {
+            buffer_.append(count, ch);
+            FlushIfFull();
+        }
+    }
+
+    template <typename T>
+    void Format(const T& value)
+    {
+        formatter_ << value;
+        FlushIfFull();
+    }
+
+    void Format(const std::string& value)
+    {
+        Append(value);
+    }
+
+    void Format(double value)
+    {
+        if (is_default_format_) {
+            AppendNumber(buffer_, value, static_cast<int>(output_.precision()));
+        } else {
+            formatter_ << value;
+        }
+        FlushIfFull();
+    }
+
+    void Flush()
+    {
+        output_.write(buffer_.data(), buffer_.size());
+        buffer_.clear();
+    }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+    static constexpr std::ios_base::fmtflags NUMBER_FORMAT_FLAGS = std::ios_base::floatfield
+        | std::ios_base::showpoint | std::ios_base::showpos | std::ios_base::uppercase;
+
+    std::ostream& output_;
+    std::ostream formatter_;
+    bool is_default_format_;
+    std::string buffer_;
+
+    void FlushIfFull()
+    {
+        if (buffer_.size() >= BLOCK_SIZE) {
+            Flush();
+        }
+    }
+
+    int_type overflow(int_type ch) override
+    {
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            buffer_.push_back(traits_type::to_char_type(ch));
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char* text, std::streamsize count) override
+    {
+        buffer_.append(text, count);
+        return count;
+    }
+};
+
+// Выводит таблицу size, обходя только занятые ячейки построчно: промежутки
+// между ними заполняются серией табуляций. Как и прежде, выводится каждая
+// существующая ячейка печатной области, в том числе пустая.
+template <typename PrintCell>
+void PrintTable(const TiledStorage<Cell>& cells, Size size, std::ostream& output, PrintCell print_cell)
+{
+    PrintBuffer buffer(output);
+    // Следующая позиция вывода: всё левее col в строке row уже выведено
+    Position next{0, 0};
+    auto finish_row = [&buffer, &next, size]() {
+        buffer.Append('\t', size.cols - 1 - next.col);
+        buffer.Append('\n', 1);
+        ++next.row;
+        next.col = 0;
+    };
+
+    cells.ForEach([&](Position pos, const Cell& cell) {
+        if (pos.row >= size.rows || pos.col >= size.cols) {
+            return;
+        }
+        while (next.row < pos.row) {
+            finish_row();
+        }
+        buffer.Append('\t', pos.col - next.col);
+        print_cell(buffer, cell);
+        if (pos.col < size.cols - 1) {
+            buffer.Append('\t', 1);
+        }
+        next.col = pos.col + 1;
+    });
+    while (next.row < size.rows) {
+        finish_row();
+    }
+    buffer.Flush();
+}
+}  // namespace
+
 Size Sheet::GetPrintableSize() const {
     return print_size_;
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    for (int r = 0; r < print_size_.rows; ++r) {
-        for (int c = 0; c < print_size_.cols; ++c) {
-            if (GetCell(Position{r, c}) != nullptr) {
-                std::visit([&output](const auto& arg){output << arg;}, GetCell(Position{r, c})->GetValue());;
-            }
-            if (c < print_size_.cols - 1) {
-                output << "\t";
-            }            
-        }
-        output << "\n";
-    }
+    WaitForReads();
+    PrintTable(cells_, print_size_, output, [](PrintBuffer& buffer, const Cell& cell) {
+        std::visit([&buffer](const auto& arg) {
+            buffer.Format(arg);
+        }, cell.GetValue());
+    });
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-    for (int r = 0; r < print_size_.rows; ++r) {
-        for (int c = 0; c < print_size_.cols; ++c) {
-            Position pos = Position{r, c};
-            if (GetCell(pos) != nullptr) {
-                output << sheet_.at(pos)->GetText();
-            }
-            if (c < print_size_.cols - 1) {
-                output << "\t";
-            }            
-        }
-        output << "\n";
-    }
+    WaitForReads();
+    PrintTable(cells_, print_size_, output, [](PrintBuffer& buffer, const Cell& cell) {
+        buffer.Append(cell.GetTextRef());
+    });
 }
 
-
+void Sheet::GetNumericValues(Range range, std::vector<double>& values) const
+{
+    WaitForReads();
+    if (values_.ReadNumbers(range.first, range.last, values)) {
+        return;
+    }
+    // Ошибки бросаются в прежнем порядке, построчно, а невычисленные формулы
+    // вычисляются при чтении
+    cells_.ForEachInRange(range.first, range.last, [&values](Position, const Cell& cell) {
+        if (cell.GetTextRef().empty()) {
+            return;
+        }
+        FormulaInterface::Value value = cell.GetNumericValue();
+        if (const double* number = std::get_if<double>(&value)) {
+            values.push_back(*number);
+        } else {
+            throw std::get<FormulaError>(value);
+        }
+    });
+}
 
 void Sheet::IncreasePrintableSize(const Position& pos)
 {
@@ -146,6 +1524,15 @@ void Sheet::IncreasePrintableSize(const Position& pos)
     print_size_.cols = std::max(pos.col + 1, print_size_.cols);
 }
 
+void Sheet::UpdatePrintableSize(const Position& pos, bool was_printable, bool is_printable)
+{
+    if (!was_printable && is_printable) {
+        IncreasePrintableSize(pos);
+    } else if (was_printable && !is_printable) {
+        DecreasePrintableSize(pos);
+    }
+}
+
 void Sheet::DecreasePrintableSize(const Position& pos)
 {
     --row_none_empty_cells_.at(pos.row);
@@ -2,10 +2,35 @@
 
 #include "cell.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "formula.h"
+#include "metrics.h"
+#include "range_index.h"
+#include "sheet_version.h"
+#include "thread_pool.h"
+#include "tiled_storage.h"
+#include "value_plane.h"
 
+#include <atomic>
+#include <condition_variable>
 #include <functional>
 #include <map>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Когда лист вычисляет формулы, затронутые правками
+enum class EvaluationPolicy {
+    // При первом чтении значения после правки
+    Lazy,
+    // В конце каждой правки, до возврата из неё
+    EagerSync,
+    // В фоновом потоке сразу после правки; правка возвращается без ожидания
+    EagerBackground
+};
 
 class Sheet : public SheetInterface {
 public:
@@ -13,6 +38,40 @@ public:
 
     void SetCell(Position pos, std::string text) override;
 
+    // Устанавливает содержимое многих ячеек за одну правку. Формулы
+    // разбираются заранее (при нескольких потоках пересчёта - параллельно),
+    // связи большого пакета проверяются на циклы одним проходом по графу, а
+    // зависимые ячейки помечаются к пересчёту один раз. Правка атомарна: при
+    // FormulaException или CircularDependencyException лист не меняется. Из
+    // повторяющихся позиций действует последняя.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+    // Открывает пакет правок: SetCell, SetCells и ClearCell до Commit или
+    // Rollback только запоминаются (из повторных правок позиции действует
+    // последняя), а чтения видят лист до пакета. Ошибки в формулах и позициях
+    // бросаются сразу. Повторный BeginBatch продолжает открытый пакет.
+    void BeginBatch();
+    // Применяет пакет как один SetCells: связи и сброс кэшей считаются один
+    // раз, после чего лист пересчитывается. При CircularDependencyException
+    // пакет отбрасывается, а лист не меняется.
+    void Commit();
+    // Отбрасывает пакет; лист не менялся, поэтому откат ничего не стоит
+    void Rollback();
+
+    // Вставляют count пустых строк (столбцов) перед строкой (столбцом) before
+    // и удаляют count строк (столбцов), начиная с first. Ячейки сдвигаются, а
+    // ссылки формул переписываются без разбора выражений: вставка внутри
+    // диапазона расширяет его, ссылки на удалённые ячейки становятся #REF!.
+    // Стоимость пропорциональна числу сдвинутых ячеек и формул, которые на
+    // них ссылаются. Если непустые ячейки вышли бы за пределы листа (с учётом
+    // открытого пакета правок), бросается InvalidPositionException, и ни
+    // лист, ни пакет не меняются; ссылки на ушедшие за край пустые ячейки
+    // становятся #REF!. Иначе открытый пакет сначала применяется.
+    void InsertRows(int before, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
@@ -23,14 +82,158 @@ public:
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // Читает числа из столбцового слепка значений; ячейки обходятся только
+    // при ошибках и невычисленных формулах в диапазоне
+    void GetNumericValues(Range range, std::vector<double>& values) const override;
+
+    // Обходят непустые ячейки построчно, по возрастанию позиций:
+    // func(Position, const CellInterface&). Время пропорционально числу
+    // занятых ячеек (пустые плитки листа пропускаются целиком), на ячейку
+    // ничего не выделяется. Менять лист во время обхода нельзя.
+    template <typename Func>
+    void ForEachCell(Func&& func) const;
+    // Только ячейки прямоугольника range; при некорректном range бросается
+    // InvalidPositionException
+    template <typename Func>
+    void ForEachCell(Range range, Func&& func) const;
+
+    // Вычисляет все формулы, затронутые правками с момента прошлого пересчёта.
+    // Каждая формула вычисляется ровно один раз, после всех формул, от которых
+    // она зависит. Вызывается автоматически при первом чтении значения формулы.
+    void Recalculate();
+
+    // Политика пересчёта, по умолчанию Lazy. При EagerBackground правка
+    // прерывает идущий фоновый пересчёт и запускает его заново, а чтения через
+    // методы листа (GetCell, PrintValues, PrintTexts, GetNumericValues,
+    // снимки) дожидаются его окончания. Указатели на ячейки, полученные до
+    // правки, после неё нужно получить заново.
+    void SetEvaluationPolicy(EvaluationPolicy policy);
+    EvaluationPolicy GetEvaluationPolicy() const;
+
+    // Дожидается, пока все правки будут пересчитаны. При фоновом пересчёте
+    // оставшуюся работу доделывает вызывающий поток.
+    void WaitForQuiescence();
+
+    // Число потоков пересчёта; 1 - последовательный пересчёт. Независимые
+    // формулы одного уровня зависимостей вычисляются параллельно, результат
+    // совпадает с последовательным.
+    void SetRecalculationThreads(size_t threads);
+    size_t GetRecalculationThreads() const;
+
+    // Пересчитывает лист и публикует его состояние как новую версию для
+    // читателей. Копируются только плитки с ячейками, изменёнными после
+    // прошлой публикации; первая публикация обходит весь лист.
+    void PublishVersion();
+
+    // Закрепляет последнюю опубликованную версию (до первой публикации -
+    // пустую). Безопасно вызывать и читать версию из любых потоков
+    // одновременно с правками и публикациями; закреплённая версия не меняется.
+    // Читатели не должны пережить лист.
+    VersionManager::Reader ReadVersion() const;
+
+    // Счётчики и замеры времени с последнего сброса. Собираются, только если
+    // сборка определяет SPREADSHEET_METRICS, иначе снимок нулевой.
+    SheetMetrics GetMetrics() const;
+    void ResetMetrics();
+
 private:
+    friend class SheetSnapshot;
+    friend class Cell;
+    class EditGuard;
+
     Size print_size_;
-    std::unordered_map<Position, std::unique_ptr<Cell>, Position::Hasher, Position::EqualTo> sheet_;
+    TiledStorage<Cell> cells_;
+    // Обратные связи формул; прямые хранит сама ячейка
+    DependencyGraph graph_;
+    // Диапазоны формул: их ячейки связаны с формулой, только если сами формулы
+    RangeIndex range_index_;
+    // Числовые значения ячеек по столбцам для свёрток диапазонов
+    ValuePlane values_;
+    // Общие деревья формул, протянутых вдоль листа
+    FormulaInternTable formulas_;
     std::map<int, int> row_none_empty_cells_;
     std::map<int, int> col_none_empty_cells_;
+    // Ячейки, затронутые правками и ещё не пересчитанные
+    std::vector<Cell*> dirty_cells_;
+    // Стек обхода InvalidateFrom: память переиспользуется между правками
+    std::vector<Cell*> invalidate_stack_;
+    bool is_recalculating_ = false;
+    std::unique_ptr<ThreadPool> thread_pool_;
+    int next_topo_index_ = 0;
+    mutable MetricsCollector metrics_;
+    VersionManager versions_;
+    // Версии публикуются; тогда копятся позиции, изменённые после публикации
+    bool is_versioned_ = false;
+    std::vector<Position> unpublished_changes_;
+    // Открытый пакет правок: по одной правке на позицию, формулы уже разобраны
+    bool is_batch_open_ = false;
+    std::vector<std::pair<Position, std::string>> batch_cells_;
+    std::vector<std::unique_ptr<FormulaInterface>> batch_formulas_;
+    std::vector<bool> batch_clears_;
+    std::unordered_map<Position, size_t, Position::Hasher, Position::EqualTo> batch_index_;
+    EvaluationPolicy policy_ = EvaluationPolicy::Lazy;
+    // Фоновый пересчёт: поток держит background_mutex_, пока считает
+    std::thread background_;
+    std::mutex background_mutex_;
+    std::condition_variable background_cv_;
+    bool background_requested_ = false;
+    bool background_stop_ = false;
+    // Есть правки, ещё не пересчитанные фоновым потоком
+    std::atomic<bool> background_pending_{false};
+    // Правка ждёт листа: пересчёт прерывается после текущего уровня
+    std::atomic<bool> cancel_recalculation_{false};
 
     void IncreasePrintableSize(const Position& pos);
     void DecreasePrintableSize(const Position& pos);
-    void FillLinks(std::unique_ptr<Cell>& main_cell);
+    void UpdatePrintableSize(const Position& pos, bool was_printable, bool is_printable);
+    Cell& GetOrCreateCell(Position pos);
+    DependencyGraph::NodeId GetGraphNode(Cell* cell);
+    void EraseCell(Position pos, Cell* cell);
+    void SetLinks(Cell* main_cell, const FormulaInterface* formula);
+    void RemoveLinks(Cell* main_cell);
+    bool AddLink(Cell* ref_cell, Cell* main_cell);
+    void RemoveLink(Cell* ref_cell, Cell* main_cell);
+    std::vector<Cell*> FindRangeDependents(Position pos) const;
+    bool IsRangeLink(const Cell* ref_cell, const Cell* main_cell) const;
+    void AppendRangeLinks(const std::vector<Range>& ranges, std::vector<Cell*>& links);
+    bool AddRangeLinks(Cell* cell);
+    void RemoveRangeLinks(Cell* cell);
+    bool RebuildTopologicalOrder();
+    void EraseIfUnused(Position pos);
+    void InvalidateFrom(Cell* cell);
+    void PublishValue(const Cell& cell);
+    void ApplyEdits(std::vector<std::pair<Position, std::string>> cells,
+                    std::vector<std::unique_ptr<FormulaInterface>> formulas);
+    void AddToBatch(Position pos, std::string text, std::unique_ptr<FormulaInterface> formula, bool clear);
+    void ShiftCells(const SheetShift& shift);
+    std::vector<std::vector<Cell*>> BuildRecalculationLevels();
+    void EvaluateLevel(const std::vector<Cell*>& level);
+    void RecalculateDirty();
+    void BackgroundLoop();
+    void StopBackground();
+    void WaitForReads() const;
     bool IsValidCell(const Position& pos) const;
-};
\ No newline at end of file
+};
+
+template <typename Func>
+void Sheet::ForEachCell(Func&& func) const {
+    WaitForReads();
+    cells_.ForEach([&func](Position pos, const Cell& cell) {
+        if (!cell.GetTextRef().empty()) {
+            func(pos, static_cast<const CellInterface&>(cell));
+        }
+    });
+}
+
+template <typename Func>
+void Sheet::ForEachCell(Range range, Func&& func) const {
+    if (!range.IsValid()) {
+        throw InvalidPositionException("Invalid range.");
+    }
+    WaitForReads();
+    cells_.ForEachInRange(range.first, range.last, [&func](Position pos, const Cell& cell) {
+        if (!cell.GetTextRef().empty()) {
+            func(pos, static_cast<const CellInterface&>(cell));
+        }
+    });
+}
\ No newline at end of file
@@ -0,0 +1,89 @@
+#include "sheet_io.h"
+
+#include "mapped_file.h"
+
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace {
+// Конец поля без кавычек: разделитель, перевод строки или конец данных
+size_t FindFieldEnd(std::string_view data, size_t pos, char separator)
+{
+    while (pos < data.size() && data[pos] != separator && data[pos] != '\n') {
+        ++pos;
+    }
+    return pos;
+}
+
+// Читает поле CSV в кавычках, начиная с открывающей кавычки. Удвоенная
+// кавычка внутри поля означает одну. Возвращает позицию после закрывающей.
+size_t ReadQuotedField(std::string_view data, size_t pos, std::string& text)
+{
+    ++pos;
+    while (true) {
+        size_t quote = data.find('"', pos);
+        if (quote == std::string_view::npos) {
+            throw std::runtime_error("Unterminated quoted field");
+        }
+        text.append(data.substr(pos, quote - pos));
+        pos = quote + 1;
+        if (pos < data.size() && data[pos] == '"') {
+            text += '"';
+            ++pos;
+        } else {
+            return pos;
+        }
+    }
+}
+}  // namespace
+
+void ImportTable(Sheet& sheet, std::string_view data, char separator)
+{
+    std::vector<std::pair<Position, std::string>> cells;
+    Position pos{0, 0};
+    size_t i = 0;
+    while (i < data.size()) {
+        std::string text;
+        if (separator == ',' && data[i] == '"') {
+            i = ReadQuotedField(data, i, text);
+        } else {
+            size_t end = FindFieldEnd(data, i, separator);
+            std::string_view field = data.substr(i, end - i);
+            i = end;
+            if (!field.empty() && field.back() == '\r' && (i == data.size() || data[i] == '\n')) {
+                field.remove_suffix(1);
+            }
+            text = field;
+        }
+
+        if (!text.empty()) {
+            cells.emplace_back(pos, std::move(text));
+        }
+
+        if (i < data.size() && data[i] == '\r' && i + 1 < data.size() && data[i + 1] == '\n') {
+            ++i;
+        }
+        if (i == data.size()) {
+            break;
+        }
+        if (data[i] == separator) {
+            ++pos.col;
+        } else if (data[i] == '\n') {
+            ++pos.row;
+            pos.col = 0;
+        } else {
+            throw std::runtime_error("Unexpected character after quoted field in row "
+                                     + std::to_string(pos.row + 1));
+        }
+        ++i;
+    }
+
+    sheet.SetCells(std::move(cells));
+}
+
+void ImportTableFile(Sheet& sheet, const std::string& path, char separator)
+{
+    MappedFile file(path);
+    ImportTable(sheet, file.GetData(), separator);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <string>
+#include <string_view>
+
+// Загружает таблицу в формате Sheet::PrintTexts: строки разделены '\n' (или
+// "\r\n"), поля - separator. Поле становится текстом ячейки как есть, так что
+// формулы и экранированный текст распознаются по первому символу, а пустые
+// поля ячеек не создают. При separator == ',' поля могут быть взяты в двойные
+// кавычки по правилам CSV. Загрузка идёт одним пакетом Sheet::SetCells и
+// атомарна: при исключении лист не меняется.
+void ImportTable(Sheet& sheet, std::string_view data, char separator = '\t');
+
+// То же для файла, отображённого в память.
+void ImportTableFile(Sheet& sheet, const std::string& path, char separator = '\t');
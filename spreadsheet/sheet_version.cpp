@@ -0,0 +1,178 @@
+#include "sheet_version.h"
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <tuple>
+
+namespace {
+std::uint16_t GetOffset(Position pos)
+{
+    return static_cast<std::uint16_t>((pos.row % SheetVersion::TILE_SIZE) * SheetVersion::TILE_SIZE
+                                      + pos.col % SheetVersion::TILE_SIZE);
+}
+}  // namespace
+
+std::unique_ptr<const SheetVersion> SheetVersion::Update(const SheetVersion& base, std::vector<Change> changes,
+                                                         Size printable_size)
+{
+    auto tile_key = [](Position pos) {
+        return std::make_tuple(pos.row / TILE_SIZE, pos.col / TILE_SIZE, GetOffset(pos));
+    };
+    std::sort(changes.begin(), changes.end(), [&tile_key](const Change& lhs, const Change& rhs) {
+        return tile_key(lhs.first) < tile_key(rhs.first);
+    });
+
+    auto version = std::make_unique<SheetVersion>(base);
+    version->number_ = base.number_ + 1;
+    version->printable_size_ = printable_size;
+    auto& bands = version->bands_;
+
+    for (size_t i = 0; i < changes.size();) {
+        size_t band_index = changes[i].first.row / TILE_SIZE;
+        if (band_index >= bands.size()) {
+            bands.resize(band_index + 1);
+        }
+        auto band = bands[band_index] != nullptr ? std::make_shared<Band>(*bands[band_index])
+                                                 : std::make_shared<Band>();
+        while (i < changes.size() && static_cast<size_t>(changes[i].first.row / TILE_SIZE) == band_index) {
+            size_t tile_index = changes[i].first.col / TILE_SIZE;
+            if (tile_index >= band->size()) {
+                band->resize(tile_index + 1);
+            }
+
+            // Слияние прежних ячеек плитки с изменёнными, обе части упорядочены
+            auto tile = std::make_shared<Tile>();
+            const Tile* old_tile = (*band)[tile_index].get();
+            size_t old_index = 0;
+            auto copy_old_before = [&](std::uint32_t offset) {
+                while (old_tile != nullptr && old_index < old_tile->entries.size()
+                       && old_tile->entries[old_index].first < offset) {
+                    tile->entries.push_back(old_tile->entries[old_index++]);
+                }
+            };
+            for (; i < changes.size() && static_cast<size_t>(changes[i].first.row / TILE_SIZE) == band_index
+                   && static_cast<size_t>(changes[i].first.col / TILE_SIZE) == tile_index;
+                 ++i) {
+                std::uint16_t offset = GetOffset(changes[i].first);
+                copy_old_before(offset);
+                if (old_tile != nullptr && old_index < old_tile->entries.size()
+                    && old_tile->entries[old_index].first == offset) {
+                    ++old_index;
+                }
+                if (changes[i].second.has_value()) {
+                    tile->entries.emplace_back(offset, std::move(*changes[i].second));
+                }
+            }
+            copy_old_before(TILE_SIZE * TILE_SIZE);
+            (*band)[tile_index] = tile->entries.empty() ? nullptr : std::move(tile);
+        }
+        bands[band_index] = std::move(band);
+    }
+    return version;
+}
+
+std::uint64_t SheetVersion::GetNumber() const
+{
+    return number_;
+}
+
+Size SheetVersion::GetPrintableSize() const
+{
+    return printable_size_;
+}
+
+const SheetVersion::Entry* SheetVersion::Find(Position pos) const
+{
+    if (!pos.IsValid()) {
+        return nullptr;
+    }
+    size_t band_index = pos.row / TILE_SIZE;
+    if (band_index >= bands_.size() || bands_[band_index] == nullptr) {
+        return nullptr;
+    }
+    const Band& band = *bands_[band_index];
+    size_t tile_index = pos.col / TILE_SIZE;
+    if (tile_index >= band.size() || band[tile_index] == nullptr) {
+        return nullptr;
+    }
+    const auto& entries = band[tile_index]->entries;
+    std::uint16_t offset = GetOffset(pos);
+    auto it = std::lower_bound(entries.begin(), entries.end(), offset, [](const auto& entry, std::uint16_t value) {
+        return entry.first < value;
+    });
+    return it != entries.end() && it->first == offset ? &it->second : nullptr;
+}
+
+VersionManager::Reader::Reader(std::atomic<std::uint64_t>* slot, const SheetVersion* version)
+: slot_(slot),
+version_(version)
+{
+}
+
+VersionManager::Reader::Reader(Reader&& other) noexcept
+: slot_(std::exchange(other.slot_, nullptr)),
+version_(other.version_)
+{
+}
+
+VersionManager::Reader::~Reader()
+{
+    if (slot_ != nullptr) {
+        slot_->store(INACTIVE, std::memory_order_release);
+    }
+}
+
+VersionManager::VersionManager()
+: latest_(std::make_unique<SheetVersion>())
+{
+    current_.store(latest_.get());
+}
+
+VersionManager::~VersionManager() = default;
+
+// Читатель отмечает в своём слоте эпоху до того, как прочитает указатель на
+// версию. Все операции последовательно согласованы, поэтому писатель, заменивший
+// версию в эпоху e, либо увидит слот читателя с эпохой не больше e, либо
+// читатель уже получит новую версию.
+VersionManager::Reader VersionManager::Pin() const
+{
+    size_t start = std::hash<std::thread::id>{}(std::this_thread::get_id());
+    for (size_t attempt = 0;; ++attempt) {
+        Slot& slot = slots_[(start + attempt) % SLOTS];
+        std::uint64_t expected = INACTIVE;
+        if (slot.epoch.load(std::memory_order_relaxed) == INACTIVE
+            && slot.epoch.compare_exchange_strong(expected, epoch_.load())) {
+            return Reader(&slot.epoch, current_.load());
+        }
+        if (attempt % SLOTS == SLOTS - 1) {
+            // Все слоты заняты: ждём, пока освободится какой-нибудь
+            std::this_thread::yield();
+        }
+    }
+}
+
+const SheetVersion& VersionManager::GetLatest() const
+{
+    return *latest_;
+}
+
+void VersionManager::Publish(std::unique_ptr<const SheetVersion> version)
+{
+    current_.store(version.get());
+    retired_.push_back({epoch_.fetch_add(1), std::move(latest_)});
+    latest_ = std::move(version);
+    Reclaim();
+}
+
+void VersionManager::Reclaim()
+{
+    std::uint64_t oldest_reader = INACTIVE;
+    for (const Slot& slot : slots_) {
+        oldest_reader = std::min(oldest_reader, slot.epoch.load());
+    }
+    // Версия, заменённая в эпоху e, может читаться только читателями с эпохой не больше e
+    retired_.erase(std::remove_if(retired_.begin(), retired_.end(), [oldest_reader](const Retired& retired) {
+        return retired.epoch < oldest_reader;
+    }), retired_.end());
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Неизменяемая версия листа: тексты непустых ячеек и их вычисленные значения.
+// Лист разбит на плитки TILE_SIZE x TILE_SIZE; новая версия копирует только
+// плитки с изменёнными ячейками, остальные делит с предыдущей.
+class SheetVersion {
+public:
+    static constexpr int TILE_SIZE = 16;
+
+    struct Entry {
+        std::string text;
+        CellInterface::Value value;
+    };
+
+    // Новое содержимое позиции; nullopt - ячейка пуста
+    using Change = std::pair<Position, std::optional<Entry>>;
+
+    // Строит следующую за base версию. Позиции changes не повторяются.
+    static std::unique_ptr<const SheetVersion> Update(const SheetVersion& base, std::vector<Change> changes,
+                                                      Size printable_size);
+
+    // Номер версии; пустая начальная версия имеет номер 0
+    std::uint64_t GetNumber() const;
+    Size GetPrintableSize() const;
+
+    // Содержимое ячейки либо nullptr для пустой
+    const Entry* Find(Position pos) const;
+
+private:
+    struct Tile {
+        // Упорядочены по номеру позиции внутри плитки
+        std::vector<std::pair<std::uint16_t, Entry>> entries;
+    };
+    using Band = std::vector<std::shared_ptr<const Tile>>;
+
+    // bands_[tile_row][tile_col]
+    std::vector<std::shared_ptr<const Band>> bands_;
+    std::uint64_t number_ = 0;
+    Size printable_size_;
+};
+
+// Версии листа для одного писателя и многих читателей. Читатель закрепляет
+// последнюю опубликованную версию без блокировок и читает её, пока писатель
+// публикует следующие. Версия удаляется писателем, когда её не может читать
+// ни один читатель: каждый читатель отмечает эпоху, в которую начал чтение,
+// а заменённая версия ждёт, пока все такие читатели не закончат.
+class VersionManager {
+public:
+    // Закреплённая версия; действительна до уничтожения объекта
+    class Reader {
+    public:
+        Reader(Reader&& other) noexcept;
+        Reader& operator=(Reader&&) = delete;
+        ~Reader();
+
+        const SheetVersion& operator*() const {
+            return *version_;
+        }
+
+        const SheetVersion* operator->() const {
+            return version_;
+        }
+
+    private:
+        friend class VersionManager;
+
+        Reader(std::atomic<std::uint64_t>* slot, const SheetVersion* version);
+
+        std::atomic<std::uint64_t>* slot_;
+        const SheetVersion* version_;
+    };
+
+    VersionManager();
+    // Читатели не должны пережить менеджер
+    ~VersionManager();
+
+    VersionManager(const VersionManager&) = delete;
+    VersionManager& operator=(const VersionManager&) = delete;
+
+    // Безопасно из любых потоков
+    Reader Pin() const;
+
+    // Только для писателя
+    const SheetVersion& GetLatest() const;
+    void Publish(std::unique_ptr<const SheetVersion> version);
+
+private:
+    static constexpr size_t SLOTS = 128;
+    static constexpr std::uint64_t INACTIVE = ~std::uint64_t{0};
+
+    struct alignas(64) Slot {
+        std::atomic<std::uint64_t> epoch{INACTIVE};
+    };
+
+    struct Retired {
+        std::uint64_t epoch;
+        std::unique_ptr<const SheetVersion> version;
+    };
+
+    mutable std::array<Slot, SLOTS> slots_;
+    std::atomic<std::uint64_t> epoch_{0};
+    std::atomic<const SheetVersion*> current_;
+    std::unique_ptr<const SheetVersion> latest_;
+    std::vector<Retired> retired_;
+
+    void Reclaim();
+};
@@ -0,0 +1,468 @@
+#include "snapshot.h"
+
+#include "FormulaAST.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+constexpr char MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+// Записывается в порядке байтов машины; на машине с другим порядком не совпадёт
+constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+constexpr uint32_t NO_FORMULA = UINT32_MAX;
+
+enum class SectionId : uint32_t {
+    Cells,
+    Texts,
+    Formulas,
+    Nodes,
+    Dependents,
+};
+constexpr uint32_t SECTION_COUNT = 5;
+
+struct Header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t section_count;
+    uint32_t reserved;
+};
+
+struct SectionEntry {
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+};
+
+enum class ValueKind : uint8_t {
+    None,
+    Number,
+    Error,
+};
+
+struct CellRecord {
+    int32_t row;
+    int32_t col;
+    uint64_t text_offset;
+    uint32_t text_size;
+    // Загрузка не доверяет сохранённому порядку и строит его заново
+    int32_t topo_index;
+    // Индекс в секции формул либо NO_FORMULA
+    uint32_t formula;
+    int32_t anchor_row;
+    int32_t anchor_col;
+    ValueKind value_kind;
+    uint8_t error_category;
+    uint8_t reserved[2];
+    double number;
+};
+
+// Отрезок постфиксной записи дерева в секции узлов
+struct FormulaRecord {
+    uint64_t first_node;
+    uint64_t node_count;
+};
+
+// Диапазон хранит углы в row, col и last_row, last_col, вызов функции - её
+// номер и число аргументов
+struct NodeRecord {
+    uint8_t type;
+    uint8_t function;
+    uint8_t reserved[2];
+    int32_t row;
+    int32_t col;
+    int32_t last_row;
+    int32_t last_col;
+    uint32_t arg_count;
+    double number;
+};
+
+static_assert(sizeof(Header) == 24 && sizeof(SectionEntry) == 32 && sizeof(CellRecord) == 48
+                  && sizeof(FormulaRecord) == 16 && sizeof(NodeRecord) == 32,
+              "snapshot records must not contain implicit padding");
+
+// FNV-1a по 64-битным словам
+uint64_t Checksum(std::string_view data) {
+    constexpr uint64_t PRIME = 0x100000001b3;
+    uint64_t hash = 0xcbf29ce484222325;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data.data() + i, sizeof(word));
+        hash = (hash ^ word) * PRIME;
+        hash ^= hash >> 32;
+    }
+    for (; i < data.size(); ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * PRIME;
+    }
+    return hash;
+}
+
+template <typename T>
+void Append(std::string& out, const T& record) {
+    out.append(reinterpret_cast<const char*>(&record), sizeof(T));
+}
+
+// Записи читаются копированием: данные снимка не обязаны быть выровнены
+template <typename T>
+T Read(std::string_view data, size_t index) {
+    T record;
+    std::memcpy(&record, data.data() + index * sizeof(T), sizeof(T));
+    return record;
+}
+
+template <typename T>
+size_t CountRecords(std::string_view section) {
+    if (section.size() % sizeof(T) != 0) {
+        throw SnapshotError("Snapshot section has invalid size");
+    }
+    return section.size() / sizeof(T);
+}
+
+class SnapshotReader {
+public:
+    explicit SnapshotReader(std::string_view data)
+        : data_(data) {
+        if (data.size() < sizeof(Header)) {
+            throw SnapshotError("Snapshot is truncated");
+        }
+        auto header = Read<Header>(data, 0);
+        if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+            throw SnapshotError("Not a sheet snapshot");
+        }
+        if (header.byte_order != BYTE_ORDER_MARK) {
+            throw SnapshotError("Snapshot has foreign byte order");
+        }
+        if (header.version != SheetSnapshot::VERSION) {
+            throw SnapshotError("Unsupported snapshot version " + std::to_string(header.version));
+        }
+        if (header.section_count != SECTION_COUNT
+            || data.size() < sizeof(Header) + SECTION_COUNT * sizeof(SectionEntry)) {
+            throw SnapshotError("Snapshot section table is invalid");
+        }
+
+        std::string_view table = data.substr(sizeof(Header));
+        for (uint32_t i = 0; i < SECTION_COUNT; ++i) {
+            sections_[i] = Read<SectionEntry>(table, i);
+            const SectionEntry& section = sections_[i];
+            if (section.id != i || section.offset > data.size()
+                || section.size > data.size() - section.offset) {
+                throw SnapshotError("Snapshot section table is invalid");
+            }
+        }
+    }
+
+    // Контрольная сумма секции проверяется при первом обращении к ней
+    std::string_view GetSection(SectionId id) {
+        const SectionEntry& section = sections_[static_cast<uint32_t>(id)];
+        std::string_view data = data_.substr(section.offset, section.size);
+        if (!verified_[section.id]) {
+            if (Checksum(data) != section.checksum) {
+                throw SnapshotError("Snapshot section " + std::to_string(section.id) + " is corrupted");
+            }
+            verified_[section.id] = true;
+        }
+        return data;
+    }
+
+private:
+    std::string_view data_;
+    SectionEntry sections_[SECTION_COUNT] = {};
+    bool verified_[SECTION_COUNT] = {};
+};
+
+std::vector<std::shared_ptr<const FormulaAST>> ReadFormulas(SnapshotReader& reader) {
+    std::string_view formulas = reader.GetSection(SectionId::Formulas);
+    std::string_view nodes = reader.GetSection(SectionId::Nodes);
+    size_t node_count = CountRecords<NodeRecord>(nodes);
+
+    std::vector<std::shared_ptr<const FormulaAST>> asts(CountRecords<FormulaRecord>(formulas));
+    std::vector<ASTImpl::PostfixNode> postfix;
+    for (size_t i = 0; i < asts.size(); ++i) {
+        auto formula = Read<FormulaRecord>(formulas, i);
+        if (formula.first_node > node_count || formula.node_count > node_count - formula.first_node) {
+            throw SnapshotError("Snapshot formula is out of range");
+        }
+
+        postfix.clear();
+        for (uint64_t j = formula.first_node; j < formula.first_node + formula.node_count; ++j) {
+            auto record = Read<NodeRecord>(nodes, j);
+            ASTImpl::PostfixNode node;
+            node.type = static_cast<ASTImpl::PostfixNode::Type>(record.type);
+            node.number = record.number;
+            node.cell = Position{record.row, record.col};
+            node.last = Position{record.last_row, record.last_col};
+            node.function = static_cast<ASTImpl::Function>(record.function);
+            node.arg_count = record.arg_count;
+            postfix.push_back(node);
+        }
+        try {
+            asts[i] = std::make_shared<FormulaAST>(FormulaASTFromPostfix(postfix.data(), postfix.size()));
+        } catch (const ParsingError& error) {
+            throw SnapshotError(std::string("Snapshot formula is invalid: ") + error.what());
+        }
+    }
+    return asts;
+}
+}  // namespace
+
+void SheetSnapshot::Save(const Sheet& sheet, std::ostream& output) {
+    sheet.WaitForReads();
+    std::vector<const Cell*> cells;
+    std::vector<Position> positions;
+    std::unordered_map<const Cell*, uint32_t> cell_indices;
+    sheet.cells_.ForEach([&](Position pos, const Cell& cell) {
+        cell_indices.emplace(&cell, static_cast<uint32_t>(cells.size()));
+        cells.push_back(&cell);
+        positions.push_back(pos);
+    });
+
+    std::string sections[SECTION_COUNT];
+    std::string& cell_section = sections[static_cast<uint32_t>(SectionId::Cells)];
+    std::string& texts = sections[static_cast<uint32_t>(SectionId::Texts)];
+    std::string& formulas = sections[static_cast<uint32_t>(SectionId::Formulas)];
+    std::string& nodes = sections[static_cast<uint32_t>(SectionId::Nodes)];
+    std::string& dependents = sections[static_cast<uint32_t>(SectionId::Dependents)];
+
+    std::unordered_map<const FormulaAST*, uint32_t> formula_indices;
+    uint64_t node_count = 0;
+    std::vector<ASTImpl::PostfixNode> postfix;
+    for (size_t i = 0; i < cells.size(); ++i) {
+        const Cell& cell = *cells[i];
+        std::string text = cell.GetText();
+
+        CellRecord record{};
+        record.row = positions[i].row;
+        record.col = positions[i].col;
+        record.text_offset = texts.size();
+        record.text_size = static_cast<uint32_t>(text.size());
+        record.topo_index = cell.GetTopoIndex();
+        record.formula = NO_FORMULA;
+        texts += text;
+
+        if (const FormulaInterface* formula = cell.GetFormula()) {
+            auto [ast, anchor] = GetFormulaAST(*formula);
+            auto [it, inserted] = formula_indices.emplace(ast.get(), static_cast<uint32_t>(formula_indices.size()));
+            if (inserted) {
+                postfix.clear();
+                ast->Serialize(postfix);
+                Append(formulas, FormulaRecord{node_count, postfix.size()});
+                for (const auto& node : postfix) {
+                    NodeRecord node_record{};
+                    node_record.type = static_cast<uint8_t>(node.type);
+                    node_record.function = static_cast<uint8_t>(node.function);
+                    node_record.row = node.cell.row;
+                    node_record.col = node.cell.col;
+                    node_record.last_row = node.last.row;
+                    node_record.last_col = node.last.col;
+                    node_record.arg_count = node.arg_count;
+                    node_record.number = node.number;
+                    Append(nodes, node_record);
+                }
+                node_count += postfix.size();
+            }
+            record.formula = it->second;
+            record.anchor_row = anchor.row;
+            record.anchor_col = anchor.col;
+
+            // Пересчитывает лист при первом обращении к грязной формуле
+            CellInterface::Value value = cell.GetValue();
+            if (std::holds_alternative<double>(value)) {
+                record.value_kind = ValueKind::Number;
+                record.number = std::get<double>(value);
+            } else if (std::holds_alternative<FormulaError>(value)) {
+                record.value_kind = ValueKind::Error;
+                record.error_category = static_cast<uint8_t>(std::get<FormulaError>(value).GetCategory());
+            }
+        }
+        Append(cell_section, record);
+    }
+
+    // Зависимые ячейки в формате CSR: смещения для каждой ячейки, затем индексы
+    std::string dependent_indices;
+    uint64_t dependent_count = 0;
+    for (const Cell* cell : cells) {
+        Append(dependents, dependent_count);
+        sheet.graph_.ForEachDependent(cell->GetGraphNode(), [&](const Cell* dependent) {
+            Append(dependent_indices, cell_indices.at(dependent));
+            ++dependent_count;
+        });
+    }
+    Append(dependents, dependent_count);
+    dependents += dependent_indices;
+
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.byte_order = BYTE_ORDER_MARK;
+    header.version = VERSION;
+    header.section_count = SECTION_COUNT;
+
+    std::string table;
+    uint64_t offset = sizeof(Header) + SECTION_COUNT * sizeof(SectionEntry);
+    for (uint32_t i = 0; i < SECTION_COUNT; ++i) {
+        sections[i].resize((sections[i].size() + 7) / 8 * 8);
+        SectionEntry entry{};
+        entry.id = i;
+        entry.offset = offset;
+        entry.size = sections[i].size();
+        entry.checksum = Checksum(sections[i]);
+        Append(table, entry);
+        offset += entry.size;
+    }
+
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output << table;
+    for (const auto& section : sections) {
+        output << section;
+    }
+}
+
+void SheetSnapshot::SaveFile(const Sheet& sheet, const std::string& path) {
+    std::ofstream output(path, std::ios::binary);
+    Save(sheet, output);
+    if (!output) {
+        throw SnapshotError("Cannot write snapshot: " + path);
+    }
+}
+
+std::unique_ptr<Sheet> SheetSnapshot::Load(std::string_view data) {
+    SnapshotReader reader(data);
+    std::string_view cell_section = reader.GetSection(SectionId::Cells);
+    std::string_view texts = reader.GetSection(SectionId::Texts);
+    auto asts = ReadFormulas(reader);
+
+    auto sheet = std::make_unique<Sheet>();
+    size_t cell_count = CountRecords<CellRecord>(cell_section);
+    std::vector<Cell*> cells;
+    cells.reserve(cell_count);
+    for (size_t i = 0; i < cell_count; ++i) {
+        auto record = Read<CellRecord>(cell_section, i);
+        Position pos{record.row, record.col};
+        if (!pos.IsValid() || sheet->cells_.Find(pos) != nullptr) {
+            throw SnapshotError("Snapshot cell position is invalid");
+        }
+        if (record.text_offset > texts.size() || record.text_size > texts.size() - record.text_offset) {
+            throw SnapshotError("Snapshot cell text is out of range");
+        }
+        std::string text(texts.substr(record.text_offset, record.text_size));
+
+        std::unique_ptr<FormulaInterface> formula;
+        std::optional<FormulaInterface::Value> value;
+        if (record.formula != NO_FORMULA) {
+            if (record.formula >= asts.size() || Cell::GetCellType(text) != Cell::FORMULA) {
+                throw SnapshotError("Snapshot cell formula is invalid");
+            }
+            formula = MakeFormula(asts[record.formula], Position{record.anchor_row, record.anchor_col});
+            if (record.value_kind == ValueKind::Number) {
+                value = record.number;
+            } else if (record.value_kind == ValueKind::Error) {
+                if (record.error_category > static_cast<uint8_t>(FormulaError::Category::Arithmetic)) {
+                    throw SnapshotError("Snapshot cell value is invalid");
+                }
+                value = FormulaError(static_cast<FormulaError::Category>(record.error_category));
+            }
+        } else if (Cell::GetCellType(text) == Cell::FORMULA) {
+            throw SnapshotError("Snapshot cell formula is missing");
+        }
+
+        Cell& cell = sheet->cells_.Emplace(pos, sheet.get(), pos);
+        bool has_value = value.has_value();
+        cell.Restore(std::move(text), std::move(formula), std::move(value));
+        if (!cell.GetText().empty()) {
+            sheet->IncreasePrintableSize(pos);
+        }
+        if (cell.GetCellType() == Cell::FORMULA && !has_value) {
+            sheet->dirty_cells_.push_back(&cell);
+        }
+        cells.push_back(&cell);
+    }
+
+    std::string_view dependents = reader.GetSection(SectionId::Dependents);
+    size_t offsets_size = (cell_count + 1) * sizeof(uint64_t);
+    if (dependents.size() < offsets_size) {
+        throw SnapshotError("Snapshot dependency graph is truncated");
+    }
+    std::string_view dependent_indices = dependents.substr(offsets_size);
+    size_t dependent_count = dependent_indices.size() / sizeof(uint32_t);
+    std::vector<uint32_t> cell_dependents;
+    for (size_t i = 0; i < cell_count; ++i) {
+        auto begin = Read<uint64_t>(dependents, i);
+        auto end = Read<uint64_t>(dependents, i + 1);
+        if (begin > end || end > dependent_count) {
+            throw SnapshotError("Snapshot dependency graph is invalid");
+        }
+        cell_dependents.clear();
+        for (uint64_t j = begin; j < end; ++j) {
+            auto dependent = Read<uint32_t>(dependent_indices, j);
+            if (dependent >= cell_count) {
+                throw SnapshotError("Snapshot dependency graph is invalid");
+            }
+            cell_dependents.push_back(dependent);
+        }
+        std::sort(cell_dependents.begin(), cell_dependents.end());
+        if (std::adjacent_find(cell_dependents.begin(), cell_dependents.end()) != cell_dependents.end()) {
+            throw SnapshotError("Snapshot dependency graph is invalid");
+        }
+        for (uint32_t dependent : cell_dependents) {
+            sheet->graph_.AddEdge(sheet->GetGraphNode(cells[i]), sheet->GetGraphNode(cells[dependent]));
+            cells[dependent]->AddLinkTo(cells[i]);
+        }
+    }
+    sheet->graph_.Compact();
+
+    // Связи каждой ячейки должны совпадать с теми, что дали бы её ссылки и
+    // диапазоны, а граф - не иметь циклов: порядок пересчёта строится заново
+    std::vector<Cell*> expected;
+    std::vector<Cell*> links;
+    for (Cell* cell : cells) {
+        expected.clear();
+        for (Position pos : cell->GetReferencedCells()) {
+            Cell* ref_cell = sheet->cells_.Find(pos);
+            if (ref_cell == nullptr) {
+                throw SnapshotError("Snapshot dependency graph is invalid");
+            }
+            expected.push_back(ref_cell);
+        }
+        if (const FormulaInterface* formula = cell->GetFormula()) {
+            sheet->AppendRangeLinks(formula->GetReferencedRanges(), expected);
+        }
+        std::sort(expected.begin(), expected.end());
+        expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+        links = cell->GetLinksTo();
+        std::sort(links.begin(), links.end());
+        if (links != expected) {
+            throw SnapshotError("Snapshot dependency graph is invalid");
+        }
+    }
+    if (!sheet->RebuildTopologicalOrder()) {
+        throw SnapshotError("Snapshot dependency graph has a cycle");
+    }
+    for (Cell* cell : cells) {
+        if (const FormulaInterface* formula = cell->GetFormula()) {
+            sheet->range_index_.Add(cell, formula->GetReferencedRanges());
+        }
+    }
+
+    // Формулы без сохранённого значения пересчитываются вместе с зависимыми
+    std::vector<Cell*> stale = std::move(sheet->dirty_cells_);
+    sheet->dirty_cells_.clear();
+    for (Cell* cell : stale) {
+        sheet->InvalidateFrom(cell);
+    }
+    for (const Cell* cell : cells) {
+        sheet->PublishValue(*cell);
+    }
+    return sheet;
+}
+
+std::unique_ptr<Sheet> SheetSnapshot::LoadFile(const std::string& path) {
+    MappedFile file(path);
+    return Load(file.GetData());
+}
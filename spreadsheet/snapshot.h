@@ -0,0 +1,38 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+class SnapshotError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Двоичный снимок листа. Хранит тексты ячеек, деревья формул в постфиксной
+// форме (общее дерево протянутых формул - один раз), граф зависимых ячеек,
+// топологический порядок и вычисленные значения, поэтому загрузка не разбирает
+// формулы и не пересчитывает лист.
+//
+// Формат версионирован: заголовок, таблица секций и секции с записями
+// фиксированного размера, выровненные на 8 байт, в порядке байтов машины.
+// Каждая секция имеет свою контрольную сумму, которая проверяется при первом
+// чтении секции. Испорченный или чужой снимок даёт SnapshotError.
+class SheetSnapshot {
+public:
+    // 2: диапазоны и вызовы функций в узлах формул
+    static constexpr uint32_t VERSION = 2;
+
+    // Перед записью пересчитывает лист, чтобы сохранить значения всех формул.
+    static void Save(const Sheet& sheet, std::ostream& output);
+    static void SaveFile(const Sheet& sheet, const std::string& path);
+
+    static std::unique_ptr<Sheet> Load(std::string_view data);
+    // Читает снимок из файла, отображённого в память.
+    static std::unique_ptr<Sheet> LoadFile(const std::string& path);
+};
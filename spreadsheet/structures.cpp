@@ -2,13 +2,14 @@
 
 #include <algorithm>
 #include <array>
-#include <cctype>
-#include <cmath>
+#include <charconv>
 #include <sstream>
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
 const int MAX_POS_LETTER_COUNT = 3;
+const int MAX_ROW_DIGITS = 5;
+
+static_assert(Position::MAX_STRING_LENGTH == MAX_POS_LETTER_COUNT + MAX_ROW_DIGITS);
 
 const Position Position::NONE = {-1, -1};
 
@@ -27,100 +28,88 @@ bool Position::IsValid() const {
     return !((row < 0 || col < 0) || (row >= MAX_ROWS || col >= MAX_COLS));
 }
 
-int GetAlphabetCount(std::string_view str) {
-    int i = 0;
-    for (const char& c : str) {
-        if (isdigit(c)) {
-            break;
+namespace {
+// Имя столбца: до MAX_POS_LETTER_COUNT заглавных букв
+struct ColumnName {
+    char letters[MAX_POS_LETTER_COUNT] = {};
+    int length = 0;
+};
+
+constexpr std::array<ColumnName, Position::MAX_COLS> MakeColumnNames() {
+    std::array<ColumnName, Position::MAX_COLS> names{};
+    for (int col = 0; col < Position::MAX_COLS; ++col) {
+        // Запись col + 1 в биективной системе по основанию 26, младшая буква первой
+        char reversed[MAX_POS_LETTER_COUNT] = {};
+        int length = 0;
+        for (int rest = col + 1; rest > 0; rest = (rest - 1) / LETTERS) {
+            reversed[length++] = static_cast<char>('A' + (rest - 1) % LETTERS);
+        }
+        names[col].length = length;
+        for (int i = 0; i < length; ++i) {
+            names[col].letters[i] = reversed[length - 1 - i];
         }
-        ++i;
     }
-
-    return i;
+    return names;
 }
 
-int GetAlphabetCount(int col) {
-    int alphabet_count = 1;
-    if (col - 26 >= 0) {
-        if (col - 26 < 26) {
-            alphabet_count = 2;
-        } else {
-            while (26 <= col - std::pow(26, alphabet_count)) {
-                ++alphabet_count;
-            }
-        }    
-    }
+constexpr std::array<ColumnName, Position::MAX_COLS> COLUMN_NAMES = MakeColumnNames();
 
-    return alphabet_count;
-}
+static_assert(COLUMN_NAMES[25].length == 1 && COLUMN_NAMES[25].letters[0] == 'Z');
+static_assert(COLUMN_NAMES[26].length == 2 && COLUMN_NAMES[26].letters[1] == 'A');
+static_assert(COLUMN_NAMES[Position::MAX_COLS - 1].letters[0] == 'X'
+              && COLUMN_NAMES[Position::MAX_COLS - 1].letters[1] == 'F'
+              && COLUMN_NAMES[Position::MAX_COLS - 1].letters[2] == 'D');
 
-std::string Position::ToString() const {
-    if (!IsValid()) {
-        return "";
-    }
+bool IsUpperLetter(char c) {
+    return c >= 'A' && c <= 'Z';
+}
 
-    std::string col_s;
-    int alphabet_count = GetAlphabetCount(col);
-    int tmp_col = col;
+bool IsDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+}  // namespace
 
-    for (int j = 1; j <= alphabet_count; ++j) {
-        char c = (tmp_col % 26) + 65;
-        col_s = c + col_s;
-        tmp_col = (tmp_col / 26) - 1;
+char* Position::ToChars(char* buffer) const {
+    if (!IsValid()) {
+        return buffer;
     }
 
-    col_s += std::to_string(row + 1);
-
-    return col_s;
+    const ColumnName& name = COLUMN_NAMES[col];
+    buffer = std::copy_n(name.letters, name.length, buffer);
+    return std::to_chars(buffer, buffer + MAX_ROW_DIGITS, row + 1).ptr;
 }
 
-bool SubstrIsValid(std::string_view row, std::string_view col) {
-    bool result = true;
-    bool col_is_alpha = std::all_of(col.begin(), col.end(), [](const char c){
-        return std::isalpha(c);
-    });
-    
-    bool row_is_digit = std::all_of(row.begin(), row.end(), [](const char c){
-        return std::isdigit(c);
-    });
-    
-    bool col_not_valid = std::any_of(col.begin(), col.end(), [](const char c){
-        return !std::isalpha(c) || std::islower(c);
-    });
-
-    
-    try
-    {
-       [[maybe_unused]] int r = std::stoi(row.data());
-    }
-    catch (...) {
-        result = false;
-    }
-    
-    if (col.empty() || row.empty() || !col_is_alpha || !row_is_digit || col_not_valid) {
-        result = false;
-    }
-
-    return result;
+std::string Position::ToString() const {
+    char buffer[MAX_STRING_LENGTH];
+    return std::string(buffer, ToChars(buffer));
 }
 
 Position Position::FromString(std::string_view str) {
-    int alphabet_count = GetAlphabetCount(str);
-
-    std::string col_s = (std::string)str.substr(0, alphabet_count);
-    std::string row_s = (std::string)str.substr(alphabet_count, str.size());
-
-    if (!SubstrIsValid(row_s, col_s)) {
+    size_t i = 0;
+    int col = 0;
+    for (; i < str.size() && IsUpperLetter(str[i]); ++i) {
+        col = col * LETTERS + (str[i] - 'A' + 1);
+        if (col > MAX_COLS) {
+            return NONE;
+        }
+    }
+    if (i == 0 || i == str.size()) {
         return NONE;
     }
 
-    int row = std::stoi(row_s) - 1;
-    int col = 0;
-    for(int i = 0; i < alphabet_count; ++i) {
-        col += ((col_s[i]) - 64) * std::pow(26, (alphabet_count - 1) - i);
+    // Ведущие нули в номере строки допустимы
+    int row = 0;
+    for (; i < str.size(); ++i) {
+        if (!IsDigit(str[i])) {
+            return NONE;
+        }
+        row = row * 10 + (str[i] - '0');
+        if (row > MAX_ROWS) {
+            return NONE;
+        }
     }
 
-    Position pos{row, col - 1};
+    Position pos{row - 1, col - 1};
     if (pos.IsValid()) {
         return pos;
     } else {
@@ -132,6 +121,23 @@ bool Size::operator==(Size rhs) const {
     return rows == rhs.rows && cols == rhs.cols;
 }
 
+bool Range::operator==(Range rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return first.row <= pos.row && pos.row <= last.row && first.col <= pos.col && pos.col <= last.col;
+}
+
+Range Range::FromCorners(Position lhs, Position rhs) {
+    return Range{Position{std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col)},
+                 Position{std::max(lhs.row, rhs.row), std::max(lhs.col, rhs.col)}};
+}
+
 bool Position::EqualTo::operator()(const Position& lhs, const Position& rhs) const {
         return (lhs.row == rhs.row && lhs.col == rhs.col);
 }
@@ -0,0 +1,140 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threads)
+{
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    // Очередь 0 принадлежит вызывающему потоку
+    for (size_t i = 1; i < threads; ++i) {
+        workers_.emplace_back([this, i] {
+            WorkerLoop(i);
+        });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard lock(sleep_mutex_);
+        stop_ = true;
+    }
+    work_available_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::GetThreadCount() const
+{
+    return queues_.size();
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t)>& func)
+{
+    if (count == 0) {
+        return;
+    }
+
+    // Несколько диапазонов на поток, чтобы было что воровать при перекосе
+    size_t range_count = std::min(count, queues_.size() * 4);
+    size_t range_size = (count + range_count - 1) / range_count;
+    range_count = (count + range_size - 1) / range_size;
+
+    func_ = &func;
+    exception_ = nullptr;
+    unfinished_ranges_ = range_count;
+    {
+        // Счётчик выставляется до постановки в очереди, чтобы каждое взятие
+        // диапазона уменьшало уже учтённое значение
+        std::lock_guard lock(sleep_mutex_);
+        queued_ranges_ = range_count;
+    }
+    for (size_t i = 0; i < range_count; ++i) {
+        Range range{i * range_size, std::min(count, (i + 1) * range_size)};
+        Queue& queue = *queues_[i % queues_.size()];
+        std::lock_guard lock(queue.mutex);
+        queue.ranges.push_back(range);
+    }
+    work_available_.notify_all();
+
+    Range range;
+    while (TryTake(0, range)) {
+        Run(range);
+    }
+
+    {
+        std::unique_lock lock(sleep_mutex_);
+        work_done_.wait(lock, [this] {
+            return unfinished_ranges_ == 0;
+        });
+    }
+    func_ = nullptr;
+
+    if (exception_) {
+        std::rethrow_exception(exception_);
+    }
+}
+
+void ThreadPool::WorkerLoop(size_t index)
+{
+    while (true) {
+        Range range;
+        if (TryTake(index, range)) {
+            Run(range);
+            continue;
+        }
+
+        std::unique_lock lock(sleep_mutex_);
+        work_available_.wait(lock, [this] {
+            return stop_ || queued_ranges_ > 0;
+        });
+        if (stop_) {
+            return;
+        }
+    }
+}
+
+bool ThreadPool::TryTake(size_t index, Range& range)
+{
+    for (size_t i = 0; i < queues_.size(); ++i) {
+        Queue& queue = *queues_[(index + i) % queues_.size()];
+        std::lock_guard lock(queue.mutex);
+        if (queue.ranges.empty()) {
+            continue;
+        }
+        // Свои задачи берутся с начала очереди, чужие - с конца
+        if (i == 0) {
+            range = queue.ranges.front();
+            queue.ranges.pop_front();
+        } else {
+            range = queue.ranges.back();
+            queue.ranges.pop_back();
+        }
+        --queued_ranges_;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::Run(Range range)
+{
+    try {
+        for (size_t i = range.begin; i < range.end; ++i) {
+            (*func_)(i);
+        }
+    } catch (...) {
+        std::lock_guard lock(exception_mutex_);
+        if (!exception_) {
+            exception_ = std::current_exception();
+        }
+    }
+
+    if (--unfinished_ranges_ == 0) {
+        std::lock_guard lock(sleep_mutex_);
+        work_done_.notify_all();
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с очередью задач на каждый поток. Поток берёт задачи из своей
+// очереди, а когда она пуста - ворует из чужих. Вызывающий поток тоже
+// участвует в работе, поэтому пул из N потоков держит N - 1 рабочих.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t GetThreadCount() const;
+
+    // Выполняет func(i) для всех i из [0, count) и дожидается завершения.
+    // Первое исключение из func пробрасывается вызывающему после завершения
+    // остальных задач. Вызовы не должны пересекаться.
+    void ParallelFor(size_t count, const std::function<void(size_t)>& func);
+
+private:
+    struct Range {
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Range> ranges;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    const std::function<void(size_t)>* func_ = nullptr;
+    std::atomic<size_t> queued_ranges_{0};
+    std::atomic<size_t> unfinished_ranges_{0};
+
+    std::mutex sleep_mutex_;
+    std::condition_variable work_available_;
+    std::condition_variable work_done_;
+    bool stop_ = false;
+
+    std::mutex exception_mutex_;
+    std::exception_ptr exception_;
+
+    void WorkerLoop(size_t index);
+    // Берёт диапазон из своей очереди, иначе ворует из чужих
+    bool TryTake(size_t index, Range& range);
+    void Run(Range range);
+};
@@ -0,0 +1,251 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+inline int CountTrailingZeros(std::uint64_t mask) {
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanForward64(&index, mask);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(mask);
+#endif
+}
+
+// Хранилище элементов листа, разбитое на квадратные плитки TILE_SIZE x TILE_SIZE.
+// Плитка выделяется при первой записи в любую из её позиций, внутри плитки
+// элементы лежат построчно. Занятость позиций хранится битовой маской на каждую
+// строку плитки.
+// Объект в позиции конструируется при первом Emplace и живёт, пока жива его
+// плитка: Erase только помечает позицию свободной, а плитки, в которых не
+// осталось занятых позиций, освобождает ReleaseEmptyTiles. Поэтому указатели
+// на элементы остаются действительными до ближайшего ReleaseEmptyTiles.
+template <typename T>
+class TiledStorage {
+public:
+    static constexpr int TILE_SIZE = 64;
+
+    TiledStorage() = default;
+    TiledStorage(const TiledStorage&) = delete;
+    TiledStorage& operator=(const TiledStorage&) = delete;
+
+    // Возвращает элемент в занятой позиции либо nullptr.
+    T* Find(Position pos) {
+        Tile* tile = FindTile(pos);
+        if (tile == nullptr || !tile->IsOccupied(pos.row % TILE_SIZE, pos.col % TILE_SIZE)) {
+            return nullptr;
+        }
+        return tile->Get(pos.row % TILE_SIZE, pos.col % TILE_SIZE);
+    }
+
+    const T* Find(Position pos) const {
+        return const_cast<TiledStorage*>(this)->Find(pos);
+    }
+
+    // Занимает позицию и возвращает элемент в ней. Если объект в позиции ещё
+    // не создавался, он конструируется из args, иначе args игнорируются.
+    template <typename... Args>
+    T& Emplace(Position pos, Args&&... args) {
+        Tile& tile = GetOrCreateTile(pos);
+        int row = pos.row % TILE_SIZE;
+        int col = pos.col % TILE_SIZE;
+        if (!tile.IsConstructed(row, col)) {
+            new (tile.Get(row, col)) T(std::forward<Args>(args)...);
+            tile.constructed[row] |= Bit(col);
+        }
+        if (!tile.IsOccupied(row, col)) {
+            tile.occupied[row] |= Bit(col);
+            ++tile.occupied_count;
+            ++size_;
+        }
+        return *tile.Get(row, col);
+    }
+
+    void Erase(Position pos) {
+        Tile* tile = FindTile(pos);
+        int row = pos.row % TILE_SIZE;
+        int col = pos.col % TILE_SIZE;
+        if (tile != nullptr && tile->IsOccupied(row, col)) {
+            tile->occupied[row] &= ~Bit(col);
+            --size_;
+            if (--tile->occupied_count == 0) {
+                empty_tiles_.emplace_back(pos.row / TILE_SIZE, pos.col / TILE_SIZE);
+            }
+        }
+    }
+
+    // Освобождает плитки, ставшие пустыми после Erase, вместе с объектами в
+    // них. Указатели на элементы освобождённых плиток становятся
+    // недействительными.
+    void ReleaseEmptyTiles() {
+        for (auto [tile_row, tile_col] : empty_tiles_) {
+            auto& tile = tiles_[tile_row][tile_col];
+            // Плитку могли снова занять после Erase
+            if (tile != nullptr && tile->occupied_count == 0) {
+                tile.reset();
+            }
+        }
+        empty_tiles_.clear();
+    }
+
+    // Количество занятых позиций.
+    size_t Size() const {
+        return size_;
+    }
+
+    // Обходит занятые позиции построчно: f(Position, T&).
+    template <typename Func>
+    void ForEach(Func&& f) {
+        for (size_t tile_row = 0; tile_row < tiles_.size(); ++tile_row) {
+            const auto& band = tiles_[tile_row];
+            for (int row = 0; row < TILE_SIZE; ++row) {
+                for (size_t tile_col = 0; tile_col < band.size(); ++tile_col) {
+                    Tile* tile = band[tile_col].get();
+                    if (tile == nullptr) {
+                        continue;
+                    }
+                    for (std::uint64_t mask = tile->occupied[row]; mask != 0; mask &= mask - 1) {
+                        int col = CountTrailingZeros(mask);
+                        f(Position{static_cast<int>(tile_row) * TILE_SIZE + row,
+                                   static_cast<int>(tile_col) * TILE_SIZE + col},
+                          *tile->Get(row, col));
+                    }
+                }
+            }
+        }
+    }
+
+    template <typename Func>
+    void ForEach(Func&& f) const {
+        const_cast<TiledStorage*>(this)->ForEach([&f](Position pos, const T& item) {
+            f(pos, item);
+        });
+    }
+
+    // Обходит занятые позиции прямоугольника от first до last включительно
+    // построчно: f(Position, T&). Свободные плитки пропускаются целиком.
+    template <typename Func>
+    void ForEachInRange(Position first, Position last, Func&& f) {
+        size_t first_tile_col = first.col / TILE_SIZE;
+        size_t last_tile_col = last.col / TILE_SIZE;
+        for (int row = first.row; row <= last.row; ++row) {
+            size_t tile_row = row / TILE_SIZE;
+            if (tile_row >= tiles_.size()) {
+                break;
+            }
+            const auto& band = tiles_[tile_row];
+            if (band.size() <= first_tile_col) {
+                // В полосе нет плиток диапазона: переход к следующей полосе
+                row = static_cast<int>(tile_row + 1) * TILE_SIZE - 1;
+                continue;
+            }
+            int row_in_tile = row % TILE_SIZE;
+            for (size_t tile_col = first_tile_col; tile_col <= last_tile_col && tile_col < band.size(); ++tile_col) {
+                Tile* tile = band[tile_col].get();
+                if (tile == nullptr) {
+                    continue;
+                }
+                int first_col = tile_col == first_tile_col ? first.col % TILE_SIZE : 0;
+                int last_col = tile_col == last_tile_col ? last.col % TILE_SIZE : TILE_SIZE - 1;
+                std::uint64_t columns = (~std::uint64_t{0} << first_col)
+                                        & (~std::uint64_t{0} >> (TILE_SIZE - 1 - last_col));
+                for (std::uint64_t mask = tile->occupied[row_in_tile] & columns; mask != 0; mask &= mask - 1) {
+                    int col = CountTrailingZeros(mask);
+                    f(Position{row, static_cast<int>(tile_col) * TILE_SIZE + col}, *tile->Get(row_in_tile, col));
+                }
+            }
+        }
+    }
+
+    template <typename Func>
+    void ForEachInRange(Position first, Position last, Func&& f) const {
+        const_cast<TiledStorage*>(this)->ForEachInRange(first, last, [&f](Position pos, const T& item) {
+            f(pos, item);
+        });
+    }
+
+private:
+    struct alignas(T) Slot {
+        unsigned char data[sizeof(T)];
+    };
+
+    struct Tile {
+        // Пользовательский конструктор, чтобы make_unique не обнулял слоты
+        Tile() {
+        }
+
+        ~Tile() {
+            for (int row = 0; row < TILE_SIZE; ++row) {
+                for (std::uint64_t mask = constructed[row]; mask != 0; mask &= mask - 1) {
+                    Get(row, CountTrailingZeros(mask))->~T();
+                }
+            }
+        }
+
+        bool IsOccupied(int row, int col) const {
+            return (occupied[row] & Bit(col)) != 0;
+        }
+
+        bool IsConstructed(int row, int col) const {
+            return (constructed[row] & Bit(col)) != 0;
+        }
+
+        T* Get(int row, int col) {
+            return std::launder(reinterpret_cast<T*>(slots[row * TILE_SIZE + col].data));
+        }
+
+        std::array<std::uint64_t, TILE_SIZE> occupied{};
+        std::array<std::uint64_t, TILE_SIZE> constructed{};
+        int occupied_count = 0;
+        std::array<Slot, TILE_SIZE * TILE_SIZE> slots;
+    };
+
+    static_assert(TILE_SIZE == 64, "occupancy masks are 64-bit words");
+
+    static std::uint64_t Bit(int col) {
+        return std::uint64_t{1} << col;
+    }
+
+    Tile* FindTile(Position pos) const {
+        size_t tile_row = pos.row / TILE_SIZE;
+        size_t tile_col = pos.col / TILE_SIZE;
+        if (tile_row >= tiles_.size() || tile_col >= tiles_[tile_row].size()) {
+            return nullptr;
+        }
+        return tiles_[tile_row][tile_col].get();
+    }
+
+    Tile& GetOrCreateTile(Position pos) {
+        size_t tile_row = pos.row / TILE_SIZE;
+        size_t tile_col = pos.col / TILE_SIZE;
+        if (tile_row >= tiles_.size()) {
+            tiles_.resize(tile_row + 1);
+        }
+        auto& band = tiles_[tile_row];
+        if (tile_col >= band.size()) {
+            band.resize(tile_col + 1);
+        }
+        if (band[tile_col] == nullptr) {
+            band[tile_col] = std::make_unique<Tile>();
+        }
+        return *band[tile_col];
+    }
+
+    // tiles_[tile_row][tile_col]; полосы растут по мере записи
+    std::vector<std::vector<std::unique_ptr<Tile>>> tiles_;
+    size_t size_ = 0;
+    // Плитки, опустевшие после Erase: (tile_row, tile_col)
+    std::vector<std::pair<size_t, size_t>> empty_tiles_;
+};
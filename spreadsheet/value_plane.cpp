@@ -0,0 +1,112 @@
+#include "value_plane.h"
+
+#include "tiled_storage.h"
+
+namespace {
+std::uint64_t Bit(int row)
+{
+    return std::uint64_t{1} << row;
+}
+
+// Биты строк от first до last включительно
+std::uint64_t RowMask(int first, int last)
+{
+    return (~std::uint64_t{0} << first) & (~std::uint64_t{0} >> (ValuePlane::TILE_SIZE - 1 - last));
+}
+}  // namespace
+
+void ValuePlane::SetNumber(Position pos, double value)
+{
+    Tile& tile = GetOrCreateTile(pos);
+    int row = pos.row % TILE_SIZE;
+    int col = pos.col % TILE_SIZE;
+    tile.values[col * TILE_SIZE + row] = value;
+    tile.numbers[col] |= Bit(row);
+    tile.others[col] &= ~Bit(row);
+}
+
+void ValuePlane::SetOther(Position pos)
+{
+    Tile& tile = GetOrCreateTile(pos);
+    int row = pos.row % TILE_SIZE;
+    int col = pos.col % TILE_SIZE;
+    tile.numbers[col] &= ~Bit(row);
+    tile.others[col] |= Bit(row);
+}
+
+void ValuePlane::Erase(Position pos)
+{
+    if (Tile* tile = FindTile(pos)) {
+        int row = pos.row % TILE_SIZE;
+        int col = pos.col % TILE_SIZE;
+        tile->numbers[col] &= ~Bit(row);
+        tile->others[col] &= ~Bit(row);
+    }
+}
+
+bool ValuePlane::ReadNumbers(Position first, Position last, std::vector<double>& values) const
+{
+    size_t old_size = values.size();
+    size_t first_tile_row = first.row / TILE_SIZE;
+    size_t first_tile_col = first.col / TILE_SIZE;
+    size_t last_tile_row = last.row / TILE_SIZE;
+    size_t last_tile_col = last.col / TILE_SIZE;
+    for (size_t tile_row = first_tile_row; tile_row <= last_tile_row && tile_row < tiles_.size(); ++tile_row) {
+        const auto& band = tiles_[tile_row];
+        int first_row = tile_row == first_tile_row ? first.row % TILE_SIZE : 0;
+        int last_row = tile_row == last_tile_row ? last.row % TILE_SIZE : TILE_SIZE - 1;
+        std::uint64_t rows = RowMask(first_row, last_row);
+        for (size_t tile_col = first_tile_col; tile_col <= last_tile_col && tile_col < band.size(); ++tile_col) {
+            const Tile* tile = band[tile_col].get();
+            if (tile == nullptr) {
+                continue;
+            }
+            int first_col = tile_col == first_tile_col ? first.col % TILE_SIZE : 0;
+            int last_col = tile_col == last_tile_col ? last.col % TILE_SIZE : TILE_SIZE - 1;
+            for (int col = first_col; col <= last_col; ++col) {
+                if ((tile->others[col] & rows) != 0) {
+                    values.resize(old_size);
+                    return false;
+                }
+                const double* column = tile->values.data() + col * TILE_SIZE;
+                std::uint64_t numbers = tile->numbers[col] & rows;
+                if (numbers == rows) {
+                    // Сплошной отрезок столбца копируется целиком
+                    values.insert(values.end(), column + first_row, column + last_row + 1);
+                    continue;
+                }
+                for (; numbers != 0; numbers &= numbers - 1) {
+                    values.push_back(column[CountTrailingZeros(numbers)]);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+ValuePlane::Tile* ValuePlane::FindTile(Position pos) const
+{
+    size_t tile_row = pos.row / TILE_SIZE;
+    size_t tile_col = pos.col / TILE_SIZE;
+    if (tile_row >= tiles_.size() || tile_col >= tiles_[tile_row].size()) {
+        return nullptr;
+    }
+    return tiles_[tile_row][tile_col].get();
+}
+
+ValuePlane::Tile& ValuePlane::GetOrCreateTile(Position pos)
+{
+    size_t tile_row = pos.row / TILE_SIZE;
+    size_t tile_col = pos.col / TILE_SIZE;
+    if (tile_row >= tiles_.size()) {
+        tiles_.resize(tile_row + 1);
+    }
+    auto& band = tiles_[tile_row];
+    if (tile_col >= band.size()) {
+        band.resize(tile_col + 1);
+    }
+    if (band[tile_col] == nullptr) {
+        band[tile_col] = std::make_unique<Tile>();
+    }
+    return *band[tile_col];
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Числовые значения ячеек листа, сложенные по столбцам отдельно от самих
+// ячеек. Лист разбит на плитки TILE_SIZE x TILE_SIZE, как в TiledStorage;
+// внутри плитки значения столбца лежат подряд, а состояние позиций хранят две
+// битовые маски на столбец. Позиция либо пуста (свёртки её пропускают), либо
+// хранит число, либо помечена как прочая: ошибка или ещё не вычисленная
+// формула, значение которой нужно брать из самой ячейки.
+class ValuePlane {
+public:
+    static constexpr int TILE_SIZE = 64;
+
+    void SetNumber(Position pos, double value);
+    void SetOther(Position pos);
+    void Erase(Position pos);
+
+    // Добавляет в values числа непустых позиций прямоугольника от first до
+    // last включительно, по столбцам каждой плитки. Если в прямоугольнике есть
+    // прочие позиции, возвращает false и оставляет values прежним.
+    bool ReadNumbers(Position first, Position last, std::vector<double>& values) const;
+
+private:
+    struct Tile {
+        // Пользовательский конструктор, чтобы make_unique не обнулял значения
+        Tile() {
+        }
+
+        std::array<std::uint64_t, TILE_SIZE> numbers{};
+        std::array<std::uint64_t, TILE_SIZE> others{};
+        // values[col * TILE_SIZE + row]
+        std::array<double, TILE_SIZE * TILE_SIZE> values;
+    };
+
+    static_assert(TILE_SIZE == 64, "state masks are 64-bit words");
+
+    Tile* FindTile(Position pos) const;
+    Tile& GetOrCreateTile(Position pos);
+
+    // tiles_[tile_row][tile_col]; полосы растут по мере записи
+    std::vector<std::vector<std::unique_ptr<Tile>>> tiles_;
+};